@@ -0,0 +1,101 @@
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "interpreter.h"
+
+/*
+Compare the execution engines on one long-running loop program. For each engine it reports the wall time and, when the kernel allows
+perf events, the number of branch instructions and branch misses.
+
+Usage: dispatch_bench [instruction_file] [iterations] [runs]
+*/
+
+/* Open a hardware counter for this thread, or return -1 if unavailable */
+static int open_counter(unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_counter(int fd) {
+  long long value = -1;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+  return value;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+  const char *filename = argc > 1 ? argv[1] : "bench/loop.txt";
+  int iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+  int runs = argc > 3 ? atoi(argv[3]) : 5;
+  const char *names[] = {"switch", "threaded", "jit", "aot"};
+
+  static System loaded, sys;
+  initialize_system(&loaded);
+  if (load_instructions_from_file(&loaded, filename) > 0 ||
+      copy_system(&sys, &loaded) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  int branches = open_counter(PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+  int misses = open_counter(PERF_COUNT_HW_BRANCH_MISSES);
+
+  printf("%-10s %12s %16s %16s %10s\n", "engine", "seconds", "branches",
+         "branch-misses", "miss-rate");
+  for (int engine = ENGINE_SWITCH; engine <= ENGINE_AOT; engine++) {
+    double best = 1e30;
+    long long best_branches = -1, best_misses = -1;
+
+    for (int run = 0; run < runs; run++) {
+      reset_system(&sys);
+      sys.registers[ECX] = iterations;
+
+      if (branches >= 0) ioctl(branches, PERF_EVENT_IOC_RESET, 0);
+      if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_RESET, 0);
+      if (branches >= 0) ioctl(branches, PERF_EVENT_IOC_ENABLE, 0);
+      if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+      double start = now_seconds();
+      execute_with_engine(&sys, (Engine)engine);
+      double elapsed = now_seconds() - start;
+      if (branches >= 0) ioctl(branches, PERF_EVENT_IOC_DISABLE, 0);
+      if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+
+      if (sys.registers[EAX] != iterations) {
+        fprintf(stderr, "%s: wrong result EAX=%d\n", names[engine],
+                sys.registers[EAX]);
+        return EXIT_FAILURE;
+      }
+      if (elapsed < best) {
+        best = elapsed;
+        best_branches = read_counter(branches);
+        best_misses = read_counter(misses);
+      }
+    }
+
+    if (best_branches >= 0 && best_misses >= 0) {
+      printf("%-10s %12.6f %16lld %16lld %9.2f%%\n", names[engine], best,
+             best_branches, best_misses,
+             100.0 * best_misses / (best_branches ? best_branches : 1));
+    } else {
+      printf("%-10s %12.6f %16s %16s %10s\n", names[engine], best, "n/a", "n/a",
+             "n/a");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "interpreter.h"
+#include "program_file.h"
+
+/*
+Measure how fast programs are loaded. A generated program of the given number
+of megabytes is loaded with load_program, which maps the file, copies its lines
+into the image and decodes them. Decoding is timed on its own as well, so that
+the time spent on the text can be compared with reading it line by line with
+fgets into a 256-byte buffer, the way the loader used to. Last, the program is
+mapped from the program file cache, as assembly_app does for a program it has
+loaded before. Each row reports the best time of the runs, in MB/s (of source)
+and lines per second.
+
+Usage: load_bench [megabytes] [runs]
+*/
+
+int reformat(char *line);
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Write a program of about megabytes MB of counting loops, with the odd extra
+ * space that the loader has to squeeze out. Returns the number of lines */
+static long write_program(FILE *file, int megabytes) {
+  long lines = 0, bytes = 0, target = (long)megabytes << 20;
+  for (int loop = 0; bytes < target; loop++) {
+    bytes += fprintf(file, ".L%d\n", loop);
+    bytes += fprintf(file, "  ADDL $1 %%EAX\n");
+    bytes += fprintf(file, "MOVL %%EAX  -%d(%%EBP)\n", 4 * (loop % 64));
+    bytes += fprintf(file, "CMPL %%ECX %%EAX\n");
+    bytes += fprintf(file, "JL .L%d\n", loop);
+    lines += 5;
+  }
+  fprintf(file, "END\n");
+  return lines + 1;
+}
+
+/* The line by line loader, for reference: fgets, reformat and strdup */
+static int load_lines(const char *filename, char **lines, long max_lines) {
+  FILE *file = fopen(filename, "r");
+  if (!file) return -1;
+  char line[256];
+  long count = 0;
+  while (count < max_lines && fgets(line, sizeof(line), file) != NULL) {
+    line[strlen(line) - 1] = '\0';
+    if (reformat(line) > 0) lines[count++] = strdup(line);
+  }
+  fclose(file);
+  for (long i = 0; i < count; i++) free(lines[i]);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int megabytes = argc > 1 ? atoi(argv[1]) : 32;
+  int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+  char path[] = "/tmp/load_benchXXXXXX";
+  int fd = mkstemp(path);
+  FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (file == NULL) {
+    perror("Error creating program");
+    return EXIT_FAILURE;
+  }
+  long lines = write_program(file, megabytes);
+  double megabytes_written = ftell(file) / (1024.0 * 1024.0);
+  fclose(file);
+
+  // a cache of its own, removed again at the end
+  char cache[] = "/tmp/load_bench_cacheXXXXXX";
+  if (mkdtemp(cache) == NULL) {
+    perror("Error creating cache");
+    return EXIT_FAILURE;
+  }
+  setenv("ASSEMBLY_PROGRAM_CACHE", cache, 1);
+
+  System sys;
+  initialize_system(&sys);
+  double best_mapped = 1e30, best_decode = 1e30, best_lines = 1e30;
+  double best_cached = 1e30;
+  char **reference = (char **)malloc(lines * sizeof(char *));
+  for (int run = 0; run < runs; run++) {
+    double start = now_seconds();
+    Program *program = load_program(path);
+    double elapsed = now_seconds() - start;
+    if (program == NULL || program->num_instructions != lines) {
+      fprintf(stderr, "load_program: wrong number of lines\n");
+      unlink(path);
+      return EXIT_FAILURE;
+    }
+    if (elapsed < best_mapped) best_mapped = elapsed;
+
+    // decode the image again to see how much of the load it takes
+    attach_program(&sys, program);
+    release_program(program);
+    start = now_seconds();
+    decode_instructions(&sys);
+    elapsed = now_seconds() - start;
+    if (elapsed < best_decode) best_decode = elapsed;
+
+    start = now_seconds();
+    load_lines(path, reference, lines);
+    elapsed = now_seconds() - start;
+    if (elapsed < best_lines) best_lines = elapsed;
+
+    // the first run fills the cache
+    release_program(load_program_cached(path));
+    start = now_seconds();
+    program = load_program_cached(path);
+    elapsed = now_seconds() - start;
+    if (program == NULL || program->mapping == NULL) {
+      fprintf(stderr, "load_program_cached: not mapped from the cache\n");
+      unlink(path);
+      return EXIT_FAILURE;
+    }
+    release_program(program);
+    if (elapsed < best_cached) best_cached = elapsed;
+  }
+  free(reference);
+  destroy_system(&sys);
+  unlink(path);
+  char command[4096];
+  snprintf(command, sizeof(command), "rm -rf %s", cache);
+  if (system(command) != 0) fprintf(stderr, "Error removing %s\n", cache);
+
+  printf("%.1f MB, %ld lines\n", megabytes_written, lines);
+  printf("%-14s %12s %12s %14s\n", "loader", "seconds", "MB/s", "lines/s");
+  printf("%-14s %12.6f %12.1f %14.0f\n", "load_program", best_mapped,
+         megabytes_written / best_mapped, lines / best_mapped);
+  printf("%-14s %12.6f %12.1f %14.0f\n", "decode", best_decode,
+         megabytes_written / best_decode, lines / best_decode);
+  double text = best_mapped - best_decode;
+  printf("%-14s %12.6f %12.1f %14.0f\n", "text", text,
+         megabytes_written / text, lines / text);
+  printf("%-14s %12.6f %12.1f %14.0f\n", "fgets", best_lines,
+         megabytes_written / best_lines, lines / best_lines);
+  printf("%-14s %12.6f %12.1f %14.0f\n", "cached", best_cached,
+         megabytes_written / best_cached, lines / best_cached);
+  return 0;
+}
@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "interpreter.h"
+#include "server.h"
+
+/*
+Load generator for the interpreter server. A number of clients connect to the
+server at once; each sends the program text once, and then runs it by id, one
+request at a time, with ECX counting up from 0 to 99. It reports the requests
+per second of all clients together and the latency of a round trip, against
+starting assembly_app for every run the way jobs did before. Without a socket,
+a server is started in this process on a socket of its own.
+
+Usage: server_bench [instruction_file] [requests] [clients] [socket]
+*/
+
+typedef struct Client {
+  const char *socket_path;
+  const char *text;
+  int text_bytes;
+  int requests;
+  double *latencies;  // seconds of each request
+  int failed;
+} Client;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct OwnServer {
+  Server *server;
+  const char *socket_path;
+} OwnServer;
+
+static void *serve(void *arg) {
+  OwnServer *own = (OwnServer *)arg;
+  if (run_server(own->server, own->socket_path) != 0) {
+    perror("Error serving");
+    exit(EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static void *client_thread(void *arg) {
+  Client *client = (Client *)arg;
+  int fd = -1;
+  for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+    fd = connect_server(client->socket_path);
+    if (fd < 0) usleep(10000);  // the server may still be starting
+  }
+  ServerRequest request = {0, client->text_bytes, 0, 0, 0, 0, 0};
+  ServerResponse response;
+  if (fd < 0 || send_server_request(fd, &request, client->text) != 0 ||
+      read_server_response(fd, &response) != 0 ||
+      response.status != SERVER_OK) {
+    client->failed = 1;
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  request.program = response.program;
+  request.text_bytes = 0;
+  request.run = 1;
+  for (int i = 0; i < client->requests; i++) {
+    request.ecx = i % 100;
+    double start = now_seconds();
+    if (send_server_request(fd, &request, NULL) != 0 ||
+        read_server_response(fd, &response) != 0 ||
+        response.status != SERVER_OK) {
+      client->failed = 1;
+      break;
+    }
+    client->latencies[i] = now_seconds() - start;
+  }
+  close(fd);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Seconds a run of assembly_app takes from start to exit, best of runs, or -1
+ * if it cannot be started */
+static double spawn_seconds(const char *filename, int runs) {
+  double best = -1;
+  for (int run = 0; run < runs; run++) {
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+      execl("./assembly_app", "assembly_app", filename, (char *)NULL);
+      _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      return -1;
+    }
+    double elapsed = now_seconds() - start;
+    if (best < 0 || elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  const char *filename = argc > 1 ? argv[1] : "bench/loop.txt";
+  int requests = argc > 2 ? atoi(argv[2]) : 20000;
+  int num_clients = argc > 3 ? atoi(argv[3]) : 4;
+  const char *socket_path = argc > 4 ? argv[4] : NULL;
+
+  int text_bytes;
+  char *text = read_program_text(filename, &text_bytes);
+  if (text == NULL) {
+    perror("Error opening file");
+    return EXIT_FAILURE;
+  }
+
+  // a server of our own, on a socket in a directory of its own
+  char directory[] = "/tmp/server_benchXXXXXX";
+  char own_socket[64];
+  OwnServer own;
+  if (socket_path == NULL) {
+    if (mkdtemp(directory) == NULL) {
+      perror("Error creating socket directory");
+      return EXIT_FAILURE;
+    }
+    snprintf(own_socket, sizeof(own_socket), "%s/socket", directory);
+    socket_path = own_socket;
+    own.socket_path = own_socket;
+    own.server = create_server(MEMORY_SIZE);
+    pthread_t thread;
+    if (own.server == NULL || pthread_create(&thread, NULL, serve, &own) != 0) {
+      perror("Error starting server");
+      return EXIT_FAILURE;
+    }
+    pthread_detach(thread);
+  }
+
+  Client *clients = (Client *)calloc(num_clients, sizeof(Client));
+  pthread_t *threads = (pthread_t *)malloc(num_clients * sizeof(pthread_t));
+  double *latencies = (double *)malloc(num_clients * requests * sizeof(double));
+  double start = now_seconds();
+  for (int i = 0; i < num_clients; i++) {
+    clients[i].socket_path = socket_path;
+    clients[i].text = text;
+    clients[i].text_bytes = text_bytes;
+    clients[i].requests = requests;
+    clients[i].latencies = latencies + (size_t)i * requests;
+    pthread_create(&threads[i], NULL, client_thread, &clients[i]);
+  }
+  int failed = 0;
+  for (int i = 0; i < num_clients; i++) {
+    pthread_join(threads[i], NULL);
+    failed |= clients[i].failed;
+  }
+  double elapsed = now_seconds() - start;
+  if (socket_path == own_socket) {
+    unlink(own_socket);
+    rmdir(directory);
+  }
+  if (failed) {
+    fprintf(stderr, "A client failed\n");
+    return EXIT_FAILURE;
+  }
+
+  int total = num_clients * requests;
+  qsort(latencies, total, sizeof(double), compare_doubles);
+  double spawned = spawn_seconds(filename, 20);
+  printf("%s: %d clients, %d requests each\n", filename, num_clients, requests);
+  printf("%-14s %14s %12s %12s\n", "", "requests/s", "p50 us", "p99 us");
+  printf("%-14s %14.0f %12.1f %12.1f\n", "server", total / elapsed,
+         latencies[total / 2] * 1e6, latencies[total * 99 / 100] * 1e6);
+  if (spawned > 0) {
+    printf("%-14s %14.0f %12.1f %12s\n", "assembly_app", 1 / spawned,
+           spawned * 1e6, "-");
+  }
+  free(latencies);
+  free(threads);
+  free(clients);
+  free(text);
+  return 0;
+}
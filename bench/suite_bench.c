@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "interpreter.h"
+
+/*
+Benchmark suite: run a corpus of generated workload programs on every
+execution engine, and report instructions per second, nanoseconds per
+instruction and the time to load each program. Each workload stresses one kind
+of code:
+- addl_loop: a tight loop of register ADDLs
+- recursion: deep CALL/RET recursion
+- stack: PUSHL/POPL traffic
+- memory: memory operands on every instruction
+- branches: data-dependent conditional jumps
+
+Every workload loops ECX times. The number of instructions a run executes is
+counted once by stepping through it with execute_decoded (labels are not
+counted), and every engine must finish with the same registers as that run. Times are the best of the runs, after one warm-up run that also fills
+the AOT cache.
+
+Results are printed as a table and written to the output file as JSON, one
+object per workload and engine, so that runs of different versions can be
+compared.
+
+Usage: suite_bench [output_file] [iterations] [runs]
+*/
+
+#define SUITE_MEMORY_SIZE (1 << 20)  // words, room for deep recursion
+
+typedef struct Workload {
+  const char *name;
+  const char *source;
+} Workload;
+
+static const Workload workloads[] = {
+    {"addl_loop",
+     "MOVL $0 %EAX\n"
+     ".LOOP\n"
+     "ADDL $1 %EAX\n"
+     "ADDL $3 %EDX\n"
+     "ADDL %EAX %EDX\n"
+     "ADDL $-2 %EDX\n"
+     "CMPL %ECX %EAX\n"
+     "JL .LOOP\n"
+     "END\n"},
+    {"recursion",
+     "JMP .MAIN\n"
+     ".DOWN\n"
+     "CMPL $0 %EDX\n"
+     "JE .BOTTOM\n"
+     "ADDL $-1 %EDX\n"
+     "CALL .DOWN\n"
+     ".BOTTOM\n"
+     "RET\n"
+     ".MAIN\n"
+     "MOVL $0 %EAX\n"
+     ".LOOP\n"
+     "MOVL $1000 %EDX\n"
+     "CALL .DOWN\n"
+     "ADDL $1000 %EAX\n"
+     "CMPL %ECX %EAX\n"
+     "JL .LOOP\n"
+     "END\n"},
+    {"stack",
+     "MOVL $0 %EAX\n"
+     ".LOOP\n"
+     "PUSHL %EAX\n"
+     "PUSHL %EDX\n"
+     "POPL %EDX\n"
+     "POPL %EDX\n"
+     "PUSHL %ECX\n"
+     "PUSHL %EDX\n"
+     "ADDL $1 %EAX\n"
+     "POPL %EDX\n"
+     "POPL %ECX\n"
+     "CMPL %ECX %EAX\n"
+     "JL .LOOP\n"
+     "END\n"},
+    {"memory",
+     "MOVL $0 %EAX\n"
+     "MOVL $0 -12(%EBP)\n"
+     ".LOOP\n"
+     "MOVL %EAX -4(%EBP)\n"
+     "ADDL -4(%EBP) %EDX\n"
+     "MOVL %EDX -8(%EBP)\n"
+     "ADDL $1 -12(%EBP)\n"
+     "MOVL -12(%EBP) %EAX\n"
+     "ADDL -8(%EBP) %EDX\n"
+     "CMPL %ECX -12(%EBP)\n"
+     "JL .LOOP\n"
+     "END\n"},
+    {"branches",
+     "MOVL $0 %EAX\n"
+     "MOVL $0 %EDX\n"
+     "MOVL $0 -4(%EBP)\n"
+     ".LOOP\n"
+     "ADDL $1 %EDX\n"
+     "CMPL $3 %EDX\n"
+     "JL .MOD3\n"
+     "MOVL $0 %EDX\n"
+     ".MOD3\n"
+     "ADDL $1 -4(%EBP)\n"
+     "CMPL $5 -4(%EBP)\n"
+     "JNE .MOD5\n"
+     "MOVL $0 -4(%EBP)\n"
+     ".MOD5\n"
+     "CMPL $1 %EDX\n"
+     "JE .ONE\n"
+     "JG .TWO\n"
+     "CMPL $2 -4(%EBP)\n"
+     "JL .NEXT\n"
+     "JMP .NEXT\n"
+     ".ONE\n"
+     "CMPL $4 -4(%EBP)\n"
+     "JE .NEXT\n"
+     "JMP .NEXT\n"
+     ".TWO\n"
+     "CMPL $0 -4(%EBP)\n"
+     "JNE .NEXT\n"
+     ".NEXT\n"
+     "ADDL $1 %EAX\n"
+     "CMPL %ECX %EAX\n"
+     "JL .LOOP\n"
+     "END\n"},
+};
+
+static const char *engine_names[] = {"switch", "threaded", "jit", "aot",
+                                     "lockstep"};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Write the source of the workload to a temporary file, and load it. The load
+ * time goes to *load_seconds. Returns NULL if it cannot be loaded */
+static Program *load_workload(const Workload *workload, double *load_seconds) {
+  char path[] = "/tmp/suite_benchXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return NULL;
+  size_t length = strlen(workload->source);
+  int written = write(fd, workload->source, length) == (ssize_t)length;
+  close(fd);
+
+  Program *program = NULL;
+  if (written) {
+    double start = now_seconds();
+    program = load_program(path);
+    *load_seconds = now_seconds() - start;
+  }
+  unlink(path);
+  return program;
+}
+
+/* Number of instructions one run executes, stepping through it one at a time
+ * the way execute_instructions does */
+static long long count_instructions(System *sys) {
+  long long count = 0;
+  for (;;) {
+    int instruction_idx = sys->registers[EIP] / 4;
+    if (instruction_idx < 0 ||
+        instruction_idx >= sys->memory.num_instructions) {
+      break;
+    }
+    const Instruction *inst = &sys->memory.code[instruction_idx];
+    if (inst->opcode == OP_END) break;
+    if (inst->opcode != OP_NOP) count++;
+    if (execute_decoded(sys, inst) != SUCCESS) break;
+  }
+  return count;
+}
+
+static void start_run(System *sys, int iterations) {
+  reset_system(sys);
+  sys->registers[ECX] = iterations;
+}
+
+int main(int argc, char *argv[]) {
+  const char *output = argc > 1 ? argv[1] : "bench_results.json";
+  int iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+  int runs = argc > 3 ? atoi(argv[3]) : 3;
+  int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+  int failed = 0;
+
+  FILE *out = fopen(output, "w");
+  if (out == NULL) {
+    perror("Error opening output file");
+    return EXIT_FAILURE;
+  }
+  fprintf(out, "{\"iterations\": %d, \"runs\": %d, \"results\": [", iterations,
+          runs);
+
+  printf("%-10s %-9s %14s %12s %14s %10s %12s\n", "workload", "engine",
+         "instructions", "seconds", "instr/s", "ns/instr", "load-us");
+  for (int w = 0; w < num_workloads; w++) {
+    double load_seconds = 0;
+    Program *program = load_workload(&workloads[w], &load_seconds);
+    System sys, expected;
+    if (program == NULL ||
+        initialize_system_with_size(&sys, SUITE_MEMORY_SIZE) != 0 ||
+        initialize_system_with_size(&expected, SUITE_MEMORY_SIZE) != 0) {
+      fprintf(stderr, "%s: cannot load\n", workloads[w].name);
+      return EXIT_FAILURE;
+    }
+    attach_program(&sys, program);
+    attach_program(&expected, program);
+    release_program(program);
+
+    start_run(&expected, iterations);
+    long long instructions = count_instructions(&expected);
+
+    for (int engine = ENGINE_SWITCH; engine <= ENGINE_LOCKSTEP; engine++) {
+      double best = 1e30;
+      for (int run = 0; run <= runs; run++) {
+        start_run(&sys, iterations);
+        double start = now_seconds();
+        execute_with_engine(&sys, (Engine)engine);
+        double elapsed = now_seconds() - start;
+        if (run > 0 && elapsed < best) best = elapsed;  // run 0 warms up
+      }
+
+      int correct =
+          memcmp(sys.registers, expected.registers, sizeof(sys.registers)) == 0;
+      if (!correct) {
+        fprintf(stderr, "%s: wrong registers with %s\n", workloads[w].name,
+                engine_names[engine]);
+        failed = 1;
+      }
+      printf("%-10s %-9s %14lld %12.6f %14.0f %10.3f %12.1f\n",
+             workloads[w].name, engine_names[engine], instructions, best,
+             instructions / best, best * 1e9 / instructions,
+             load_seconds * 1e6);
+      fprintf(out,
+              "%s\n  {\"workload\": \"%s\", \"engine\": \"%s\", "
+              "\"instructions\": %lld, \"seconds\": %.9f, "
+              "\"instructions_per_second\": %.0f, "
+              "\"ns_per_instruction\": %.4f, \"load_seconds\": %.9f, "
+              "\"correct\": %s}",
+              w == 0 && engine == ENGINE_SWITCH ? "" : ",", workloads[w].name,
+              engine_names[engine], instructions, best, instructions / best,
+              best * 1e9 / instructions, load_seconds,
+              correct ? "true" : "false");
+    }
+    destroy_system(&sys);
+    destroy_system(&expected);
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+  return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include "interpreter.h"
+
+// Initial values of EAX, EDX and ECX for one run of a batch
+typedef struct BatchInput {
+  Registers eax;
+  Registers edx;
+  Registers ecx;
+} BatchInput;
+
+// Registers and comparison flag at the end of one run of a batch
+typedef struct BatchResult {
+  Registers registers[6];
+  int comparison_flag;
+} BatchResult;
+
+int run_batch(const System *program, const BatchInput *inputs,
+              BatchResult *results, int count, int num_threads, Engine engine);
+int read_batch_inputs(const char *filename, BatchInput **inputs);
+
+#endif
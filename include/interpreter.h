@@ -1,14 +1,13 @@
 #ifndef __INTERPRETER_H
 #define __INTERPRETER_H
 
-#define MEMORY_SIZE 1024
+#include <stddef.h>
+#include <stdio.h>
 
-// Declaration of Memory type:
-typedef struct Memory {
-  int num_instructions;
-  char *instruction[MEMORY_SIZE];  // array of instructions
-  int data[MEMORY_SIZE];           // array of data
-} Memory;
+#define MEMORY_SIZE 1024      // default words of data memory, see initialize_system
+#define MIN_MEMORY_SIZE 256   // the stack starts 256 below the memory size
+#define LOCKSTEP_LANES 8  // systems run together by execute_instructions_lockstep
+#define DIRTY_LINE_SHIFT 6  // data memory bytes per written flag: 64
 
 /*** General Register Structures ***/
 typedef int Registers;
@@ -17,12 +16,6 @@ typedef int Registers;
 enum RegisterName { EAX, EDX, ECX, ESP, EBP, EIP, NOT_REG };
 typedef enum RegisterName RegisterName;
 
-typedef struct System {
-  Registers registers[6];  // 0: EAX, 1: EDX, 2: ECX, 3: ESP, 4: EBP, 5: EIP
-  Memory memory;
-  int comparison_flag;  // comparison flag to hold the result of comparisons
-} System;
-
 typedef enum DataType { REG, MEM, CONST, UNKNOWN } DataType;
 
 /*
@@ -43,6 +36,164 @@ typedef struct MemoryType {
   int value;
 } MemoryType;
 
+/*
+Opcode of a decoded instruction. Labels and unrecognized instructions decode to
+OP_NOP and are skipped. A jump whose condition is not one of JMP, JE, JNE, JL or
+JG decodes to OP_JNEVER: its label is still checked, but it is never taken.
+*/
+typedef enum Opcode {
+  OP_NOP,
+  OP_MOVL,
+  OP_ADDL,
+  OP_PUSHL,
+  OP_POPL,
+  OP_CMPL,
+  OP_JMP,
+  OP_JE,
+  OP_JNE,
+  OP_JL,
+  OP_JG,
+  OP_JNEVER,
+  OP_CALL,
+  OP_RET,
+  OP_END
+} Opcode;
+
+/*
+Superinstructions, see fuse_instructions. A fused instruction executes the
+instructions after it as well, which keep their own records so that jumping
+into the middle of a fused sequence still works.
+*/
+typedef enum Fusion {
+  FUSION_NONE,
+  FUSION_CMPL_JCC,       // CMPL followed by any jump
+  FUSION_PUSH_POP,       // PUSHL %X, POPL %Y: move through the stack
+  FUSION_ADDL_CMPL_JCC,  // ADDL $k %R, CMPL on registers, jump: counting loop
+  FUSION_CONST_FOLD,     // constant MOVL/ADDL folded by optimize_instructions
+  NUM_FUSIONS
+} Fusion;
+
+/*
+Instruction is the decoded form of one line of the instruction segment. The
+operands are parsed once at load time, and for jumps and calls target holds the
+address of the instruction after the label (-1 if the label is not defined).
+For a MOVL or ADDL of a constant to a register, target holds the constant the
+instructions folded into it add up to, see optimize_instructions.
+*/
+typedef struct Instruction {
+  Opcode opcode;
+  MemoryType src;  // source operand, or the only operand of PUSHL/POPL
+  MemoryType dst;
+  int target;
+  Fusion fusion;  // superinstruction starting here, FUSION_NONE if none
+  // smallest memory size (words) for which the data accesses of the
+  // instruction are proven in bounds, INT_MAX if they are not, see
+  // verify_instructions
+  int safe_size;
+  int folded;  // instructions after this one it stands for, FUSION_CONST_FOLD
+} Instruction;
+
+/*
+Program image: the instruction text, decoded instructions and label table of a
+program, in a single allocation. An image can be attached to any number of
+systems; it is reference counted, and freed when the last system (or caller)
+holding it releases it. See load_program, attach_program and release_program.
+An image can also be saved to a program file and mapped back from it, see
+program_file.h.
+*/
+typedef struct Program {
+  int refcount;
+  int num_instructions;  // lines loaded into the image
+  int num_decoded;       // lines decoded when the image was loaded
+  int capacity;          // entries of instruction and code
+  char **instruction;
+  Instruction *code;
+  int label_table_size;  // a power of two
+  int *label_table;
+  int free_lines;  // lines were set one by one (strdup) and are freed with it
+  int optimized;   // optimize_instructions has run on the decoded lines
+  int removed;     // instructions it removed then
+  int revision;    // changes whenever the decoded lines do, see jit.c
+  void *mapping;   // program file the arrays point into, see map_program
+  size_t mapping_bytes;
+} Program;
+
+/*
+Declaration of Memory type:
+
+The data memory holds size words and is set up when the system is created. It
+is mapped lazily: pages are only backed by real memory once they are touched,
+so a large address space costs only what the program uses. It can be moved
+between guard pages, so that execute_instructions needs no bounds checks.
+
+The instruction segment (instruction, code and label_table) lives in the
+program image attached to the system, which copies of the system share.
+*/
+typedef struct Memory {
+  int num_instructions;
+  char **instruction;   // array of instructions
+  int size;             // words of data memory
+  int *data;            // array of data, size words
+  // one flag per line of 1 << DIRTY_LINE_SHIFT bytes of data, set when the
+  // line is written, see reset_system_dirty
+  unsigned char *dirty;
+  int num_decoded;      // number of valid entries in code
+  Instruction *code;    // decoded instructions
+  // label symbol table: instruction index + 1 of each label line, 0 if empty.
+  // Open addressing, label_table_size is a power of two
+  int label_table_size;
+  int *label_table;
+  Program *program;     // image holding the arrays above
+  int data_from_snapshot;  // data is a copy-on-write mapping of a snapshot
+  // reservation of guard pages around data, NULL if there is none, see
+  // guard_data_memory
+  char *guard;
+} Memory;
+
+/*
+Where run_for last ran out of budget. A slice that goes on from exactly this
+state continues the same run, and keeps running the instructions that
+verify_instructions proved for it without bounds checks.
+*/
+typedef struct Pause {
+  Registers registers[6];
+  int comparison_flag;
+  int verified;  // memory size the run was verified for, -1 if it was not
+  const Instruction *code;  // program it was running
+} Pause;
+
+typedef struct System {
+  Registers registers[6];  // 0: EAX, 1: EDX, 2: ECX, 3: ESP, 4: EBP, 5: EIP
+  Memory memory;
+  int comparison_flag;  // comparison flag to hold the result of comparisons
+  long long fusion_hits[NUM_FUSIONS];  // executions of each superinstruction
+  Pause pause;  // see run_for
+} System;
+
+/*
+Snapshot of the state of a system, see take_snapshot. The data memory is kept
+in a memory file, which systems restored from the snapshot map copy-on-write:
+they share its pages until they write to them. The program image is shared
+as well.
+*/
+typedef struct Snapshot {
+  Registers registers[6];
+  int comparison_flag;
+  long long fusion_hits[NUM_FUSIONS];
+  Program *program;  // the snapshot holds a reference
+  int memory_size;   // words of data memory
+  int fd;            // memory file holding the data memory
+} Snapshot;
+
+// Execution engines that can run a loaded program, see execute_with_engine
+typedef enum Engine {
+  ENGINE_SWITCH,
+  ENGINE_THREADED,
+  ENGINE_JIT,
+  ENGINE_AOT,
+  ENGINE_LOCKSTEP
+} Engine;
+
 typedef enum ExecResult {
   SUCCESS,
   INSTRUCTION_ERROR,
@@ -50,11 +201,40 @@ typedef enum ExecResult {
   PC_ERROR
 } ExecResult;
 
+// How a slice of a run ended, see run_for
+typedef enum RunStatus {
+  RUN_FINISHED,  // reached END, or ran off the instruction segment
+  RUN_BUDGET,    // used up its budget: run_for again to go on
+  RUN_ERROR      // an instruction failed, EIP is at it
+} RunStatus;
+
 void initialize_system(System *sys);
+int initialize_system_with_size(System *sys, int memory_size);
+int copy_system(System *copy, const System *sys);
+void destroy_system(System *sys);
+Snapshot *take_snapshot(const System *sys);
+int restore_snapshot(System *sys, const Snapshot *snapshot);
+void release_snapshot(Snapshot *snapshot);
+int guard_data_memory(System *sys);
+void reset_system(System *sys);
+void reset_system_dirty(System *sys);
 RegisterName get_register_by_name(const char *name);
 MemoryType get_memory_type(const char *name);
+Opcode get_opcode_by_name(const char *name);
+int get_addr_from_label(System *sys, const char *label);
 
-void load_instructions_from_file(System *sys, const char *filename);
+int load_instructions_from_file(System *sys, const char *filename);
+Program *load_program(const char *filename);
+Program *load_program_text(const char *source, size_t size);
+int attach_loaded_program(System *sys, Program *program, const char *filename);
+void attach_program(System *sys, Program *program);
+void release_program(Program *program);
+void decode_instructions(System *sys);
+void fuse_instructions(System *sys);
+void verify_instructions(System *sys);
+int optimize_instructions(System *sys);
+int optimize_program(Program *program);
+void print_fusion_stats(const System *sys, FILE *out);
 ExecResult execute_movl(System *sys, char *src, char *dst);
 ExecResult execute_addl(System *sys, char *src, char *dst);
 ExecResult execute_push(System *sys, char *src);
@@ -64,5 +244,27 @@ ExecResult execute_jmp(System *sys, char *condition, char *dst);
 ExecResult execute_call(System *sys, char *dst);
 ExecResult execute_ret(System *sys);
 void execute_instructions(System *sys);
+RunStatus run_for(System *sys, long long max_instructions);
+void execute_instructions_threaded(System *sys);
+void execute_instructions_jit(System *sys);
+void execute_instructions_aot(System *sys);
+void execute_instructions_lockstep(System *systems, int count);
+int get_engine_by_name(const char *name);
+void execute_with_engine(System *sys, Engine engine);
+
+/* Same as the execute_* functions above, on already decoded operands */
+ExecResult execute_decoded(System *sys, const Instruction *inst);
+ExecResult execute_movl_decoded(System *sys, MemoryType src, MemoryType dst);
+ExecResult execute_addl_decoded(System *sys, MemoryType src, MemoryType dst);
+ExecResult execute_push_decoded(System *sys, MemoryType src);
+ExecResult execute_pop_decoded(System *sys, MemoryType dst);
+ExecResult execute_cmpl_decoded(System *sys, MemoryType src, MemoryType dst);
+ExecResult execute_jmp_decoded(System *sys, Opcode condition, int target);
+ExecResult execute_call_decoded(System *sys, int target);
+
+/* Ahead-of-time compiled program, see compile_program_aot */
+typedef int (*AotProgram)(System *sys);
+AotProgram compile_program_aot(System *sys);
+void execute_compiled(System *sys, AotProgram program);
 
 #endif
@@ -0,0 +1,10 @@
+#ifndef __PRIVATE_CACHE_H
+#define __PRIVATE_CACHE_H
+
+#include <stddef.h>
+
+int private_cache_directory(const char *variable, const char *name, char *dir,
+                            size_t size);
+int open_private_file(const char *path);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include "interpreter.h"
+
+#define PROFILE_MAX_DEPTH 4096  // deeper calls are counted in the caller
+
+/*
+Calling context: a path of calls from the start of the program, one node per
+distinct path. function is the instruction index of the label that was called,
+-1 for the context the program starts in.
+*/
+typedef struct CallContext {
+  int parent;
+  int function;
+  long long executions;  // instructions executed in this context itself
+} CallContext;
+
+// Frame of the shadow call stack, the context a CALL entered
+typedef struct CallFrame {
+  int context;
+  int return_address;
+} CallFrame;
+
+/*
+Execution profile of a program, filled in by execute_instructions_profiled:
+executions and cycles of every opcode and of every instruction address, and for
+jumps how often they were taken (the others were not). Cycles are read from the
+time stamp counter before and after every instruction.
+
+CALL and RET are followed on a shadow call stack, and every instruction is
+counted in the calling context it ran in, see print_folded_stacks.
+*/
+typedef struct Profile {
+  int num_instructions;  // entries of the arrays below
+  long long opcode_executions[OP_END + 1];
+  unsigned long long opcode_cycles[OP_END + 1];
+  long long *executions;
+  unsigned long long *cycles;
+  long long *taken;
+
+  // calling contexts, and a hash table from (parent, function) to context + 1
+  int num_contexts;
+  int context_capacity;  // a power of two, context_table has twice as many
+  CallContext *contexts;
+  int *context_table;
+  int context;  // the one running
+  int depth;
+  int stack_capacity;
+  CallFrame *stack;
+} Profile;
+
+Profile *create_profile(const System *sys);
+void destroy_profile(Profile *profile);
+void execute_instructions_profiled(System *sys, Profile *profile);
+void print_profile(const System *sys, const Profile *profile, FILE *out);
+void print_folded_stacks(const System *sys, const Profile *profile, FILE *out);
+
+/* Shadow call stack upkeep, called by execute_instructions_profiled after a
+ * CALL or RET succeeded */
+void profile_call(Profile *profile, const System *sys, int call_address);
+void profile_return(Profile *profile, const System *sys);
+
+#endif
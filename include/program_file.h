@@ -0,0 +1,11 @@
+#ifndef __PROGRAM_FILE_H
+#define __PROGRAM_FILE_H
+
+#include "interpreter.h"
+
+int save_program(const Program *program, const char *filename);
+Program *map_program(const char *filename);
+Program *load_program_cached(const char *filename);
+int load_instructions_cached(System *sys, const char *filename);
+
+#endif
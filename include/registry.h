@@ -0,0 +1,24 @@
+#ifndef __REGISTRY_H
+#define __REGISTRY_H
+
+#include "interpreter.h"
+
+// Counters of a program registry, see get_registry_stats
+typedef struct RegistryStats {
+  long long hits;       // loads answered with a registered image
+  long long misses;     // loads that had to decode the program
+  long long evictions;  // images dropped to stay within the limit
+  int num_programs;     // images registered now
+} RegistryStats;
+
+// Decoded programs by source text, see registry.c
+typedef struct Registry Registry;
+
+Registry *create_registry(int max_programs);
+Program *load_program_registered(Registry *registry, const char *source,
+                                 size_t size, int *id);
+Program *get_registered_program(Registry *registry, int id);
+void get_registry_stats(Registry *registry, RegistryStats *stats);
+void destroy_registry(Registry *registry);
+
+#endif
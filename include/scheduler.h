@@ -0,0 +1,15 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include "interpreter.h"
+
+// Runs many guest systems as coroutines on one thread, see scheduler.c
+typedef struct Scheduler Scheduler;
+
+Scheduler *create_scheduler(long long slice);
+int spawn_guest(Scheduler *scheduler, System *sys, RunStatus *status);
+long long run_scheduler(Scheduler *scheduler);
+int count_guests(const Scheduler *scheduler);
+void destroy_scheduler(Scheduler *scheduler);
+
+#endif
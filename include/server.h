@@ -0,0 +1,54 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "interpreter.h"
+
+// Longest program text a request can carry
+#define SERVER_MAX_TEXT (64 << 20)
+// Programs sent as text that a server keeps cached, the ones used last
+#define SERVER_REGISTRY_PROGRAMS 256
+
+/*
+Request to the interpreter server, see server.c. It is followed by text_bytes
+bytes of program text, which are loaded and cached, and then run instead of the
+cached program given by id.
+*/
+typedef struct ServerRequest {
+  int program;     // id of a cached program, when there is no text
+  int text_bytes;  // program text following the request
+  int run;         // 0 to only load and cache the text
+  Registers eax;   // initial values of EAX, EDX and ECX
+  Registers edx;
+  Registers ecx;
+  long long budget;  // instructions the run may take, 0 for no limit
+} ServerRequest;
+
+typedef enum ServerStatus {
+  SERVER_OK,
+  SERVER_UNKNOWN_PROGRAM,  // no cached program has the id
+  SERVER_BAD_PROGRAM       // the text jumps or calls to undefined labels
+} ServerStatus;
+
+// Answer to one request, in request order
+typedef struct ServerResponse {
+  int status;      // ServerStatus
+  int program;     // id of the program, for the text of the request as well
+  int run_status;  // RunStatus of the run
+  Registers registers[6];
+  int comparison_flag;
+} ServerResponse;
+
+typedef struct Server Server;
+
+Server *create_server(int memory_size);
+int add_server_program(Server *server, Program *program);
+int serve_connection(Server *server, int in_fd, int out_fd);
+int run_server(Server *server, const char *socket_path);
+void destroy_server(Server *server);
+
+int connect_server(const char *socket_path);
+int send_server_request(int fd, const ServerRequest *request, const char *text);
+int read_server_response(int fd, ServerResponse *response);
+char *read_program_text(const char *filename, int *text_bytes);
+
+#endif
@@ -0,0 +1,496 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "interpreter.h"
+#include "private_cache.h"
+
+/*
+Ahead-of-time compilation of a program to a native shared object.
+
+compile_program_aot lowers the decoded program to one C function, with a label
+per instruction and jumps as gotos, compiles it with the system C compiler and
+dlopens the result. The shared object is cached on disk under the hash of the
+program text, so a program is only compiled once per user. The cache is a
+private directory of the user (see private_cache.c), since whatever is in it
+gets loaded into the process. A shared object also holds the text it was
+compiled from, as aot_source, and is only run for the same text; one left by
+a program whose hash is the same is compiled over.
+
+The generated function only depends on the layout of System and the size of
+the data memory, which are baked in (and are part of the text). It returns
+0 when the program is done (END, an error, or EIP outside the program), and 1
+when an ADDL, MOVL or POPL to %EIP left EIP unaligned; the caller then
+interprets until EIP is aligned again and calls it once more.
+*/
+
+#define AOT_VERSION 4
+#define AOT_CACHE_NAME "assembly_aot_cache"
+
+extern char **environ;
+
+/* Text of the program that a compiled program is looked up by: a line with
+ * everything the generated code depends on, and the lines of the program.
+ * Returns a new string, or NULL if memory cannot be allocated */
+static char *program_key(const System *sys) {
+  char layout[128];
+  int length = snprintf(layout, sizeof(layout), "%d %d %d %d %d %d %d\n",
+                        AOT_VERSION, sys->memory.size, (int)sizeof(System),
+                        (int)offsetof(System, registers),
+                        (int)offsetof(System, comparison_flag),
+                        (int)offsetof(System, memory.data),
+                        (int)offsetof(System, memory.dirty));
+  size_t bytes = length;
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    const char *line = sys->memory.instruction[i] ? sys->memory.instruction[i]
+                                                  : "END";
+    bytes += strlen(line) + 1;
+  }
+  char *key = (char *)malloc(bytes + 1);
+  if (key == NULL) return NULL;
+  char *end = stpcpy(key, layout);
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    const char *line = sys->memory.instruction[i] ? sys->memory.instruction[i]
+                                                  : "END";
+    end = stpcpy(end, line);
+    *end++ = '\n';
+  }
+  *end = '\0';
+  return key;
+}
+
+/* FNV-1a hash of the key of a program, used as the cache key */
+static unsigned long long hash_key(const char *key) {
+  unsigned long long hash = 14695981039346656037ull;
+  for (; *key; key++) hash = (hash ^ (unsigned char)*key) * 1099511628211ull;
+  return hash;
+}
+
+/*** C code generation ***/
+
+/* Print the C expression for the value of a register or constant operand.
+ * Inside compiled code EIP always holds the address of the instruction */
+static void print_value(FILE *out, MemoryType operand, int idx) {
+  if (operand.type == CONST) {
+    fprintf(out, "(%d)", operand.value);
+  } else if (operand.reg == EIP) {
+    fprintf(out, "(%d)", idx * 4);
+  } else {
+    fprintf(out, "r%d", operand.reg);
+  }
+}
+
+/* Compute the address of a memory operand into variable name and stop with
+ * the instruction's error if it is out of range */
+static void print_address(FILE *out, const char *name, MemoryType operand,
+                          int idx) {
+  fprintf(out, "  %s = (int)((unsigned)", name);
+  print_value(out, operand, idx);
+  fprintf(out, " + %du);\n", operand.value);
+  fprintf(out, "  if (BAD_ADDRESS(%s)) STOP(%d);\n", name, idx);
+}
+
+/* Load the value of any operand into variable name */
+static void print_load(FILE *out, const char *name, MemoryType operand,
+                       int idx) {
+  if (operand.type == MEM) {
+    print_address(out, "a", operand, idx);
+    fprintf(out, "  %s = DATA(a);\n", name);
+  } else {
+    fprintf(out, "  %s = ", name);
+    print_value(out, operand, idx);
+    fprintf(out, ";\n");
+  }
+}
+
+/* Store v to a register destination; writing EIP continues wherever it now
+ * points to, or at the next instruction if it did not change */
+static void print_set_register(FILE *out, RegisterName reg, int idx) {
+  if (reg == EIP) {
+    fprintf(out, "  e = v == %d ? %d : v;\n  goto dispatch;\n", idx * 4,
+            idx * 4 + 4);
+  } else {
+    fprintf(out, "  r%d = v;\n", reg);
+  }
+}
+
+static int successor(int idx, int target) {
+  return target == idx * 4 ? idx + 1 : target / 4;
+}
+
+static void print_instruction(FILE *out, const Instruction *inst, int idx,
+                              int num_instructions) {
+  MemoryType src = inst->src, dst = inst->dst;
+  const char *condition = NULL;
+
+  fprintf(out, "I%d:\n", idx);
+  switch (inst->opcode) {
+    case OP_MOVL:
+    case OP_ADDL:
+      if (src.type == UNKNOWN || dst.type == UNKNOWN || dst.type == CONST ||
+          (src.type == MEM && dst.type == MEM)) {
+        fprintf(out, "  STOP(%d);\n", idx);
+        break;
+      }
+      print_load(out, "v", src, idx);
+      if (inst->opcode == OP_ADDL) {
+        print_load(out, "d", dst, idx);
+        fprintf(out, "  v = (int)((unsigned)d + (unsigned)v);\n");
+      }
+      if (dst.type == REG) {
+        print_set_register(out, dst.reg, idx);
+      } else {
+        // ADDL already computed and checked the address when loading d
+        if (inst->opcode == OP_MOVL) print_address(out, "a", dst, idx);
+        fprintf(out, "  STORE(a, v);\n");
+      }
+      break;
+
+    case OP_CMPL:
+      if (src.type == UNKNOWN || dst.type == UNKNOWN ||
+          (src.type == MEM && dst.type == MEM)) {
+        fprintf(out, "  STOP(%d);\n", idx);
+        break;
+      }
+      print_load(out, "v", src, idx);
+      print_load(out, "d", dst, idx);
+      fprintf(out, "  f = d == v ? 0 : d > v ? 1 : -1;\n");
+      break;
+
+    case OP_PUSHL:
+      if (src.type == UNKNOWN) {
+        fprintf(out, "  STOP(%d);\n", idx);
+        break;
+      }
+      print_load(out, "v", src, idx);
+      fprintf(out, "  a = (int)((unsigned)r%d - 4u);\n", ESP);
+      fprintf(out, "  if (BAD_PUSH(a)) STOP(%d);\n", idx);
+      fprintf(out, "  STORE(a, v);\n  r%d = a;\n", ESP);
+      break;
+
+    case OP_POPL:
+      if (src.type == UNKNOWN || src.type == CONST) {
+        fprintf(out, "  STOP(%d);\n", idx);
+        break;
+      }
+      fprintf(out, "  if (BAD_ADDRESS(r%d)) STOP(%d);\n", ESP, idx);
+      fprintf(out, "  v = DATA(r%d);\n", ESP);
+      if (src.type == MEM) {
+        print_address(out, "a", src, idx);
+        fprintf(out, "  STORE(a, v);\n  r%d += 4;\n", ESP);
+      } else if (src.reg == ESP) {
+        // execute_pop adds 4 to the popped value in this case
+        fprintf(out, "  r%d = (int)((unsigned)v + 4u);\n", ESP);
+      } else {
+        fprintf(out, "  r%d += 4;\n", ESP);
+        print_set_register(out, src.reg, idx);
+      }
+      break;
+
+    case OP_JE:
+      condition = "f == 0";
+      break;
+    case OP_JNE:
+      condition = "f != 0";
+      break;
+    case OP_JL:
+      condition = "f == -1";
+      break;
+    case OP_JG:
+      condition = "f == 1";
+      break;
+
+    case OP_JMP:
+      if (inst->target == -1) {
+        fprintf(out, "  STOP(%d);\n", idx);
+      } else {
+        fprintf(out, "  goto I%d;\n", successor(idx, inst->target));
+      }
+      break;
+
+    case OP_JNEVER:
+      if (inst->target == -1) fprintf(out, "  STOP(%d);\n", idx);
+      break;
+
+    case OP_CALL:
+      if (inst->target == -1) {
+        fprintf(out, "  STOP(%d);\n", idx);
+        break;
+      }
+      fprintf(out, "  a = (int)((unsigned)r%d - 4u);\n", ESP);
+      fprintf(out, "  if (BAD_PUSH(a)) STOP(%d);\n", idx);
+      fprintf(out, "  STORE(a, %d);\n  r%d = a;\n", idx * 4 + 4, ESP);
+      fprintf(out, "  goto I%d;\n", successor(idx, inst->target));
+      break;
+
+    case OP_RET:
+      fprintf(out, "  if (BAD_ADDRESS(r%d)) STOP(%d);\n", ESP, idx);
+      fprintf(out, "  v = DATA(r%d);\n", ESP);
+      fprintf(out, "  if (v < 0 || v >= %d || (v & 3)) STOP(%d);\n",
+              num_instructions * 4, idx);
+      fprintf(out, "  r%d += 4;\n", ESP);
+      print_set_register(out, EIP, idx);
+      break;
+
+    case OP_END:
+      fprintf(out, "  STOP(%d);\n", idx);
+      break;
+
+    default:  // labels and unrecognized instructions
+      break;
+  }
+
+  if (condition != NULL) {
+    if (inst->target == -1) {
+      fprintf(out, "  STOP(%d);\n", idx);
+    } else {
+      fprintf(out, "  if (%s) goto I%d;\n", condition,
+              successor(idx, inst->target));
+    }
+  }
+}
+
+/* Print the key as a C string literal, a line of it per line of the key */
+static void print_key(FILE *out, const char *key) {
+  fputs("\n  \"", out);
+  for (; *key; key++) {
+    unsigned char c = (unsigned char)*key;
+    if (c == '\\' || c == '"' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+    if (c == '\n' && key[1] != '\0') fputs("\"\n  \"", out);
+  }
+  fputs("\"", out);
+}
+
+/* Write the C source of the compiled program */
+static void print_program(FILE *out, const System *sys, const char *key,
+                          unsigned long long hash) {
+  int num = sys->memory.num_instructions;
+
+  fprintf(out, "/* generated by assembly_app, program %016llx */\n", hash);
+  fprintf(out, "const char aot_source[] =");
+  print_key(out, key);
+  fprintf(out, ";\n\n");
+  fprintf(out, "#define REG(n) (*(int *)(sys + %d + 4 * (n)))\n",
+          (int)offsetof(System, registers));
+  fprintf(out, "#define FLAG (*(int *)(sys + %d))\n",
+          (int)offsetof(System, comparison_flag));
+  fprintf(out, "#define DATA(a) (*(int *)(data + (a)))\n");
+  fprintf(out, "#define STORE(a, v) (DATA(a) = (v), dirty[(a) >> %d] = 1)\n",
+          DIRTY_LINE_SHIFT);
+  fprintf(out, "#define BAD_ADDRESS(a) ((unsigned)(a) > %du || ((a) & 3))\n",
+          (sys->memory.size - 1) * 4);
+  fprintf(out, "#define BAD_PUSH(a) ((a) < 4 || (a) >= %d || ((a) & 3))\n",
+          sys->memory.size * 4);
+  fprintf(out, "#define STOP(idx) do { e = (idx) * 4; goto done; } while (0)\n");
+  fprintf(out, "\nint aot_program(char *sys) {\n");
+  fprintf(out, "  int r0 = REG(0), r1 = REG(1), r2 = REG(2), r3 = REG(3), "
+               "r4 = REG(4);\n");
+  fprintf(out, "  int e = REG(5), f = FLAG, a, v, d;\n");
+  fprintf(out, "  char *data = *(char **)(sys + %d);\n",
+          (int)offsetof(System, memory.data));
+  fprintf(out, "  unsigned char *dirty = *(unsigned char **)(sys + %d);\n",
+          (int)offsetof(System, memory.dirty));
+  fprintf(out, "  static void *const label[] = {");
+  for (int i = 0; i < num; i++) fprintf(out, "%s&&I%d", i ? ", " : "", i);
+  fprintf(out, "};\n  int unaligned = 0;\n\n");
+  fprintf(out, "dispatch:\n");
+  fprintf(out, "  if (e & 3) { unaligned = 1; goto done; }\n");
+  fprintf(out, "  if (e < 0 || e >= %d) goto done;\n", num * 4);
+  fprintf(out, "  goto *label[e >> 2];\n\n");
+
+  for (int i = 0; i < num; i++) {
+    print_instruction(out, &sys->memory.code[i], i, num);
+  }
+  fprintf(out, "  e = %d;\n\n", num * 4);
+
+  fprintf(out, "done:\n");
+  fprintf(out, "  REG(0) = r0; REG(1) = r1; REG(2) = r2; REG(3) = r3; "
+               "REG(4) = r4;\n");
+  fprintf(out, "  REG(5) = e;\n  FLAG = f;\n  (void)a; (void)v; (void)d;\n");
+  fprintf(out, "  return unaligned;\n}\n");
+}
+
+/*** compiling and caching ***/
+
+/* Run the C compiler on source, writing the shared object to output */
+static int run_compiler(const char *source, const char *output) {
+  const char *compiler = getenv("CC") ? getenv("CC") : "cc";
+  char *argv[] = {(char *)compiler, (char *)"-x",  (char *)"c",
+                  (char *)"-O2",    (char *)"-shared", (char *)"-fPIC",
+                  (char *)"-w",     (char *)"-o",      (char *)output,
+                  (char *)source,   NULL};
+  pid_t pid;
+  int status;
+
+  if (posix_spawnp(&pid, compiler, NULL, NULL, argv, environ) != 0) return -1;
+  if (waitpid(pid, &status, 0) != pid) return -1;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Shared object loaded by load_library
+typedef struct Library {
+  dev_t device;
+  ino_t inode;
+  void *handle;
+  struct Library *next;
+} Library;
+
+static Library *loaded_libraries;
+static pthread_mutex_t libraries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Load the shared object open on fd. It is loaded through /proc/self/fd, so that
+the file checked by open_private_file is the one loaded, whatever happens to
+its path meanwhile. The loader knows a library by the name it was loaded under,
+and would take a later library opened on the same descriptor number for it, so
+the descriptor stays open (and its number taken) for as long as the library is
+loaded, which is until the process ends. A file that is loaded already is
+looked up by its inode instead, and its descriptor closed. Returns NULL if it
+cannot be loaded.
+*/
+static void *load_library(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  pthread_mutex_lock(&libraries_lock);
+  Library *library = loaded_libraries;
+  while (library != NULL &&
+         (library->device != st.st_dev || library->inode != st.st_ino)) {
+    library = library->next;
+  }
+  void *handle = library != NULL ? library->handle : NULL;
+  int keep = handle == NULL;  // the descriptor names a new library
+  if (keep) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    library = handle != NULL ? (Library *)malloc(sizeof(Library)) : NULL;
+    if (library != NULL) {
+      library->device = st.st_dev;
+      library->inode = st.st_ino;
+      library->handle = handle;
+      library->next = loaded_libraries;
+      loaded_libraries = library;
+    }
+  }
+  pthread_mutex_unlock(&libraries_lock);
+  if (!keep || handle == NULL) close(fd);
+  return handle;
+}
+
+/* Compile the program to the shared object at library in the cache directory
+ * dir. Returns 0 on success and -1 if it cannot be compiled */
+static int compile_library(const System *sys, const char *key,
+                           unsigned long long hash, const char *dir,
+                           const char *library) {
+  char source[4096], temporary[4096];
+  snprintf(source, sizeof(source), "%s/%016llx.%d.c", dir, hash,
+           (int)getpid());
+  snprintf(temporary, sizeof(temporary), "%s/%016llx.%d.so", dir, hash,
+           (int)getpid());
+
+  FILE *out = fopen(source, "w");
+  if (!out) return -1;
+  print_program(out, sys, key, hash);
+  fclose(out);
+
+  // private whatever the umask, see open_private_file
+  int compiled = run_compiler(source, temporary) == 0 &&
+                 chmod(temporary, 0700) == 0 &&
+                 rename(temporary, library) == 0;
+  unlink(source);
+  if (!compiled) unlink(temporary);
+  return compiled ? 0 : -1;
+}
+
+/* The compiled program in the shared object open on fd, which is closed, if
+ * it was compiled from the program with the key; NULL otherwise */
+static AotProgram load_compiled(int fd, const char *key) {
+  // The library stays loaded, later lookups of the same program reuse it
+  void *handle = load_library(fd);
+  if (handle == NULL) return NULL;
+  const char *source = (const char *)dlsym(handle, "aot_source");
+  if (source == NULL || strcmp(source, key) != 0) return NULL;
+  return (AotProgram)dlsym(handle, "aot_program");
+}
+
+/*
+Return the compiled form of the program loaded in the system, compiling it
+first if the cache does not have it yet, or has another program under its
+hash. The cache lives in the directory named by the ASSEMBLY_AOT_CACHE
+environment variable, or in AOT_CACHE_NAME under $XDG_CACHE_HOME or /tmp (see
+private_cache_directory). Returns NULL if the program cannot be compiled, or
+the cache is not private to the user.
+*/
+AotProgram compile_program_aot(System *sys) {
+  // the directory leaves room for the file names in the paths below
+  char dir[4000], library[4096];
+  if (private_cache_directory("ASSEMBLY_AOT_CACHE", AOT_CACHE_NAME, dir,
+                              sizeof(dir)) != 0) {
+    return NULL;
+  }
+
+  if (sys->memory.num_decoded != sys->memory.num_instructions) {
+    decode_instructions(sys);
+  }
+  if (sys->memory.num_instructions == 0) return NULL;
+
+  char *key = program_key(sys);
+  if (key == NULL) return NULL;
+  unsigned long long hash = hash_key(key);
+  snprintf(library, sizeof(library), "%s/%016llx.so", dir, hash);
+
+  int fd = open_private_file(library);
+  AotProgram program = fd >= 0 ? load_compiled(fd, key) : NULL;
+  if (program == NULL && (fd >= 0 || errno == ENOENT) &&
+      compile_library(sys, key, hash, dir, library) == 0) {
+    fd = open_private_file(library);
+    if (fd >= 0) program = load_compiled(fd, key);
+  }
+  free(key);
+  return program;
+}
+
+/* Run a compiled program on the system, the same way execute_instructions
+ * would run it */
+void execute_compiled(System *sys, AotProgram program) {
+  while (program(sys) != 0) {
+    // EIP is not a multiple of 4: interpret until it is again
+    do {
+      int instruction_idx = sys->registers[EIP] / 4;
+      if (instruction_idx < 0 ||
+          instruction_idx >= sys->memory.num_instructions) {
+        return;
+      }
+      const Instruction *inst = &sys->memory.code[instruction_idx];
+      if (inst->opcode == OP_END) return;
+      if (execute_decoded(sys, inst) != SUCCESS) return;
+    } while (sys->registers[EIP] % 4 != 0);
+  }
+}
+
+/* Compile (or fetch from the cache) and run the program; it is interpreted
+ * if it cannot be compiled */
+void execute_instructions_aot(System *sys) {
+  AotProgram program = compile_program_aot(sys);
+  if (program == NULL) {
+    execute_instructions(sys);
+    return;
+  }
+  execute_compiled(sys, program);
+}
@@ -0,0 +1,259 @@
+#include "batch.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+Batch execution of one program on many inputs.
+
+run_batch spreads the inputs over a pool of worker threads. Each worker runs on
+its own copy of the System (one per lane with ENGINE_LOCKSTEP, see
+copy_system), which shares the decoded program of the loaded system
+(memory.code is never written while running), and is reset before every
+input. Results are written to the slot of
+their input, so they come back in input order no matter which worker ran them.
+
+Work is distributed by range stealing: every worker starts with an equal slice
+of the inputs and takes BATCH_CHUNK inputs at a time from the front of it. A
+worker whose slice is empty steals the back half of the largest remaining slice
+of another worker, so a few slow inputs do not leave the other cores idle.
+*/
+
+#define BATCH_CHUNK (2 * LOCKSTEP_LANES)
+
+typedef struct WorkRange {
+  pthread_mutex_t lock;
+  int begin;
+  int end;
+} WorkRange;
+
+typedef struct Batch {
+  const System *program;
+  const BatchInput *inputs;
+  BatchResult *results;
+  Engine engine;
+  AotProgram compiled;  // used instead of engine when not NULL
+  int num_workers;
+  WorkRange *ranges;
+} Batch;
+
+typedef struct Worker {
+  Batch *batch;
+  int id;
+  pthread_t thread;
+} Worker;
+
+/* Take up to BATCH_CHUNK inputs from the front of a range */
+static int take_chunk(WorkRange *range, int *begin, int *end) {
+  pthread_mutex_lock(&range->lock);
+  *begin = range->begin;
+  *end = range->begin + BATCH_CHUNK < range->end ? range->begin + BATCH_CHUNK
+                                                 : range->end;
+  range->begin = *end;
+  pthread_mutex_unlock(&range->lock);
+  return *begin < *end;
+}
+
+/* Move the back half of the largest other range into the worker's own range,
+ * return 0 if there is nothing left to steal */
+static int steal(Batch *batch, int id) {
+  int victim = -1, largest = 0;
+
+  for (int i = 0; i < batch->num_workers; i++) {
+    int remaining = batch->ranges[i].end - batch->ranges[i].begin;  // hint only
+    if (i != id && remaining > largest) {
+      victim = i;
+      largest = remaining;
+    }
+  }
+  if (victim < 0) return 0;
+
+  WorkRange *from = &batch->ranges[victim];
+  int begin, end;
+  pthread_mutex_lock(&from->lock);
+  end = from->end;
+  begin = from->begin + (from->end - from->begin) / 2;
+  if (begin < end) from->end = begin;
+  pthread_mutex_unlock(&from->lock);
+  if (begin >= end) return 1;  // lost a race, look again
+
+  WorkRange *own = &batch->ranges[id];
+  pthread_mutex_lock(&own->lock);
+  own->begin = begin;
+  own->end = end;
+  pthread_mutex_unlock(&own->lock);
+  return 1;
+}
+
+/* Run the inputs from begin to end, each on one of the given systems, and
+ * store their results */
+static void run_inputs(Batch *batch, System *systems, int begin, int end) {
+  for (int idx = begin; idx < end; idx++) {
+    System *sys = &systems[idx - begin];
+    const BatchInput *input = &batch->inputs[idx];
+    reset_system_dirty(sys);  // only what the last input wrote
+    sys->registers[EAX] = input->eax;
+    sys->registers[EDX] = input->edx;
+    sys->registers[ECX] = input->ecx;
+    if (batch->engine == ENGINE_LOCKSTEP) continue;  // all of them run below
+    if (batch->compiled != NULL) {
+      execute_compiled(sys, batch->compiled);
+    } else {
+      execute_with_engine(sys, batch->engine);
+    }
+  }
+  if (batch->engine == ENGINE_LOCKSTEP) {
+    execute_instructions_lockstep(systems, end - begin);
+  }
+
+  for (int idx = begin; idx < end; idx++) {
+    BatchResult *result = &batch->results[idx];
+    memcpy(result->registers, systems[idx - begin].registers,
+           sizeof(result->registers));
+    result->comparison_flag = systems[idx - begin].comparison_flag;
+  }
+}
+
+static void *run_worker(void *arg) {
+  Worker *worker = (Worker *)arg;
+  Batch *batch = worker->batch;
+  // the lockstep engine runs a whole group of inputs at once
+  int num_systems = batch->engine == ENGINE_LOCKSTEP ? LOCKSTEP_LANES : 1;
+  System *systems = (System *)malloc(num_systems * sizeof(System));
+  int begin, end, copied = 0;
+
+  while (systems != NULL && copied < num_systems &&
+         copy_system(&systems[copied], batch->program) == 0) {
+    copied++;
+  }
+  if (copied < num_systems) {
+    // the other workers steal this range
+    for (int i = 0; i < copied; i++) destroy_system(&systems[i]);
+    free(systems);
+    return NULL;
+  }
+  do {
+    while (take_chunk(&batch->ranges[worker->id], &begin, &end)) {
+      for (int idx = begin; idx < end; idx += num_systems) {
+        run_inputs(batch, systems, idx,
+                   end - idx < num_systems ? end : idx + num_systems);
+      }
+    }
+  } while (steal(batch, worker->id));
+  for (int i = 0; i < num_systems; i++) destroy_system(&systems[i]);
+  free(systems);
+  return NULL;
+}
+
+/*
+Run the program loaded in the system once for every input, on num_threads
+threads (all online cores if num_threads <= 0), and store the final registers
+of inputs[i] in results[i]. The calling thread works as one of the threads.
+Returns 0 on success and -1 if no worker could run.
+*/
+int run_batch(const System *program, const BatchInput *inputs,
+              BatchResult *results, int count, int num_threads,
+              Engine engine) {
+  System *loaded = (System *)program;
+  Batch batch;
+
+  if (num_threads <= 0) num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0) num_threads = 1;
+  if (num_threads > count) num_threads = count > 0 ? count : 1;
+
+  // decode and compile once here, workers only read the program
+  if (loaded->memory.num_decoded != loaded->memory.num_instructions) {
+    decode_instructions(loaded);
+  }
+  batch.program = program;
+  batch.inputs = inputs;
+  batch.results = results;
+  batch.engine = engine;
+  batch.compiled = engine == ENGINE_AOT ? compile_program_aot(loaded) : NULL;
+  if (engine == ENGINE_AOT && batch.compiled == NULL) {
+    batch.engine = ENGINE_SWITCH;
+  }
+  batch.num_workers = num_threads;
+  batch.ranges = (WorkRange *)calloc(num_threads, sizeof(WorkRange));
+  Worker *workers = (Worker *)calloc(num_threads, sizeof(Worker));
+  if (batch.ranges == NULL || workers == NULL) {
+    free(batch.ranges);
+    free(workers);
+    return -1;
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&batch.ranges[i].lock, NULL);
+    batch.ranges[i].begin = (int)((long long)count * i / num_threads);
+    batch.ranges[i].end = (int)((long long)count * (i + 1) / num_threads);
+    workers[i].batch = &batch;
+    workers[i].id = i;
+  }
+
+  // a worker that fails to start just leaves its range to be stolen, and
+  // without the flags no worker is started: the calling thread runs them all
+  int *started = (int *)calloc(num_threads, sizeof(int));
+  int num_started = started != NULL ? num_threads : 1;
+  for (int i = 1; i < num_started; i++) {
+    started[i] = pthread_create(&workers[i].thread, NULL, run_worker,
+                                &workers[i]) == 0;
+  }
+  run_worker(&workers[0]);
+  for (int i = 1; i < num_started; i++) {
+    if (started[i]) pthread_join(workers[i].thread, NULL);
+  }
+
+  // anything left means the calling thread could not allocate its system
+  int left = 0;
+  for (int i = 0; i < num_threads; i++) {
+    left += batch.ranges[i].begin < batch.ranges[i].end;
+    pthread_mutex_destroy(&batch.ranges[i].lock);
+  }
+  free(started);
+  free(workers);
+  free(batch.ranges);
+  return left ? -1 : 0;
+}
+
+/* Read one input per line, "EAX EDX ECX", into a newly allocated array.
+ * Returns the number of inputs, or -1 on error */
+int read_batch_inputs(const char *filename, BatchInput **inputs) {
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  char line[256];
+  int count = 0, capacity = 0, line_number = 0;
+  *inputs = NULL;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    BatchInput input;
+    line_number++;
+    int fields = sscanf(line, "%d %d %d", &input.eax, &input.edx, &input.ecx);
+    if (fields == EOF) continue;  // blank line
+    if (fields != 3) {
+      fprintf(stderr, "%s:%d: expected \"EAX EDX ECX\"\n", filename,
+              line_number);
+      free(*inputs);
+      fclose(file);
+      return -1;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      BatchInput *grown =
+          (BatchInput *)realloc(*inputs, capacity * sizeof(BatchInput));
+      if (grown == NULL) {
+        free(*inputs);
+        fclose(file);
+        return -1;
+      }
+      *inputs = grown;
+    }
+    (*inputs)[count++] = input;
+  }
+  fclose(file);
+  return count;
+}
@@ -1,24 +1,487 @@
 #include "interpreter.h"
+#include "profile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-/* reset the system to a defulat status */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// data memory up to this many bytes is cleared with memset rather than madvise
+#define DATA_CLEAR_IN_PLACE (64 * 1024)
+// bytes of source scanned at a time by the program loader, one bit each
+#define SCAN_BLOCK 64
+// lines of a program, which keeps the sizes of the image arrays within an int
+#define MAX_PROGRAM_LINES (1 << 28)
+// inaccessible bytes on either side of guarded data memory: as far as any int
+// byte address reaches, see guard_data_memory
+#define GUARD_SPAN ((size_t)1 << 31)
+
+/* reset the system to a defulat status, with MEMORY_SIZE words of data
+ * memory */
 void initialize_system(System *sys) {
+  if (initialize_system_with_size(sys, MEMORY_SIZE) != 0) {
+    perror("Error initializing system");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Bytes mapped for the data memory, a whole number of pages */
+static size_t data_bytes(int memory_size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return ((size_t)memory_size * 4 + page - 1) / page * page;
+}
+
+/* Map zero-filled data memory, the kernel only allocates the pages that are
+ * touched. Returns NULL on failure */
+static int *map_data(int memory_size) {
+  void *data = mmap(NULL, data_bytes(memory_size), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return data == MAP_FAILED ? NULL : (int *)data;
+}
+
+/* Bytes of the reservation holding guarded data memory, see
+ * guard_data_memory */
+static size_t guard_bytes(int memory_size) {
+  return GUARD_SPAN + data_bytes(memory_size) + GUARD_SPAN;
+}
+
+/* Unmap the data memory, and the guard pages around it if it has any */
+static void unmap_data(Memory *memory) {
+  if (memory->guard != NULL) {
+    munmap(memory->guard, guard_bytes(memory->size));
+  } else {
+    munmap(memory->data, data_bytes(memory->size));
+  }
+  memory->data = NULL;
+  memory->guard = NULL;
+}
+
+/* Bytes of the written flags of the data memory, one per line */
+static size_t dirty_bytes(int memory_size) {
+  return ((size_t)memory_size * 4 + (1 << DIRTY_LINE_SHIFT) - 1) >>
+         DIRTY_LINE_SHIFT;
+}
+
+/* Store value at the byte address of the data memory, and flag its line as
+ * written */
+static inline void store_data(Memory *memory, int address, int value) {
+  memory->data[address / 4] = value;
+  memory->dirty[address >> DIRTY_LINE_SHIFT] = 1;
+}
+
+/*
+Allocate an image for capacity lines and text_bytes of line text, all in one
+block: the Program, the line pointers, the decoded instructions, the label
+table and then the text. The caller holds the only reference.
+*/
+static Program *allocate_program(int capacity, size_t text_bytes) {
+  // twice as many label slots as lines keeps probe chains short
+  int label_table_size = 2;
+  while (label_table_size < 2 * capacity) label_table_size *= 2;
+
+  Program *program = (Program *)malloc(
+      sizeof(Program) + capacity * (sizeof(char *) + sizeof(Instruction)) +
+      label_table_size * sizeof(int) + text_bytes);
+  if (program == NULL) return NULL;
+  program->refcount = 1;
+  program->num_instructions = 0;
+  program->num_decoded = 0;
+  program->capacity = capacity;
+  program->instruction = (char **)(program + 1);
+  program->code = (Instruction *)(program->instruction + capacity);
+  program->label_table_size = label_table_size;
+  program->label_table = (int *)(program->code + capacity);
+  program->free_lines = 0;
+  program->optimized = 0;
+  program->removed = 0;
+  program->revision = 0;
+  program->mapping = NULL;
+  program->mapping_bytes = 0;
+  memset(program->instruction, 0, capacity * sizeof(char *));
+  return program;
+}
+
+/* Point the instruction segment of the memory at the image, which the memory
+ * already holds a reference to */
+static void use_program(Memory *memory, Program *program) {
+  memory->program = program;
+  memory->num_instructions = program->num_instructions;
+  memory->num_decoded = program->num_decoded;
+  memory->instruction = program->instruction;
+  memory->code = program->code;
+  memory->label_table_size = program->label_table_size;
+  memory->label_table = program->label_table;
+}
+
+/* Attach the image to the system in place of its current program. The system
+ * takes a reference of its own, the caller keeps its reference */
+void attach_program(System *sys, Program *program) {
+  __atomic_add_fetch(&program->refcount, 1, __ATOMIC_RELAXED);
+  release_program(sys->memory.program);
+  use_program(&sys->memory, program);
+}
+
+/* Drop a reference to the image, and free it with the last one */
+void release_program(Program *program) {
+  if (program == NULL ||
+      __atomic_sub_fetch(&program->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  if (program->free_lines) {
+    for (int i = 0; i < program->capacity; i++) free(program->instruction[i]);
+  }
+  if (program->mapping != NULL) munmap(program->mapping, program->mapping_bytes);
+  free(program);
+}
+
+/*
+Set up an empty system with memory_size words of data memory. The stack starts
+at MEMORY_SIZE - 256 with the default size, and 256 below the size in general.
+Returns 0 on success, and -1 if the size is smaller than MIN_MEMORY_SIZE or too
+large to address, or if memory cannot be allocated.
+*/
+int initialize_system_with_size(System *sys, int memory_size) {
+  if (memory_size < MIN_MEMORY_SIZE || memory_size > INT_MAX / 4) {
+    errno = EINVAL;
+    return -1;
+  }
+  // an empty image whose lines are filled in one by one
+  Program *program = allocate_program(MEMORY_SIZE, 0);
+  sys->memory.size = memory_size;
+  sys->memory.data = map_data(memory_size);
+  sys->memory.dirty = (unsigned char *)calloc(dirty_bytes(memory_size), 1);
+  if (program == NULL || sys->memory.data == NULL ||
+      sys->memory.dirty == NULL) {
+    free(program);
+    free(sys->memory.dirty);
+    if (sys->memory.data != NULL) {
+      munmap(sys->memory.data, data_bytes(memory_size));
+    }
+    return -1;
+  }
+  program->free_lines = 1;
+  sys->memory.program = NULL;
+  sys->memory.data_from_snapshot = 0;
+  sys->memory.guard = NULL;
+  use_program(&sys->memory, program);
+  reset_system(sys);
+  return 0;
+}
+
+/*
+Make copy a system with the same program, registers and data as sys. The
+program is shared, and the copy gets data memory of its own: only the pages of
+sys that hold anything other than zeros are copied, and flagged as written.
+The copy of a guarded system is guarded as well, when the guard pages can be
+mapped. Returns 0 on success, and -1 if memory cannot be allocated.
+*/
+int copy_system(System *copy, const System *sys) {
+  int *data = map_data(sys->memory.size);
+  unsigned char *dirty =
+      (unsigned char *)calloc(dirty_bytes(sys->memory.size), 1);
+  if (data == NULL || dirty == NULL) {
+    if (data != NULL) munmap(data, data_bytes(sys->memory.size));
+    free(dirty);
+    return -1;
+  }
+
+  size_t page_words = (size_t)sysconf(_SC_PAGESIZE) / 4;
+  for (size_t first = 0; first < (size_t)sys->memory.size; first += page_words) {
+    size_t words = (size_t)sys->memory.size - first < page_words
+                       ? (size_t)sys->memory.size - first
+                       : page_words;
+    const int *page = &sys->memory.data[first];
+    for (size_t i = 0; i < words; i++) {
+      if (page[i] != 0) {
+        memcpy(&data[first], page, words * 4);
+        memset(&dirty[first * 4 >> DIRTY_LINE_SHIFT], 1,
+               ((words * 4 - 1) >> DIRTY_LINE_SHIFT) + 1);
+        break;
+      }
+    }
+  }
+  *copy = *sys;
+  copy->memory.data = data;
+  copy->memory.dirty = dirty;
+  copy->memory.data_from_snapshot = 0;
+  copy->memory.guard = NULL;
+  if (sys->memory.guard != NULL) guard_data_memory(copy);
+  __atomic_add_fetch(&sys->memory.program->refcount, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+Take a snapshot of the registers, data memory and program of the system, which
+the system can go back to, and any number of other systems can start from, with
+restore_snapshot. The data memory is written to a memory file, only the pages
+holding anything other than zeros. Returns NULL if the memory file or the
+snapshot cannot be created; the caller holds the snapshot.
+*/
+Snapshot *take_snapshot(const System *sys) {
+  Snapshot *snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+  if (snapshot == NULL) return NULL;
+  size_t bytes = data_bytes(sys->memory.size);
+  snapshot->fd = memfd_create("assembly_snapshot", MFD_CLOEXEC);
+  if (snapshot->fd < 0 || ftruncate(snapshot->fd, bytes) != 0) {
+    if (snapshot->fd >= 0) close(snapshot->fd);
+    free(snapshot);
+    return NULL;
+  }
+
+  // the rest of the file reads as zeros without taking any memory
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  const char *data = (const char *)sys->memory.data;
+  for (size_t offset = 0; offset < (size_t)sys->memory.size * 4;
+       offset += page) {
+    size_t length = (size_t)sys->memory.size * 4 - offset < page
+                        ? (size_t)sys->memory.size * 4 - offset
+                        : page;
+    const int *words = (const int *)(data + offset);
+    size_t i = 0;
+    while (i < length / 4 && words[i] == 0) i++;
+    if (i < length / 4 &&
+        pwrite(snapshot->fd, data + offset, length, offset) != (ssize_t)length) {
+      close(snapshot->fd);
+      free(snapshot);
+      return NULL;
+    }
+  }
+
+  memcpy(snapshot->registers, sys->registers, sizeof(snapshot->registers));
+  snapshot->comparison_flag = sys->comparison_flag;
+  memcpy(snapshot->fusion_hits, sys->fusion_hits,
+         sizeof(snapshot->fusion_hits));
+  snapshot->memory_size = sys->memory.size;
+  snapshot->program = sys->memory.program;
+  __atomic_add_fetch(&snapshot->program->refcount, 1, __ATOMIC_RELAXED);
+  return snapshot;
+}
+
+/*
+Put the system back in the state of the snapshot: registers, program and data
+memory. The data memory maps the snapshot copy-on-write, so restoring costs
+nothing up front, and running afterwards only copies the pages it writes to.
+The system has to be initialized, its data memory takes the size of the
+snapshot; memory that changes size loses its guard pages. Returns 0 on success,
+and -1 if the data memory cannot be mapped.
+*/
+int restore_snapshot(System *sys, const Snapshot *snapshot) {
+  size_t bytes = data_bytes(snapshot->memory_size);
+  int same_size = sys->memory.data != NULL &&
+                  data_bytes(sys->memory.size) == bytes;
+  unsigned char *dirty = sys->memory.dirty;
+  if (dirty_bytes(sys->memory.size) != dirty_bytes(snapshot->memory_size)) {
+    dirty = (unsigned char *)calloc(dirty_bytes(snapshot->memory_size), 1);
+    if (dirty == NULL) return -1;
+  }
+  // the mapping of the same size is replaced where it is
+  void *data = mmap(same_size ? sys->memory.data : NULL, bytes,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_NORESERVE | (same_size ? MAP_FIXED : 0),
+                    snapshot->fd, 0);
+  if (data == MAP_FAILED) {
+    if (dirty != sys->memory.dirty) free(dirty);
+    return -1;
+  }
+  if (!same_size && sys->memory.data != NULL) unmap_data(&sys->memory);
+  if (dirty != sys->memory.dirty) free(sys->memory.dirty);
+  sys->memory.data = (int *)data;
+  sys->memory.dirty = dirty;
+  sys->memory.size = snapshot->memory_size;
+  sys->memory.data_from_snapshot = 1;
+
+  memcpy(sys->registers, snapshot->registers, sizeof(sys->registers));
+  sys->comparison_flag = snapshot->comparison_flag;
+  memcpy(sys->fusion_hits, snapshot->fusion_hits, sizeof(sys->fusion_hits));
+  if (sys->memory.program != snapshot->program) {
+    attach_program(sys, snapshot->program);
+  }
+  return 0;
+}
+
+/* Free the snapshot. Systems restored from it keep their data memory */
+void release_snapshot(Snapshot *snapshot) {
+  if (snapshot == NULL) return;
+  close(snapshot->fd);
+  release_program(snapshot->program);
+  free(snapshot);
+}
+
+/*
+Guard pages: guard_data_memory moves the data memory into the middle of a
+reservation of inaccessible pages, GUARD_SPAN bytes on either side, so that
+every int byte address lands either in the data or on a guard page.
+execute_instructions then runs the instructions that verify_instructions could
+not prove without their bounds checks (see step_guarded): an access out of
+bounds faults, and the SIGSEGV handler jumps back to execute_guarded, which
+stops the run there. Each instruction makes its accesses before it changes
+anything, so the system is left exactly as the checked instruction leaves it
+when it fails with MEMORY_ERROR.
+*/
+typedef struct Guard {
+  const char *begin, *end;  // the reservation of the running system
+  sigjmp_buf env;           // in execute_guarded
+} Guard;
+
+static __thread Guard *active_guard;  // of the run on this thread, if any
+static struct sigaction previous_segv;
+static pthread_once_t guard_handler_once = PTHREAD_ONCE_INIT;
+
+/* Jump back out of a fault on the guard pages of the running system. Any
+ * other fault goes to the handler that was installed before: it is put back,
+ * and the faulting instruction runs again */
+static void guard_fault(int signal, siginfo_t *info, void *context) {
+  (void)signal;
+  (void)context;
+  const char *address = (const char *)info->si_addr;
+  Guard *guard = active_guard;
+  if (guard != NULL && address >= guard->begin && address < guard->end) {
+    siglongjmp(guard->env, 1);
+  }
+  sigaction(SIGSEGV, &previous_segv, NULL);
+}
+
+static void install_guard_handler(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = guard_fault;
+  sigemptyset(&action.sa_mask);
+  // SIGSEGV stays unblocked in the handler, so that jumping out of it does
+  // not have to restore the signal mask
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGSEGV, &action, &previous_segv);
+}
+
+/*
+Move the data memory of the system between guard pages, see Guard. The pages
+are moved rather than copied, and the memory keeps its contents. Returns 0 on
+success or if the memory is guarded already, and -1 if its size is not a whole
+number of pages (the guard pages have to start right after the last word),
+pointers are too small for the reservation, or it cannot be mapped.
+*/
+int guard_data_memory(System *sys) {
+  if (sys->memory.guard != NULL) return 0;
+  size_t bytes = data_bytes(sys->memory.size);
+  if (sizeof(void *) < 8 || bytes != (size_t)sys->memory.size * 4) {
+    errno = EINVAL;
+    return -1;
+  }
+  void *guard = mmap(NULL, guard_bytes(sys->memory.size), PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (guard == MAP_FAILED) return -1;
+  void *data = mremap(sys->memory.data, bytes, bytes,
+                      MREMAP_MAYMOVE | MREMAP_FIXED, (char *)guard + GUARD_SPAN);
+  if (data == MAP_FAILED) {
+    munmap(guard, guard_bytes(sys->memory.size));
+    return -1;
+  }
+  pthread_once(&guard_handler_once, install_guard_handler);
+  sys->memory.data = (int *)data;
+  sys->memory.guard = (char *)guard;
+  return 0;
+}
+
+/* Free the data memory of the system and release its program image. The
+ * system has to be initialized again before it is used */
+void destroy_system(System *sys) {
+  if (sys->memory.data != NULL) unmap_data(&sys->memory);
+  free(sys->memory.dirty);
+  sys->memory.dirty = NULL;
+  release_program(sys->memory.program);
+  sys->memory.program = NULL;
+  sys->memory.instruction = NULL;
+  sys->memory.code = NULL;
+  sys->memory.label_table = NULL;
+  sys->memory.num_instructions = 0;
+  sys->memory.num_decoded = 0;
+}
+
+/* Zero the data memory: small memories are cleared in place, larger ones hand
+ * their pages back so that they cost nothing until touched again. Memory
+ * mapped from a snapshot is replaced by fresh memory, since handing its pages
+ * back would bring back the snapshot */
+static void clear_data(Memory *memory) {
+  size_t bytes = data_bytes(memory->size);
+  if (memory->data_from_snapshot &&
+      mmap(memory->data, bytes, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+           0) != MAP_FAILED) {
+    memory->data_from_snapshot = 0;
+    return;
+  }
+  if (memory->data_from_snapshot || bytes <= DATA_CLEAR_IN_PLACE ||
+      madvise(memory->data, bytes, MADV_DONTNEED) != 0) {
+    memset(memory->data, 0, (size_t)memory->size * 4);
+  }
+}
+
+/* Reset the registers, comparison flag and fusion counts */
+static void reset_registers(System *sys) {
   sys->registers[EAX] = 0;
   sys->registers[EDX] = 0;
   sys->registers[ECX] = 0;
-  sys->registers[ESP] = MEMORY_SIZE - 256;
-  sys->registers[EBP] = MEMORY_SIZE - 256;
+  sys->registers[ESP] = sys->memory.size - 256;
+  sys->registers[EBP] = sys->memory.size - 256;
   sys->registers[EIP] = 0;  // Program counter
+  sys->comparison_flag = 0;
+  memset(sys->fusion_hits, 0, sizeof(sys->fusion_hits));
+  sys->pause.verified = -1;
+}
 
-  sys->memory.num_instructions = 0;
-  for (int i = 0; i < MEMORY_SIZE; i++) {
-    sys->memory.instruction[i] = NULL;
-    sys->memory.data[i] = 0;
+/* Reset registers, data memory and the comparison flag to their initial
+ * state but keep the loaded program, so that it can run again */
+void reset_system(System *sys) {
+  clear_data(&sys->memory);
+  memset(sys->memory.dirty, 0, dirty_bytes(sys->memory.size));
+  reset_registers(sys);
+}
+
+/*
+Same as reset_system, but only zero the lines of data memory written since the
+last reset, which is much cheaper when a run touches a small part of a large
+memory. Every engine flags the lines it writes; data written through
+memory.data directly is not tracked, and has to be cleared with reset_system.
+Memory restored from a snapshot is reset with reset_system as well.
+*/
+void reset_system_dirty(System *sys) {
+  if (sys->memory.data_from_snapshot) {
+    reset_system(sys);
+    return;
   }
-  sys->comparison_flag = 0;
+  unsigned char *dirty = sys->memory.dirty;
+  size_t lines = dirty_bytes(sys->memory.size);
+  size_t line_words = (1 << DIRTY_LINE_SHIFT) / 4;
+  for (size_t first = 0; first < lines; first += 8) {
+    unsigned long long flags = 0;  // skip eight clean lines at a time
+    memcpy(&flags, &dirty[first], lines - first < 8 ? lines - first : 8);
+    if (flags == 0) continue;
+    for (size_t line = first; line < first + 8 && line < lines; line++) {
+      if (!dirty[line]) continue;
+      size_t word = line * line_words;
+      size_t words = (size_t)sys->memory.size - word < line_words
+                         ? (size_t)sys->memory.size - word
+                         : line_words;
+      memset(&sys->memory.data[word], 0, words * 4);
+      dirty[line] = 0;
+    }
+  }
+  reset_registers(sys);
 }
 
 /* Remove leading and extra space, and \n from the input string and return the
@@ -45,32 +508,238 @@ int reformat(char *line) {
   return size;
 }
 
+/* Set bit i of *newlines and *spaces when block[i] is a newline or a space,
+ * for the 64 bytes of the block */
+static inline void scan_block(const char *block, uint64_t *newlines,
+                              uint64_t *spaces) {
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n'), space = _mm_set1_epi8(' ');
+  uint64_t n = 0, s = 0;
+  for (int i = 0; i < SCAN_BLOCK; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+    n |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline))
+         << i;
+    s |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, space))
+         << i;
+  }
+  *newlines = n;
+  *spaces = s;
+#else
+  *newlines = *spaces = 0;
+  for (int i = 0; i < SCAN_BLOCK; i++) {
+    *newlines |= (uint64_t)(block[i] == '\n') << i;
+    *spaces |= (uint64_t)(block[i] == ' ') << i;
+  }
+#endif
+}
+
+/* Scan the block at offset of the source, which may be the short last one:
+ * that one is scanned from a zero-padded copy. Returns the block length */
+static size_t scan_source(const char *source, size_t size, size_t offset,
+                          uint64_t *newlines, uint64_t *spaces) {
+  if (size - offset >= SCAN_BLOCK) {
+    scan_block(source + offset, newlines, spaces);
+    return SCAN_BLOCK;
+  }
+  char tail[SCAN_BLOCK] = {0};
+  memcpy(tail, source + offset, size - offset);
+  scan_block(tail, newlines, spaces);
+  return size - offset;
+}
+
+/*
+Map the whole file for reading. Files that cannot be mapped, such as pipes and
+empty files, are read into memory instead, and *mapped tells which one it was.
+Returns NULL if the file cannot be read.
+*/
+static char *map_source(int fd, size_t *size, int *mapped) {
+  struct stat st;
+  *size = 0;
+  *mapped = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (source != MAP_FAILED) {
+      madvise(source, st.st_size, MADV_SEQUENTIAL);
+      *size = st.st_size;
+      *mapped = 1;
+      return (char *)source;
+    }
+  }
+
+  size_t capacity = 0;
+  char *source = NULL;
+  for (;;) {
+    if (*size == capacity) {
+      capacity = capacity ? 2 * capacity : 1 << 16;
+      char *grown = (char *)realloc(source, capacity);
+      if (grown == NULL) break;
+      source = grown;
+    }
+    ssize_t got = read(fd, source + *size, capacity - *size);
+    if (got == 0) return source;
+    if (got < 0 && errno != EINTR) break;
+    if (got > 0) *size += got;
+  }
+  free(source);
+  return NULL;
+}
+
+/* Record the line from start to the terminator at end of the image text.
+ * Returns 1 if it is the END line, after which loading stops */
+static inline int end_line(Program *program, char *start, const char *end) {
+  program->instruction[program->num_instructions++] = start;
+  // Reach out the end of the instruction
+  return end - start == 3 && memcmp(start, "END", 3) == 0;
+}
+
+/*
+Copy the lines of the source into the image text, laid out one after the other
+and formatted as reformat does: leading spaces are dropped, runs of spaces are
+collapsed to one, and empty lines are skipped. Lines have no length limit, and
+the last one does not need a newline. Loading stops after the END line.
+
+The source is scanned 64 bytes at a time for newlines and spaces. A space is
+dropped when the byte before it is a space or a newline. Most blocks have no
+byte to drop and no empty line, and are copied whole, with their newlines
+turned into terminators in place. The others are copied piece by piece between
+the bytes that are dropped or end a line.
+*/
+static void fill_program(Program *program, const char *source, size_t size,
+                         char *text) {
+  char *line = text;  // start of the line being copied
+  uint64_t after_break = 1;  // the previous byte was a space or newline
+
+  for (size_t offset = 0; offset < size; offset += SCAN_BLOCK) {
+    uint64_t newlines, spaces;
+    size_t length = scan_source(source, size, offset, &newlines, &spaces);
+    uint64_t dropped =
+        spaces & ((spaces << 1) | (newlines << 1) | after_break);
+    uint64_t empty = newlines & ((newlines << 1) | (text == line));
+    after_break = ((newlines | spaces) >> (length - 1)) & 1;
+    const char *block = source + offset;
+
+    if ((dropped | empty) == 0) {
+      memcpy(text, block, length);
+      for (; newlines != 0; newlines &= newlines - 1) {
+        char *end = text + __builtin_ctzll(newlines);
+        *end = '\0';
+        if (end_line(program, line, end)) return;
+        line = end + 1;
+      }
+      text += length;
+      continue;
+    }
+
+    uint64_t events = newlines | dropped;
+    size_t copied = 0;
+    for (; events != 0; events &= events - 1) {
+      size_t at = __builtin_ctzll(events);
+      memcpy(text, block + copied, at - copied);
+      text += at - copied;
+      copied = at + 1;
+      if (!((newlines >> at) & 1) || text == line) continue;
+
+      *text = '\0';
+      if (end_line(program, line, text++)) return;
+      line = text;
+    }
+    memcpy(text, block + copied, length - copied);
+    text += length - copied;
+  }
+  if (text != line) {
+    *text = '\0';
+    end_line(program, line, text);
+  }
+}
+
+/*
+Load a program from a file into a new image, and decode it, see
+load_program_text. Returns NULL if the file cannot be read or memory cannot be
+allocated; the caller holds the only reference to the image.
+*/
+Program *load_program(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  size_t size;
+  int mapped;
+  char *source = map_source(fd, &size, &mapped);
+  close(fd);
+  if (source == NULL) return NULL;
+
+  Program *program = load_program_text(source, size);
+  if (mapped) {
+    munmap(source, size);
+  } else {
+    free(source);
+  }
+  return program;
+}
+
+/*
+Load a program from size bytes of source text into a new image, and decode it.
+The text is scanned twice, once to count its lines and once to copy them into
+the image, which is allocated in one piece in between. Returns NULL if memory
+cannot be allocated; the caller holds the only reference to the image.
+*/
+Program *load_program_text(const char *source, size_t size) {
+  // every line but the last ends with a newline, and the lines take no more
+  // text than the source plus the terminator of an unfinished last line
+  size_t lines = 1;
+  for (size_t offset = 0; offset < size; offset += SCAN_BLOCK) {
+    uint64_t newlines, spaces;
+    scan_source(source, size, offset, &newlines, &spaces);
+    lines += __builtin_popcountll(newlines);
+  }
+
+  Program *program = NULL;
+  if (lines <= MAX_PROGRAM_LINES) {
+    program = allocate_program(lines, size + 1);
+  } else {
+    errno = EFBIG;
+  }
+  if (program != NULL) {
+    fill_program(program, source, size,
+                 (char *)(program->label_table + program->label_table_size));
+  }
+  if (program == NULL) return NULL;
+
+  // decode through a system that holds nothing but the image
+  System loader;
+  use_program(&loader.memory, program);
+  decode_instructions(&loader);
+  program->num_decoded = program->num_instructions;
+  return program;
+}
+
 /* Load all the instruction from the file into the instruction segment in the
- * system */
-void load_instructions_from_file(System *sys, const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
+ * system. Jumps and calls to undefined labels are reported on stderr, and the
+ * number of them is returned */
+int load_instructions_from_file(System *sys, const char *filename) {
+  return attach_loaded_program(sys, load_program(filename), filename);
+}
+
+/* Attach the image just loaded from the file to the system, which takes over
+ * the caller's reference, and report undefined labels the same way as
+ * load_instructions_from_file. Exits if the image could not be loaded */
+int attach_loaded_program(System *sys, Program *program, const char *filename) {
+  if (program == NULL) {
     perror("Error opening file");
     exit(EXIT_FAILURE);
   }
+  attach_program(sys, program);
+  release_program(program);
 
-  char line[256];
-  int address = 0;
-
-  while (fgets(line, sizeof(line), file) != NULL && address < MEMORY_SIZE) {
-    // Remove newline character
-    line[strlen(line) - 1] = '\0';
-    // Save instruction to the memory
-    int size = reformat(line);
-    if (size == 0) continue;
-    sys->memory.instruction[address] = strdup(line);
-    address++;
-    // Reach out the end of the instruction
-    if (strcmp(line, "END") == 0) break;
+  int undefined = 0;
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    Opcode opcode = sys->memory.code[i].opcode;
+    if (opcode >= OP_JMP && opcode <= OP_CALL &&
+        sys->memory.code[i].target == -1) {
+      fprintf(stderr, "%s: undefined label at address %d: %s\n", filename,
+              i * 4, sys->memory.instruction[i]);
+      undefined++;
+    }
   }
-  sys->memory.num_instructions = address;
-
-  fclose(file);
+  return undefined;
 }
 
 /* Return value could be the name of one of the valid registers, or NOT_REG for
@@ -85,6 +754,25 @@ RegisterName get_register_by_name(const char *name) {
   return NOT_REG;  // indicate this is not a register
 }
 
+/* Return the opcode for an instruction name. Any other name starting with J is
+ * a jump that is never taken, and everything else is OP_NOP */
+Opcode get_opcode_by_name(const char *name) {
+  if (strcmp(name, "MOVL") == 0) return OP_MOVL;
+  if (strcmp(name, "ADDL") == 0) return OP_ADDL;
+  if (strcmp(name, "PUSHL") == 0) return OP_PUSHL;
+  if (strcmp(name, "POPL") == 0) return OP_POPL;
+  if (strcmp(name, "CMPL") == 0) return OP_CMPL;
+  if (strcmp(name, "CALL") == 0) return OP_CALL;
+  if (strcmp(name, "RET") == 0) return OP_RET;
+  if (strcmp(name, "JMP") == 0) return OP_JMP;
+  if (strcmp(name, "JE") == 0) return OP_JE;
+  if (strcmp(name, "JNE") == 0) return OP_JNE;
+  if (strcmp(name, "JL") == 0) return OP_JL;
+  if (strcmp(name, "JG") == 0) return OP_JG;
+  if (name[0] == 'J') return OP_JNEVER;
+  return OP_NOP;
+}
+
 /*
 This function accepts an operand that can be represented in different formats:
 registers, memory, or constant values. For example, a valid operand could be
@@ -110,14 +798,15 @@ MemoryType get_memory_type(const char *operand) {
       result.type = CONST;
       result.value = atoi(&operand[1]);
     } else if (strstr(operand, "(") && strstr(operand, ")")) {
-      char str[5];
+      // long enough for any register and ')', longer names are cut off
+      char str[16] = "";
       if (operand[0] == '(') {
-        sscanf(operand, "(%s)", str);
+        sscanf(operand, "(%15s)", str);
         result.value = 0;
       } else {
-        sscanf(operand, "%d(%s", &result.value, str);
+        sscanf(operand, "%d(%15s", &result.value, str);
       }
-      str[strlen(str) - 1] = '\0';
+      if (str[0] != '\0') str[strlen(str) - 1] = '\0';
       result.reg = get_register_by_name(str);
       if (result.reg != NOT_REG) {
         result.type = MEM;
@@ -127,6 +816,55 @@ MemoryType get_memory_type(const char *operand) {
   return result;
 }
 
+/* FNV-1a hash of a label, used to index the label symbol table */
+static unsigned int hash_label(const char *label) {
+  unsigned int hash = 2166136261u;
+  for (; *label; label++) {
+    hash = (hash ^ (unsigned char)*label) * 16777619u;
+  }
+  return hash;
+}
+
+/* Fill the label symbol table with every label line of the instruction
+ * segment. If a label is defined twice, the first definition wins */
+static void build_label_table(System *sys) {
+  int mask = sys->memory.label_table_size - 1;
+
+  memset(sys->memory.label_table, 0,
+         sys->memory.label_table_size * sizeof(int));
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    const char *line = sys->memory.instruction[i];
+    if (line == NULL || line[0] != '.') continue;
+
+    unsigned int slot = hash_label(line) & mask;
+    while (sys->memory.label_table[slot] != 0 &&
+           strcmp(sys->memory.instruction[sys->memory.label_table[slot] - 1],
+                  line) != 0) {
+      slot = (slot + 1) & mask;
+    }
+    if (sys->memory.label_table[slot] == 0) {
+      sys->memory.label_table[slot] = i + 1;
+    }
+  }
+}
+
+/* Look a label up in the label symbol table, see get_addr_from_label */
+static int lookup_label(System *sys, const char *label) {
+  if (label[0] != '.') {
+    return -1;
+  }
+  int mask = sys->memory.label_table_size - 1;
+  unsigned int slot = hash_label(label) & mask;
+  while (sys->memory.label_table[slot] != 0) {
+    int idx = sys->memory.label_table[slot] - 1;
+    if (strcmp(sys->memory.instruction[idx], label) == 0) {
+      return (idx + 1) * 4;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
 /*
 This function takes a string that represnts a label in the instruction.
 It returns the memory address of the next instruction
@@ -134,15 +872,155 @@ corresponding to the label in the system. It returns -1 if the label is not
 found or the label does not come with . as the first character
 */
 int get_addr_from_label(System *sys, const char *label) {
-  if (label[0] != '.') {
-    return -1;
+  // The symbol table is built together with the decoded instructions
+  if (sys->memory.num_decoded != sys->memory.num_instructions) {
+    decode_instructions(sys);
   }
+  return lookup_label(sys, label);
+}
+
+/* Parse an operand that may be missing from the instruction line */
+static MemoryType decode_operand(const char *operand) {
+  MemoryType unknown = {UNKNOWN, NOT_REG, -1};
+  return operand ? get_memory_type(operand) : unknown;
+}
+
+/*
+Decode every line of the instruction segment into sys->memory.code, so that
+execution never has to look at the instruction text again. The label symbol
+table is rebuilt first, and jump and call targets are resolved through it.
+*/
+void decode_instructions(System *sys) {
+  char line[256];
+
+  build_label_table(sys);
+  sys->memory.program->optimized = 0;
+  sys->memory.program->removed = 0;
+  sys->memory.program->revision++;
+
   for (int i = 0; i < sys->memory.num_instructions; i++) {
-    if (strcmp(sys->memory.instruction[i], label) == 0) {
-      return (i + 1) * 4;
+    Instruction *decoded = &sys->memory.code[i];
+    const char *raw_line = sys->memory.instruction[i];
+    MemoryType unknown = {UNKNOWN, NOT_REG, -1};
+
+    decoded->opcode = OP_NOP;
+    decoded->src = unknown;
+    decoded->dst = unknown;
+    decoded->target = -1;
+    decoded->fusion = FUSION_NONE;
+    decoded->folded = 0;
+
+    if (raw_line == NULL || strcmp(raw_line, "END") == 0) {
+      decoded->opcode = OP_END;
+      continue;
     }
+
+    // lines have no length limit, the long ones are split up in a copy
+    size_t length = strlen(raw_line);
+    char *inst = length < sizeof(line) ? line : (char *)malloc(length + 1);
+    if (inst == NULL) continue;
+    memcpy(inst, raw_line, length + 1);
+    char *opcode = strtok(inst, " ,");
+    if (opcode == NULL || opcode[0] == '.') {
+      if (inst != line) free(inst);
+      continue;
+    }
+
+    decoded->opcode = get_opcode_by_name(opcode);
+    switch (decoded->opcode) {
+      case OP_MOVL:
+      case OP_ADDL:
+      case OP_CMPL: {
+        char *src = strtok(NULL, " ,");
+        char *dst = strtok(NULL, " ,");
+        decoded->src = decode_operand(src);
+        decoded->dst = decode_operand(dst);
+        break;
+      }
+      case OP_PUSHL:
+      case OP_POPL:
+        decoded->src = decode_operand(strtok(NULL, " ,"));
+        break;
+      case OP_RET:
+      case OP_NOP:
+      case OP_END:
+        break;
+      default: {  // jumps and CALL
+        char *label = strtok(NULL, " ,");
+        if (label) decoded->target = lookup_label(sys, label);
+        break;
+      }
+    }
+    if (inst != line) free(inst);
+  }
+  sys->memory.num_decoded = sys->memory.num_instructions;
+  fuse_instructions(sys);
+  verify_instructions(sys);
+}
+
+static int is_jump(Opcode opcode) {
+  return opcode >= OP_JMP && opcode <= OP_JNEVER;
+}
+
+/* A register operand other than %EIP */
+static int is_plain_register(MemoryType operand) {
+  return operand.type == REG && operand.reg != EIP;
+}
+
+/*
+Mark the starts of frequent instruction sequences in the decoded program, so
+that the interpreter executes each sequence as one superinstruction:
+- CMPL followed by a jump
+- PUSHL %X followed by POPL %Y, a register move through the stack
+- ADDL $k %R, CMPL between registers and constants, and a jump, the step and
+  test of a counting loop
+- constant MOVL and ADDL to a register, folded by optimize_instructions
+Sequences involving %EIP, which can redirect execution in the middle, and POPL
+to %ESP are not fused. Only records whose fusion changes are written, as in
+verify_instructions.
+*/
+void fuse_instructions(System *sys) {
+  int num = sys->memory.num_instructions;
+  Instruction *code = sys->memory.code;
+
+  for (int i = 0; i < num; i++) {
+    Fusion fusion = FUSION_NONE;
+    if (i + 2 < num && code[i].opcode == OP_ADDL &&
+        code[i].src.type == CONST && is_plain_register(code[i].dst) &&
+        code[i + 1].opcode == OP_CMPL &&
+        (code[i + 1].src.type == CONST || is_plain_register(code[i + 1].src)) &&
+        (code[i + 1].dst.type == CONST || is_plain_register(code[i + 1].dst)) &&
+        is_jump(code[i + 2].opcode)) {
+      fusion = FUSION_ADDL_CMPL_JCC;
+    } else if (i + 1 < num && code[i].opcode == OP_CMPL &&
+               is_jump(code[i + 1].opcode)) {
+      fusion = FUSION_CMPL_JCC;
+    } else if (i + 1 < num && code[i].opcode == OP_PUSHL &&
+               is_plain_register(code[i].src) &&
+               code[i + 1].opcode == OP_POPL &&
+               is_plain_register(code[i + 1].src) &&
+               code[i + 1].src.reg != ESP) {
+      fusion = FUSION_PUSH_POP;
+    } else if (code[i].folded > 0) {
+      fusion = FUSION_CONST_FOLD;
+    }
+    if (code[i].fusion != fusion) code[i].fusion = fusion;
+  }
+}
+
+/* Print how many superinstructions of each kind the program has, and how
+ * often they were executed */
+void print_fusion_stats(const System *sys, FILE *out) {
+  static const char *names[] = {"", "CMPL+Jcc", "PUSHL+POPL",
+                                "ADDL+CMPL+Jcc", "constant fold"};
+  for (int fusion = FUSION_NONE + 1; fusion < NUM_FUSIONS; fusion++) {
+    int sites = 0;
+    for (int i = 0; i < sys->memory.num_decoded; i++) {
+      if (sys->memory.code[i].fusion == fusion) sites++;
+    }
+    fprintf(out, "%-14s sites %4d hits %lld\n", names[fusion], sites,
+            sys->fusion_hits[fusion]);
   }
-  return -1;
 }
 
 
@@ -166,9 +1044,11 @@ Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
 ExecResult execute_movl(System *sys, char *src, char *dst) {
-  MemoryType src_duc = get_memory_type(src);
-  MemoryType dst_duc = get_memory_type(dst);
+  return execute_movl_decoded(sys, get_memory_type(src), get_memory_type(dst));
+}
 
+ExecResult execute_movl_decoded(System *sys, MemoryType src_duc,
+                                MemoryType dst_duc) {
   if (src_duc.type == UNKNOWN || dst_duc.type == UNKNOWN) {
     return INSTRUCTION_ERROR;
   }
@@ -195,7 +1075,7 @@ ExecResult execute_movl(System *sys, char *src, char *dst) {
   else if (src_duc.type == MEM) {
     address = sys->registers[src_duc.reg] + src_duc.value;
 
-    if (address < 0 || address > (MEMORY_SIZE - 1) * 4 || address % 4 != 0) {
+    if (address < 0 || address > (sys->memory.size - 1) * 4 || address % 4 != 0) {
       return MEMORY_ERROR;
     }
 
@@ -210,11 +1090,11 @@ ExecResult execute_movl(System *sys, char *src, char *dst) {
   else if (dst_duc.type == MEM) {
     address = sys->registers[dst_duc.reg] + dst_duc.value;
 
-    if (address < 0 || address > (MEMORY_SIZE - 1) * 4 || address % 4 != 0) {
+    if (address < 0 || address > (sys->memory.size - 1) * 4 || address % 4 != 0) {
       return MEMORY_ERROR;
     }
 
-    sys->memory.data[address / 4] = src_value;
+    store_data(&sys->memory, address, src_value);
   }
 
   return SUCCESS;
@@ -240,9 +1120,11 @@ Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
 ExecResult execute_addl(System *sys, char *src, char *dst) {
-  MemoryType src_duc = get_memory_type(src);
-  MemoryType dst_duc = get_memory_type(dst);
+  return execute_addl_decoded(sys, get_memory_type(src), get_memory_type(dst));
+}
 
+ExecResult execute_addl_decoded(System *sys, MemoryType src_duc,
+                                MemoryType dst_duc) {
   if (src_duc.type == UNKNOWN || dst_duc.type == UNKNOWN)
     return INSTRUCTION_ERROR;
 
@@ -263,7 +1145,7 @@ ExecResult execute_addl(System *sys, char *src, char *dst) {
     src_value = src_duc.value;
   else {
     src_address = sys->registers[src_duc.reg] + src_duc.value;
-    if (src_address < 0 || src_address > (MEMORY_SIZE - 1) * 4 || src_address % 4 != 0)
+    if (src_address < 0 || src_address > (sys->memory.size - 1) * 4 || src_address % 4 != 0)
       return MEMORY_ERROR;
     src_value = sys->memory.data[src_address / 4];
   }
@@ -272,7 +1154,7 @@ ExecResult execute_addl(System *sys, char *src, char *dst) {
     dst_value = sys->registers[dst_duc.reg];
   else {
     dst_address = sys->registers[dst_duc.reg] + dst_duc.value;
-    if (dst_address < 0 || dst_address > (MEMORY_SIZE - 1) * 4 || dst_address % 4 != 0)
+    if (dst_address < 0 || dst_address > (sys->memory.size - 1) * 4 || dst_address % 4 != 0)
       return MEMORY_ERROR;
     dst_value = sys->memory.data[dst_address / 4];
   }
@@ -282,7 +1164,7 @@ ExecResult execute_addl(System *sys, char *src, char *dst) {
   if (dst_duc.type == REG)
     sys->registers[dst_duc.reg] = result;
   else
-    sys->memory.data[dst_address / 4] = result;
+    store_data(&sys->memory, dst_address, result);
 
   return SUCCESS;
 }
@@ -307,9 +1189,10 @@ Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
 ExecResult execute_push(System *sys, char *src) {
-  MemoryType src_duc = get_memory_type(src);
+  return execute_push_decoded(sys, get_memory_type(src));
+}
 
-  
+ExecResult execute_push_decoded(System *sys, MemoryType src_duc) {
   if (src_duc.type == UNKNOWN) {
     return INSTRUCTION_ERROR;
   }
@@ -329,7 +1212,7 @@ ExecResult execute_push(System *sys, char *src) {
     src_address = sys->registers[src_duc.reg] + src_duc.value;
 
     if (src_address < 0 || 
-        src_address > (MEMORY_SIZE - 1) * 4 || 
+        src_address > (sys->memory.size - 1) * 4 || 
         src_address % 4 != 0) {
       return MEMORY_ERROR;
     }
@@ -343,12 +1226,12 @@ ExecResult execute_push(System *sys, char *src) {
   int new_esp = old_esp - 4;
 
  
-  if (new_esp < 4 || new_esp >= MEMORY_SIZE * 4 || new_esp % 4 != 0) {
+  if (new_esp < 4 || new_esp >= sys->memory.size * 4 || new_esp % 4 != 0) {
     return MEMORY_ERROR;
   }
 
   
-  sys->memory.data[new_esp / 4] = src_value;
+  store_data(&sys->memory, new_esp, src_value);
 
  
 
@@ -376,15 +1259,17 @@ Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
 ExecResult execute_pop(System *sys, char *dst) {
-    MemoryType dst_duc = get_memory_type(dst);
+  return execute_pop_decoded(sys, get_memory_type(dst));
+}
 
+ExecResult execute_pop_decoded(System *sys, MemoryType dst_duc) {
     if (dst_duc.type == UNKNOWN || dst_duc.type == CONST) {
         return INSTRUCTION_ERROR;
     }
 
     int old_esp = sys->registers[ESP];
 
-    if (old_esp < 0 || old_esp > (MEMORY_SIZE - 1) * 4 || old_esp % 4 != 0) {
+    if (old_esp < 0 || old_esp > (sys->memory.size - 1) * 4 || old_esp % 4 != 0) {
         return MEMORY_ERROR;
     }
 
@@ -392,7 +1277,7 @@ ExecResult execute_pop(System *sys, char *dst) {
     int incremented_esp = old_esp + 4;
 
     
-    if (incremented_esp < 0 || incremented_esp > MEMORY_SIZE * 4) {
+    if (incremented_esp < 0 || incremented_esp > sys->memory.size * 4) {
         return MEMORY_ERROR;
     }
 
@@ -406,11 +1291,11 @@ ExecResult execute_pop(System *sys, char *dst) {
     } else { // MEM Case
         int dst_address = sys->registers[dst_duc.reg] + dst_duc.value;
 
-        if (dst_address < 0 || dst_address > (MEMORY_SIZE - 1) * 4 || dst_address % 4 != 0) {
+        if (dst_address < 0 || dst_address > (sys->memory.size - 1) * 4 || dst_address % 4 != 0) {
             return MEMORY_ERROR;
         }
 
-        sys->memory.data[dst_address / 4] = value;
+        store_data(&sys->memory, dst_address, value);
         sys->registers[ESP] = incremented_esp;
     }
 
@@ -436,10 +1321,11 @@ Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
 ExecResult execute_cmpl(System *sys, char *src, char *dst) {
-  MemoryType src_duc = get_memory_type(src);
-  MemoryType dst_duc = get_memory_type(dst);
-
+  return execute_cmpl_decoded(sys, get_memory_type(src), get_memory_type(dst));
+}
 
+ExecResult execute_cmpl_decoded(System *sys, MemoryType src_duc,
+                                MemoryType dst_duc) {
   if (src_duc.type == UNKNOWN || dst_duc.type == UNKNOWN) {
     return INSTRUCTION_ERROR;
   }
@@ -459,7 +1345,7 @@ ExecResult execute_cmpl(System *sys, char *src, char *dst) {
     src_value = src_duc.value;
   } else if (src_duc.type == MEM) {
     address = sys->registers[src_duc.reg] + src_duc.value;
-    if (address < 0 || address > (MEMORY_SIZE - 1) * 4 || address % 4 != 0) {
+    if (address < 0 || address > (sys->memory.size - 1) * 4 || address % 4 != 0) {
       return MEMORY_ERROR;
     }
     src_value = sys->memory.data[address / 4];
@@ -473,7 +1359,7 @@ ExecResult execute_cmpl(System *sys, char *src, char *dst) {
     dst_value = dst_duc.value; 
   } else if (dst_duc.type == MEM) {
     address = sys->registers[dst_duc.reg] + dst_duc.value;
-    if (address < 0 || address > (MEMORY_SIZE - 1) * 4 || address % 4 != 0) {
+    if (address < 0 || address > (sys->memory.size - 1) * 4 || address % 4 != 0) {
       return MEMORY_ERROR;
     }
     dst_value = sys->memory.data[address / 4];
@@ -508,9 +1394,12 @@ Please update program counter (EIP) in this function.
 HINT: you may use get_addr_from_label in this function.
 */
 ExecResult execute_jmp(System *sys, char *condition, char *dst) {
-  int target_address = get_addr_from_label(sys, dst);
-
+  return execute_jmp_decoded(sys, get_opcode_by_name(condition),
+                             get_addr_from_label(sys, dst));
+}
 
+ExecResult execute_jmp_decoded(System *sys, Opcode condition,
+                               int target_address) {
   if (target_address == -1) {
    
     return PC_ERROR;
@@ -518,15 +1407,15 @@ ExecResult execute_jmp(System *sys, char *condition, char *dst) {
 
   int should_jump = 0;
 
-  if (strcmp(condition, "JMP") == 0) {
+  if (condition == OP_JMP) {
     should_jump = 1;
-  } else if (strcmp(condition, "JE") == 0) {
+  } else if (condition == OP_JE) {
     if (sys->comparison_flag == 0) should_jump = 1;
-  } else if (strcmp(condition, "JNE") == 0) {
+  } else if (condition == OP_JNE) {
     if (sys->comparison_flag != 0) should_jump = 1;
-  } else if (strcmp(condition, "JL") == 0) {
+  } else if (condition == OP_JL) {
     if (sys->comparison_flag == -1) should_jump = 1;
-  } else if (strcmp(condition, "JG") == 0) {
+  } else if (condition == OP_JG) {
     if (sys->comparison_flag == 1) should_jump = 1;
   }
 
@@ -554,7 +1443,10 @@ Please update program counter (EIP) in this function.
 HINT: you may use get_addr_from_label in this function.
 */
 ExecResult execute_call(System *sys, char *dst) {
-  int target_address = get_addr_from_label(sys, dst);
+  return execute_call_decoded(sys, get_addr_from_label(sys, dst));
+}
+
+ExecResult execute_call_decoded(System *sys, int target_address) {
   if (target_address == -1) {
     return PC_ERROR;
   }
@@ -565,12 +1457,12 @@ ExecResult execute_call(System *sys, char *dst) {
   int new_esp = old_esp - 4;
 
   
-  if (new_esp < 4 || new_esp >= MEMORY_SIZE * 4 || new_esp % 4 != 0) {
+  if (new_esp < 4 || new_esp >= sys->memory.size * 4 || new_esp % 4 != 0) {
     return MEMORY_ERROR;
   }
 
  
-  sys->memory.data[new_esp / 4] = return_address;
+  store_data(&sys->memory, new_esp, return_address);
 
   
   sys->registers[ESP] = new_esp;
@@ -594,7 +1486,7 @@ ExecResult execute_ret(System *sys) {
   int current_esp = sys->registers[ESP];
 
   
-  if (current_esp < 0 || current_esp > (MEMORY_SIZE - 1) * 4 || current_esp % 4 != 0) {
+  if (current_esp < 0 || current_esp > (sys->memory.size - 1) * 4 || current_esp % 4 != 0) {
     return MEMORY_ERROR;
   }
   int ret_addr = sys->memory.data[current_esp / 4];
@@ -609,19 +1501,485 @@ ExecResult execute_ret(System *sys) {
 }
 
 /*
-Utilizing the EIP register's value (also known as the program counter), the
-function fetches instructions from the instruction segment in system memory. It
-then executes each instruction, which can be one of MOVL, ADDL PUSHL, POPL,
-CMPL, CALL, RET, JMP, JNE, JE, JL, or JG, by employing the corresponding execute
-functions. This process continues until the program encounters any Error status
-or the END instruction. During the execution, it will ignore all the
-instructions that are not listed above and continue to the next one.
-Please update program counter (EIP) for MOVL, ADDL, PUSHL, POPL, and CMPL in
-this function.
+Execute one decoded instruction, the one at EIP, and update the program counter
+(EIP) the same way execute_instructions does. Labels and unrecognized
+instructions just move on to the next instruction. END is not executed here:
+callers have to stop when they reach it.
 */
-void execute_instructions(System *sys) {
-  char inst[256];
+static inline ExecResult step_decoded(System *sys, const Instruction *inst) {
+  ExecResult result;
+  int eip_before = sys->registers[EIP];
+
+  switch (inst->opcode) {
+    case OP_MOVL:
+      result = execute_movl_decoded(sys, inst->src, inst->dst);
+      break;
+    case OP_ADDL:
+      result = execute_addl_decoded(sys, inst->src, inst->dst);
+      break;
+    case OP_PUSHL:
+      result = execute_push_decoded(sys, inst->src);
+      break;
+    case OP_POPL:
+      result = execute_pop_decoded(sys, inst->src);
+      break;
+    case OP_CMPL:
+      result = execute_cmpl_decoded(sys, inst->src, inst->dst);
+      break;
+    case OP_CALL:
+      result = execute_call_decoded(sys, inst->target);
+      break;
+    case OP_RET:
+      result = execute_ret(sys);
+      break;
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JNEVER:
+      result = execute_jmp_decoded(sys, inst->opcode, inst->target);
+      break;
+    case OP_END:
+      return SUCCESS;
+    default:
+      // Labels and unrecognized instructions
+      sys->registers[EIP] += 4;
+      return SUCCESS;
+  }
+
+  if (result == SUCCESS) {
+    if (sys->registers[EIP] == eip_before) {
+      sys->registers[EIP] += 4;
+    }
+  }
+  return result;
+}
+
+ExecResult execute_decoded(System *sys, const Instruction *inst) {
+  return step_decoded(sys, inst);
+}
+
+/*
+Memory size that the instructions proven by verify_instructions can be run
+without bounds checks for: those with a safe_size up to it. The proofs only
+hold for runs that start where the verifier assumes, at EIP 0 with ESP and EBP
+at the initial stack pointer; for any other run this is -1, and every
+instruction keeps its checks.
+*/
+static inline int verified_size(const System *sys) {
+  int stack = sys->memory.size - 256;
+  return sys->registers[EIP] == 0 && sys->registers[ESP] == stack &&
+                 sys->registers[EBP] == stack && sys->memory.size % 4 == 0
+             ? sys->memory.size
+             : -1;
+}
+
+/* Address of a memory operand */
+static inline int operand_address(const System *sys, MemoryType operand) {
+  return sys->registers[operand.reg] + operand.value;
+}
+
+/* Value of a register, constant or memory operand, without bounds checks */
+static inline int load_unchecked(const System *sys, MemoryType operand) {
+  if (operand.type == CONST) return operand.value;
+  if (operand.type == REG) return sys->registers[operand.reg];
+  return sys->memory.data[operand_address(sys, operand) / 4];
+}
+
+/*
+The execute_*_decoded functions without their checks, for the instructions
+verify_instructions has proven: their operands are well formed, they do not
+write EIP, and every data address they use is in bounds and aligned. Each
+leaves the system exactly as the checked function would.
+*/
+static inline void movl_unchecked(System *sys, const Instruction *inst) {
+  int value = load_unchecked(sys, inst->src);
+  if (inst->dst.type == REG) {
+    sys->registers[inst->dst.reg] = value;
+  } else {
+    store_data(&sys->memory, operand_address(sys, inst->dst), value);
+  }
+}
+
+static inline void addl_unchecked(System *sys, const Instruction *inst) {
+  int result = load_unchecked(sys, inst->dst) + load_unchecked(sys, inst->src);
+  if (inst->dst.type == REG) {
+    sys->registers[inst->dst.reg] = result;
+  } else {
+    store_data(&sys->memory, operand_address(sys, inst->dst), result);
+  }
+}
+
+static inline void cmpl_unchecked(System *sys, const Instruction *inst) {
+  int src_value = load_unchecked(sys, inst->src);
+  int dst_value = load_unchecked(sys, inst->dst);
+  sys->comparison_flag = dst_value == src_value ? 0
+                         : dst_value > src_value ? 1
+                                                 : -1;
+}
+
+static inline void push_unchecked(System *sys, const Instruction *inst) {
+  int value = load_unchecked(sys, inst->src);
+  int new_esp = sys->registers[ESP] - 4;
+  store_data(&sys->memory, new_esp, value);
+  sys->registers[ESP] = new_esp;
+}
+
+static inline void pop_unchecked(System *sys, const Instruction *inst) {
+  int old_esp = sys->registers[ESP];
+  int value = sys->memory.data[old_esp / 4];
+  if (inst->src.type == REG) {
+    sys->registers[inst->src.reg] = value;
+    sys->registers[ESP] += 4;  // popping into ESP leaves it at value + 4
+  } else {
+    store_data(&sys->memory, operand_address(sys, inst->src), value);
+    sys->registers[ESP] = old_esp + 4;
+  }
+}
+
+static inline void call_unchecked(System *sys, const Instruction *inst) {
+  int new_esp = sys->registers[ESP] - 4;
+  store_data(&sys->memory, new_esp, sys->registers[EIP] + 4);
+  sys->registers[ESP] = new_esp;
+  sys->registers[EIP] = inst->target;
+}
+
+static inline ExecResult ret_unchecked(System *sys) {
+  int current_esp = sys->registers[ESP];
+  int ret_addr = sys->memory.data[current_esp / 4];
+  if (ret_addr < 0 || ret_addr >= sys->memory.num_instructions * 4 ||
+      ret_addr % 4 != 0) {
+    return PC_ERROR;
+  }
+  sys->registers[EIP] = ret_addr;
+  sys->registers[ESP] = current_esp + 4;
+  return SUCCESS;
+}
+
+/* step_decoded for an instruction proven by verify_instructions */
+static inline ExecResult step_unchecked(System *sys, const Instruction *inst) {
+  ExecResult result = SUCCESS;
+  int eip_before = sys->registers[EIP];
+
+  switch (inst->opcode) {
+    case OP_MOVL:
+      movl_unchecked(sys, inst);
+      break;
+    case OP_ADDL:
+      addl_unchecked(sys, inst);
+      break;
+    case OP_CMPL:
+      cmpl_unchecked(sys, inst);
+      break;
+    case OP_PUSHL:
+      push_unchecked(sys, inst);
+      break;
+    case OP_POPL:
+      pop_unchecked(sys, inst);
+      break;
+    case OP_CALL:
+      call_unchecked(sys, inst);
+      break;
+    case OP_RET:
+      result = ret_unchecked(sys);
+      break;
+    default:
+      return step_decoded(sys, inst);
+  }
+  if (result == SUCCESS && sys->registers[EIP] == eip_before) {
+    sys->registers[EIP] += 4;
+  }
+  return result;
+}
+
+/* Load and store a word of guarded data memory, see Guard. The barriers make
+ * every earlier write to the system land before an access that may fault, and
+ * the store to the data before its line is flagged */
+static inline int guarded_load(const Memory *memory, int address) {
+  __asm__ __volatile__("" ::: "memory");
+  return ((const volatile int *)memory->data)[address / 4];
+}
+
+static inline void guarded_store(Memory *memory, int address, int value) {
+  __asm__ __volatile__("" ::: "memory");
+  ((volatile int *)memory->data)[address / 4] = value;
+  __asm__ __volatile__("" ::: "memory");
+  memory->dirty[address >> DIRTY_LINE_SHIFT] = 1;
+}
+
+/* Value of an operand of step_guarded. Only misaligned addresses are checked,
+ * those out of bounds fault */
+static inline ExecResult load_guarded(const System *sys, MemoryType operand,
+                                      int *value) {
+  if (operand.type != MEM) {
+    *value = operand.type == CONST ? operand.value : sys->registers[operand.reg];
+    return SUCCESS;
+  }
+  int address = operand_address(sys, operand);
+  if (address % 4 != 0) return MEMORY_ERROR;
+  *value = guarded_load(&sys->memory, address);
+  return SUCCESS;
+}
+
+static inline ExecResult store_guarded(System *sys, MemoryType operand,
+                                       int value) {
+  if (operand.type == REG) {
+    sys->registers[operand.reg] = value;
+    return SUCCESS;
+  }
+  int address = operand_address(sys, operand);
+  if (address % 4 != 0) return MEMORY_ERROR;
+  guarded_store(&sys->memory, address, value);
+  return SUCCESS;
+}
+
+/*
+step_decoded for a system with guarded data memory (see Guard): the same
+results, with the alignment checks kept and the bounds checks left to the
+guard pages. Pushes keep the check for address 0, which is in bounds but not
+a valid stack slot. Malformed instructions go to step_decoded.
+*/
+static inline ExecResult step_guarded(System *sys, const Instruction *inst) {
+  ExecResult result;
+  int eip_before = sys->registers[EIP];
+  MemoryType src = inst->src, dst = inst->dst;
+  int src_value, dst_value;
+  int esp = sys->registers[ESP];
+
+  switch (inst->opcode) {
+    case OP_MOVL:
+    case OP_ADDL:
+      if (src.type == UNKNOWN || dst.type == UNKNOWN || dst.type == CONST ||
+          (src.type == MEM && dst.type == MEM)) {
+        return step_decoded(sys, inst);
+      }
+      result = load_guarded(sys, src, &src_value);
+      if (result == SUCCESS && inst->opcode == OP_ADDL) {
+        result = load_guarded(sys, dst, &dst_value);
+        src_value = dst_value + src_value;
+      }
+      if (result == SUCCESS) result = store_guarded(sys, dst, src_value);
+      break;
+    case OP_CMPL:
+      if (src.type == UNKNOWN || dst.type == UNKNOWN ||
+          (src.type == MEM && dst.type == MEM)) {
+        return step_decoded(sys, inst);
+      }
+      result = load_guarded(sys, src, &src_value);
+      if (result == SUCCESS) result = load_guarded(sys, dst, &dst_value);
+      if (result == SUCCESS) {
+        sys->comparison_flag = dst_value == src_value ? 0
+                               : dst_value > src_value ? 1
+                                                       : -1;
+      }
+      break;
+    case OP_PUSHL:
+      if (src.type == UNKNOWN) return step_decoded(sys, inst);
+      result = load_guarded(sys, src, &src_value);
+      if (result == SUCCESS && (esp % 4 != 0 || esp == 4)) result = MEMORY_ERROR;
+      if (result == SUCCESS) {
+        guarded_store(&sys->memory, esp - 4, src_value);
+        sys->registers[ESP] = esp - 4;
+      }
+      break;
+    case OP_POPL:
+      if (src.type == UNKNOWN || src.type == CONST) {
+        return step_decoded(sys, inst);
+      }
+      if (esp % 4 != 0) return MEMORY_ERROR;
+      src_value = guarded_load(&sys->memory, esp);
+      if (src.type == REG) {
+        sys->registers[src.reg] = src_value;
+        sys->registers[ESP] += 4;  // popping into ESP leaves it at value + 4
+        result = SUCCESS;
+      } else {
+        result = store_guarded(sys, src, src_value);
+        if (result == SUCCESS) sys->registers[ESP] = esp + 4;
+      }
+      break;
+    case OP_CALL:
+      if (inst->target == -1) return PC_ERROR;
+      if (esp % 4 != 0 || esp == 4) return MEMORY_ERROR;
+      guarded_store(&sys->memory, esp - 4, eip_before + 4);
+      sys->registers[ESP] = esp - 4;
+      sys->registers[EIP] = inst->target;
+      result = SUCCESS;
+      break;
+    case OP_RET:
+      if (esp % 4 != 0) return MEMORY_ERROR;
+      src_value = guarded_load(&sys->memory, esp);
+      if (src_value < 0 || src_value >= sys->memory.num_instructions * 4 ||
+          src_value % 4 != 0) {
+        return PC_ERROR;
+      }
+      sys->registers[EIP] = src_value;
+      sys->registers[ESP] = esp + 4;
+      result = SUCCESS;
+      break;
+    default:
+      return step_decoded(sys, inst);
+  }
+  if (result == SUCCESS && sys->registers[EIP] == eip_before) {
+    sys->registers[EIP] += 4;
+  }
+  return result;
+}
+
+/* Value of a register (not %EIP) or constant operand */
+static inline int plain_value(const System *sys, MemoryType operand) {
+  return operand.type == CONST ? operand.value : sys->registers[operand.reg];
+}
+
+/* Finish a superinstruction with the jump at the given address: update EIP
+ * the way execute_jmp_decoded and execute_instructions would */
+static inline ExecResult finish_jump(System *sys, const Instruction *jump,
+                                     int address) {
+  int taken = 0;
+
+  sys->registers[EIP] = address;
+  if (jump->target == -1) return PC_ERROR;
+
+  switch (jump->opcode) {
+    case OP_JMP:
+      taken = 1;
+      break;
+    case OP_JE:
+      taken = sys->comparison_flag == 0;
+      break;
+    case OP_JNE:
+      taken = sys->comparison_flag != 0;
+      break;
+    case OP_JL:
+      taken = sys->comparison_flag == -1;
+      break;
+    case OP_JG:
+      taken = sys->comparison_flag == 1;
+      break;
+    default:
+      break;
+  }
+  // a jump to itself moves on, like any instruction that leaves EIP alone
+  sys->registers[EIP] =
+      taken && jump->target != address ? jump->target : address + 4;
+  return SUCCESS;
+}
+
+/*
+Execute the superinstruction starting at EIP (see fuse_instructions). The
+result, registers, memory and EIP are the same as after executing each of its
+instructions with execute_decoded, including when one of them fails.
+*/
+static inline ExecResult step_fused(System *sys, const Instruction *inst) {
+  int address = sys->registers[EIP];
+  ExecResult result;
+
+  sys->fusion_hits[inst->fusion]++;
+  switch (inst->fusion) {
+    case FUSION_CMPL_JCC:
+      result = execute_cmpl_decoded(sys, inst[0].src, inst[0].dst);
+      if (result != SUCCESS) return result;
+      return finish_jump(sys, &inst[1], address + 4);
+
+    case FUSION_PUSH_POP: {
+      int value = sys->registers[inst[0].src.reg];
+      int new_esp = sys->registers[ESP] - 4;
+      if (new_esp < 4 || new_esp >= sys->memory.size * 4 || new_esp % 4 != 0) {
+        return MEMORY_ERROR;
+      }
+      // the pop reads back the slot just written, and ESP ends where it was
+      store_data(&sys->memory, new_esp, value);
+      sys->registers[inst[1].src.reg] = value;
+      sys->registers[EIP] = address + 8;
+      return SUCCESS;
+    }
+
+    case FUSION_ADDL_CMPL_JCC: {
+      Registers *reg = &sys->registers[inst[0].dst.reg];
+      *reg = (int)((unsigned)*reg + (unsigned)inst[0].src.value);
+
+      int src_value = plain_value(sys, inst[1].src);
+      int dst_value = plain_value(sys, inst[1].dst);
+      sys->comparison_flag = dst_value == src_value ? 0
+                             : dst_value > src_value ? 1
+                                                     : -1;
+      return finish_jump(sys, &inst[2], address + 8);
+    }
+
+    case FUSION_CONST_FOLD: {
+      Registers *reg = &sys->registers[inst->dst.reg];
+      unsigned base = inst->opcode == OP_MOVL ? 0 : (unsigned)*reg;
+      *reg = (int)(base + (unsigned)inst->target);
+      sys->registers[EIP] = address + 4 * (inst->folded + 1);
+      return SUCCESS;
+    }
+
+    default:
+      return step_decoded(sys, inst);
+  }
+}
+
+/* Instructions a superinstruction stands for, labels included */
+static inline int fused_length(const Instruction *inst) {
+  switch (inst->fusion) {
+    case FUSION_ADDL_CMPL_JCC:
+      return 3;
+    case FUSION_CONST_FOLD:
+      return inst->folded + 1;
+    case FUSION_NONE:
+      return 1;
+    default:
+      return 2;
+  }
+}
+
+/*
+Memory size a run that goes on from where run_for stopped was verified for
+(see verified_size), if the system is still exactly as run_for left it, and -1
+otherwise
+*/
+static inline int paused_verified_size(const System *sys) {
+  const Pause *pause = &sys->pause;
+  return pause->verified == sys->memory.size &&
+                 pause->code == sys->memory.code &&
+                 pause->comparison_flag == sys->comparison_flag &&
+                 memcmp(pause->registers, sys->registers,
+                        sizeof(sys->registers)) == 0
+             ? pause->verified
+             : -1;
+}
+
+/* Cycle counter read around every instruction by the profiler */
+static inline unsigned long long profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/*
+The loop of execute_instructions, which also fills in the profile when there
+is one. It is inlined into its callers: execute_instructions passes NULL, so
+the profiling code is compiled out of it. Profiled runs do not fuse
+instructions, so that every address is counted on its own, and keep every
+bounds check. Guarded runs leave the bounds checks to the guard pages, see
+execute_guarded. With a budget of 0 or more, the run stops once it has executed
+that many instructions, at the next jump or other write to EIP, see run_for.
+*/
+static inline __attribute__((always_inline)) RunStatus run_instructions(
+    System *sys, Profile *profile, int guarded, long long budget) {
   ExecResult result = SUCCESS;
+  long long executed = 0;
+
+  // The instruction segment may have been filled in without loading a file
+  if (sys->memory.num_decoded != sys->memory.num_instructions) {
+    decode_instructions(sys);
+  }
+  int verified = verified_size(sys);
+  if (budget >= 0 && verified < 0) verified = paused_verified_size(sys);
 
   while (result == SUCCESS) {
     int current_pc = sys->registers[EIP];
@@ -631,68 +1989,302 @@ void execute_instructions(System *sys) {
       break; 
     }
 
-    char *raw_line = sys->memory.instruction[instruction_idx];
-    if (raw_line == NULL || strcmp(raw_line, "END") == 0) break;
-
-    strcpy(inst, raw_line);
-    
-
-    char *opcode = strtok(inst, " ,");
-    
-    
-    if (opcode == NULL || opcode[0] == '.') {
-      sys->registers[EIP] += 4;
+    const Instruction *inst = &sys->memory.code[instruction_idx];
+    if (inst->opcode == OP_END) break;
+    if (profile != NULL && instruction_idx < profile->num_instructions) {
+      unsigned long long start = profile_clock();
+      result = step_decoded(sys, inst);
+      unsigned long long cycles = profile_clock() - start;
+      profile->opcode_executions[inst->opcode]++;
+      profile->opcode_cycles[inst->opcode] += cycles;
+      profile->executions[instruction_idx]++;
+      profile->cycles[instruction_idx] += cycles;
+      if (result == SUCCESS && sys->registers[EIP] != current_pc + 4) {
+        profile->taken[instruction_idx]++;  // reported for jumps only
+      }
+      profile->contexts[profile->context].executions++;
+      if (result == SUCCESS && inst->opcode == OP_CALL) {
+        profile_call(profile, sys, current_pc);
+      } else if (result == SUCCESS && inst->opcode == OP_RET) {
+        profile_return(profile, sys);
+      }
       continue;
     }
-
-    int eip_before = sys->registers[EIP];
-
-    
-    if (strcmp(opcode, "MOVL") == 0) {
-      char *src = strtok(NULL, " ,");
-      char *dst = strtok(NULL, " ,");
-      result = execute_movl(sys, src, dst);
-
-    } else if (strcmp(opcode, "ADDL") == 0) {
-      char *src = strtok(NULL, " ,");
-      char *dst = strtok(NULL, " ,");
-      result = execute_addl(sys, src, dst);
-
-    } else if (strcmp(opcode, "PUSHL") == 0) {
-      char *src = strtok(NULL, " ,");
-      result = execute_push(sys, src);
-
-    } else if (strcmp(opcode, "POPL") == 0) {
-      char *dst = strtok(NULL, " ,");
-      result = execute_pop(sys, dst);
-
-    } else if (strcmp(opcode, "CMPL") == 0) {
-      char *src = strtok(NULL, " ,");
-      char *dst = strtok(NULL, " ,");
-      result = execute_cmpl(sys, src, dst);
-
-    } else if (strcmp(opcode, "CALL") == 0) {
-      char *label = strtok(NULL, " ,");
-      result = execute_call(sys, label);
-
-    } else if (strcmp(opcode, "RET") == 0) {
-      result = execute_ret(sys);
-
-    } else if (opcode[0] == 'J') { 
-      char *label = strtok(NULL, " ,");
-      result = execute_jmp(sys, opcode, label);
-      
+    if (inst->fusion != FUSION_NONE) {
+      result = step_fused(sys, inst);
+    } else if (inst->safe_size <= verified) {
+      result = step_unchecked(sys, inst);
+    } else if (guarded) {
+      result = step_guarded(sys, inst);
     } else {
-      // Unrecognized instruction
-      sys->registers[EIP] += 4;
-      continue;
+      result = step_decoded(sys, inst);
     }
 
-    
-    if (result == SUCCESS) {
-      if (sys->registers[EIP] == eip_before) {
-        sys->registers[EIP] += 4;
+    // the budget is only checked where the run can loop
+    if (budget >= 0) {
+      executed += fused_length(inst);
+      if (executed >= budget && result == SUCCESS &&
+          sys->registers[EIP] != current_pc + 4) {
+        memcpy(sys->pause.registers, sys->registers, sizeof(sys->registers));
+        sys->pause.comparison_flag = sys->comparison_flag;
+        sys->pause.verified = verified;
+        sys->pause.code = sys->memory.code;
+        return RUN_BUDGET;
       }
     }
   }
+  return result == SUCCESS ? RUN_FINISHED : RUN_ERROR;
+}
+
+/*
+Utilizing the EIP register's value (also known as the program counter), the
+function fetches instructions from the decoded instruction segment in system
+memory. It then executes each instruction, which can be one of MOVL, ADDL PUSHL,
+POPL, CMPL, CALL, RET, JMP, JNE, JE, JL, or JG, by employing the corresponding
+execute functions. This process continues until the program encounters any
+Error status or the END instruction. During the execution, it will ignore all
+the instructions that are not listed above and continue to the next one.
+Please update program counter (EIP) for MOVL, ADDL, PUSHL, POPL, and CMPL in
+this function.
+*/
+static RunStatus execute_guarded(System *sys, long long budget);
+
+void execute_instructions(System *sys) {
+  if (sys->memory.guard != NULL) {
+    execute_guarded(sys, -1);
+  } else {
+    run_instructions(sys, NULL, 0, -1);
+  }
+}
+
+/*
+Run the program in the system for about max_instructions instructions, and
+return whether it finished, failed, or ran out of budget first. The budget is
+only checked at jumps, calls, returns and other writes to EIP, so a slice can
+go over it by the instructions up to the next one of them; labels count as
+instructions. A run that ran out of budget goes on exactly where it stopped
+with the next call, which can come from any thread: everything it needs is in
+the system. Slices run the same way as execute_instructions does, and keep
+the bounds checks off that verify_instructions proved unnecessary for a run
+started at EIP 0 as long as the system is not changed between them.
+*/
+RunStatus run_for(System *sys, long long max_instructions) {
+  if (max_instructions < 0) max_instructions = 0;
+  if (sys->memory.guard != NULL) return execute_guarded(sys, max_instructions);
+  return run_instructions(sys, NULL, 0, max_instructions);
+}
+
+/* The loop of execute_guarded, kept out of it so that it is not compiled in a
+ * function that calls sigsetjmp */
+static __attribute__((noinline)) RunStatus run_guarded(System *sys,
+                                                       long long budget) {
+  return run_instructions(sys, NULL, 1, budget);
+}
+
+/* execute_instructions or run_for on guarded data memory, see Guard. A fault
+ * on the guard pages ends the run here, at the instruction that made it */
+static RunStatus execute_guarded(System *sys, long long budget) {
+  Guard guard;
+  Guard *outer = active_guard;
+  guard.begin = sys->memory.guard;
+  guard.end = sys->memory.guard + guard_bytes(sys->memory.size);
+  if (sigsetjmp(guard.env, 0) == 0) {
+    active_guard = &guard;
+    RunStatus status = run_guarded(sys, budget);
+    active_guard = outer;
+    return status;
+  }
+  active_guard = outer;
+  return RUN_ERROR;
+}
+
+/* Same as execute_instructions, counting every instruction in the profile,
+ * which has to be created for the program of the system, see create_profile */
+void execute_instructions_profiled(System *sys, Profile *profile) {
+  run_instructions(sys, profile, 0, -1);
+}
+
+/*
+execute_instructions_threaded has exactly the same behavior as
+execute_instructions, but uses direct-threaded dispatch: before running, every
+decoded instruction is translated to the address of its handler, and each
+handler jumps straight to the handler of the next instruction with a computed
+goto. Every handler then ends in its own indirect branch, which the branch
+predictor can learn per instruction instead of sharing one dispatch branch.
+*/
+#if defined(__GNUC__)
+void execute_instructions_threaded(System *sys) {
+  static const void *handlers[] = {
+      [OP_NOP] = &&do_nop,     [OP_MOVL] = &&do_movl, [OP_ADDL] = &&do_addl,
+      [OP_PUSHL] = &&do_push,  [OP_POPL] = &&do_pop,  [OP_CMPL] = &&do_cmpl,
+      [OP_JMP] = &&do_jmp,     [OP_JE] = &&do_jmp,    [OP_JNE] = &&do_jmp,
+      [OP_JL] = &&do_jmp,      [OP_JG] = &&do_jmp,    [OP_JNEVER] = &&do_jmp,
+      [OP_CALL] = &&do_call,   [OP_RET] = &&do_ret,   [OP_END] = &&do_end};
+  static const void *fused_handlers[] = {
+      [FUSION_NONE] = NULL, [FUSION_CMPL_JCC] = &&do_fused,
+      [FUSION_PUSH_POP] = &&do_fused, [FUSION_ADDL_CMPL_JCC] = &&do_fused,
+      [FUSION_CONST_FOLD] = &&do_fused};
+  // instructions proven by verify_instructions, see verified_size
+  static const void *unchecked_handlers[] = {
+      [OP_NOP] = &&do_nop,
+      [OP_MOVL] = &&do_movl_unchecked,
+      [OP_ADDL] = &&do_addl_unchecked,
+      [OP_PUSHL] = &&do_push_unchecked,
+      [OP_POPL] = &&do_pop_unchecked,
+      [OP_CMPL] = &&do_cmpl_unchecked,
+      [OP_JMP] = &&do_jmp,
+      [OP_JE] = &&do_jmp,
+      [OP_JNE] = &&do_jmp,
+      [OP_JL] = &&do_jmp,
+      [OP_JG] = &&do_jmp,
+      [OP_JNEVER] = &&do_jmp,
+      [OP_CALL] = &&do_call_unchecked,
+      [OP_RET] = &&do_ret_unchecked,
+      [OP_END] = &&do_end};
+  const void *local_thread[MEMORY_SIZE];
+  const void **thread = local_thread;
+  const Instruction *inst;
+  int num_instructions, instruction_idx, eip_before, verified;
+  ExecResult result;
+
+  if (sys->memory.num_decoded != sys->memory.num_instructions) {
+    decode_instructions(sys);
+  }
+  num_instructions = sys->memory.num_instructions;
+  if (num_instructions > MEMORY_SIZE) {
+    thread = (const void **)malloc(num_instructions * sizeof(void *));
+    if (thread == NULL) {
+      execute_instructions(sys);
+      return;
+    }
+  }
+  verified = verified_size(sys);
+  for (int i = 0; i < num_instructions; i++) {
+    const Instruction *decoded = &sys->memory.code[i];
+    thread[i] = decoded->fusion != FUSION_NONE
+                    ? fused_handlers[decoded->fusion]
+                : decoded->safe_size <= verified
+                    ? unchecked_handlers[decoded->opcode]
+                    : handlers[decoded->opcode];
+  }
+
+#define DISPATCH()                                                        \
+  do {                                                                    \
+    eip_before = sys->registers[EIP];                                     \
+    instruction_idx = eip_before / 4;                                     \
+    if (instruction_idx < 0 || instruction_idx >= num_instructions) {     \
+      goto done;                                                          \
+    }                                                                     \
+    inst = &sys->memory.code[instruction_idx];                            \
+    goto *thread[instruction_idx];                                        \
+  } while (0)
+
+#define NEXT()                                                     \
+  do {                                                             \
+    if (result != SUCCESS) goto done;                              \
+    if (sys->registers[EIP] == eip_before) sys->registers[EIP] += 4; \
+    DISPATCH();                                                    \
+  } while (0)
+
+  DISPATCH();
+
+do_nop:
+  sys->registers[EIP] += 4;
+  DISPATCH();
+do_movl:
+  result = execute_movl_decoded(sys, inst->src, inst->dst);
+  NEXT();
+do_addl:
+  result = execute_addl_decoded(sys, inst->src, inst->dst);
+  NEXT();
+do_push:
+  result = execute_push_decoded(sys, inst->src);
+  NEXT();
+do_pop:
+  result = execute_pop_decoded(sys, inst->src);
+  NEXT();
+do_cmpl:
+  result = execute_cmpl_decoded(sys, inst->src, inst->dst);
+  NEXT();
+do_jmp:
+  result = execute_jmp_decoded(sys, inst->opcode, inst->target);
+  NEXT();
+do_call:
+  result = execute_call_decoded(sys, inst->target);
+  NEXT();
+do_ret:
+  result = execute_ret(sys);
+  NEXT();
+do_movl_unchecked:
+  movl_unchecked(sys, inst);
+  sys->registers[EIP] += 4;
+  DISPATCH();
+do_addl_unchecked:
+  addl_unchecked(sys, inst);
+  sys->registers[EIP] += 4;
+  DISPATCH();
+do_push_unchecked:
+  push_unchecked(sys, inst);
+  sys->registers[EIP] += 4;
+  DISPATCH();
+do_pop_unchecked:
+  pop_unchecked(sys, inst);
+  sys->registers[EIP] += 4;
+  DISPATCH();
+do_cmpl_unchecked:
+  cmpl_unchecked(sys, inst);
+  sys->registers[EIP] += 4;
+  DISPATCH();
+do_call_unchecked:
+  call_unchecked(sys, inst);
+  result = SUCCESS;
+  NEXT();
+do_ret_unchecked:
+  result = ret_unchecked(sys);
+  NEXT();
+do_fused:
+  // superinstructions leave EIP at the instruction to run next
+  if (step_fused(sys, inst) != SUCCESS) goto done;
+  DISPATCH();
+do_end:
+done:
+  if (thread != local_thread) free(thread);
+
+#undef NEXT
+#undef DISPATCH
+}
+#else
+void execute_instructions_threaded(System *sys) { execute_instructions(sys); }
+#endif
+
+/* Return the engine for a name given on the command line, or -1 if there is
+ * no engine with that name */
+int get_engine_by_name(const char *name) {
+  if (strcmp(name, "switch") == 0) return ENGINE_SWITCH;
+  if (strcmp(name, "threaded") == 0) return ENGINE_THREADED;
+  if (strcmp(name, "jit") == 0) return ENGINE_JIT;
+  if (strcmp(name, "aot") == 0) return ENGINE_AOT;
+  if (strcmp(name, "lockstep") == 0) return ENGINE_LOCKSTEP;
+  return -1;
+}
+
+/* Run the program in the system with the selected execution engine */
+void execute_with_engine(System *sys, Engine engine) {
+  switch (engine) {
+    case ENGINE_THREADED:
+      execute_instructions_threaded(sys);
+      break;
+    case ENGINE_JIT:
+      execute_instructions_jit(sys);
+      break;
+    case ENGINE_AOT:
+      execute_instructions_aot(sys);
+      break;
+    case ENGINE_LOCKSTEP:
+      execute_instructions_lockstep(sys, 1);
+      break;
+    default:
+      execute_instructions(sys);
+      break;
+  }
 }
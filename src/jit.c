@@ -0,0 +1,635 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "interpreter.h"
+
+/*
+Basic-block JIT compiler for x86-64.
+
+execute_instructions_jit interprets the program like execute_instructions, but
+counts how often each instruction is reached. Once an instruction has been
+reached JIT_HOT_THRESHOLD times, the straight-line run of instructions starting
+there (up to and including the next J*, CALL, RET or END) is translated to
+native code in an mmap'd buffer. While native code runs, the guest registers
+EAX, EDX, ECX, ESP, EBP and the comparison flag live in host registers, and
+blocks jump directly to each other through a table indexed by instruction.
+
+Native code only ever leaves the system in a state the interpreter could have
+produced: every check that could fail (memory bounds, stack bounds, return
+address) runs before the instruction changes anything, and a failed check exits
+to the interpreter with EIP at that instruction. The interpreter then executes
+it again and returns the exact same MEMORY_ERROR or PC_ERROR.
+
+Instructions the JIT does not translate (operands that are unknown, constant
+destinations, memory to memory, anything using %EIP, jumps to undefined labels)
+end the block and are left to the interpreter.
+
+Batches, the server and the scheduler run one program over and over, so the
+compiled blocks and the hit counts outlive a run: every thread keeps the JIT of
+the last program it ran, and the next run of the same image (same revision, and
+same data memory size) on that thread goes on with it. The JIT holds a
+reference to the image, so the image cannot be freed and another one take its
+place at the same address while it is kept.
+*/
+
+#if defined(__x86_64__)
+
+#define JIT_HOT_THRESHOLD 8
+#define JIT_BUFFER_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64           // instructions per block
+#define JIT_MAX_INSTRUCTION 160    // bytes of native code per instruction
+#define JIT_MAX_FIXUPS 8           // failing checks per instruction
+
+// status returned by native code, with EIP stored in the system
+enum { JIT_EXIT_DISPATCH, JIT_EXIT_FALLBACK, JIT_EXIT_END };
+
+// x86-64 register numbers
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// condition codes for Jcc
+enum { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_A = 0x7,
+       CC_AE = 0x3 };
+
+// host register holding each guest register (EIP is never pinned)
+static const int host_reg[] = {RBX, R12, R13, R14, R15};
+#define HOST_FLAG RBP   // comparison_flag
+#define HOST_SYS RDI    // System *, first argument of the entry stub
+#define HOST_TABLE RSI  // block table, second argument of the entry stub
+#define HOST_DATA R8    // sys->memory.data, loaded by the entry stub
+#define HOST_DIRTY R9   // sys->memory.dirty, loaded by the entry stub
+
+#define REG_OFFSET(reg) \
+  ((int)(offsetof(System, registers) + (reg) * sizeof(Registers)))
+#define FLAG_OFFSET ((int)offsetof(System, comparison_flag))
+#define DATA_OFFSET ((int)offsetof(System, memory.data))  // the pointer
+#define DIRTY_OFFSET ((int)offsetof(System, memory.dirty))
+
+typedef int (*JitEntry)(System *sys, void **table, void *block);
+
+typedef struct Jit {
+  unsigned char *buffer;
+  size_t used;       // bytes of the buffer in use
+  size_t stubs_end;  // bytes used by the entry and exit stubs
+  unsigned char *exit_stub;      // eax = status, ecx = EIP
+  unsigned char *dispatch_exit;  // exit with JIT_EXIT_DISPATCH, ecx = EIP
+  JitEntry enter;
+  Program *program;  // the image compiled, which the JIT holds a reference to
+  int revision;      // of the image when the JIT was created
+  const Instruction *code;
+  int num_instructions;
+  int memory_size;  // words of data memory of the system
+  void **table;     // native block starting at each instruction, and one more
+  int *hits;
+  unsigned char *uncompilable;
+} Jit;
+
+/*** x86-64 encoding ***/
+
+static void emit8(Jit *jit, int byte) {
+  jit->buffer[jit->used++] = (unsigned char)byte;
+}
+
+static void emit32(Jit *jit, int value) {
+  memcpy(jit->buffer + jit->used, &value, 4);
+  jit->used += 4;
+}
+
+static void emit_rex(Jit *jit, int wide, int reg, int index, int base) {
+  int rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) |
+            (base >> 3);
+  if (rex != 0x40) emit8(jit, rex);
+}
+
+/* op reg, rm with both operands in registers */
+static void emit_reg_op(Jit *jit, int wide, int op, int reg, int rm) {
+  emit_rex(jit, wide, reg, 0, rm);
+  emit8(jit, op);
+  emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [base + index * (1 << scale) + disp]; index < 0 for none */
+static void emit_mem_op(Jit *jit, int wide, int op, int reg, int base,
+                        int index, int scale, int disp) {
+  emit_rex(jit, wide, reg, index < 0 ? 0 : index, base);
+  emit8(jit, op);
+  if (index < 0 && (base & 7) != RSP) {
+    emit8(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+  } else {
+    emit8(jit, 0x80 | ((reg & 7) << 3) | RSP);
+    emit8(jit, (scale << 6) | ((index < 0 ? RSP : index) & 7) << 3 |
+                   (base & 7));
+  }
+  emit32(jit, disp);
+}
+
+static void emit_mov_imm(Jit *jit, int reg, int imm) {
+  emit_rex(jit, 0, 0, 0, reg);
+  emit8(jit, 0xB8 + (reg & 7));
+  emit32(jit, imm);
+}
+
+/* add/cmp/test reg, imm: ext is the opcode extension in the modrm byte */
+static void emit_alu_imm(Jit *jit, int op, int ext, int reg, int imm) {
+  emit_reg_op(jit, 0, op, ext, reg);
+  emit32(jit, imm);
+}
+#define emit_add_imm(jit, reg, imm) emit_alu_imm(jit, 0x81, 0, reg, imm)
+#define emit_cmp_imm(jit, reg, imm) emit_alu_imm(jit, 0x81, 7, reg, imm)
+#define emit_test_imm(jit, reg, imm) emit_alu_imm(jit, 0xF7, 0, reg, imm)
+
+/* lea dst32, [base + disp], wrapping around like 32-bit int addition */
+static void emit_lea(Jit *jit, int dst, int base, int disp) {
+  emit_mem_op(jit, 0, 0x8D, dst, base, -1, 0, disp);
+}
+
+/* Emit a Jcc or JMP (cc < 0) with a rel32 to be patched, return its offset */
+static size_t emit_jump(Jit *jit, int cc) {
+  if (cc < 0) {
+    emit8(jit, 0xE9);
+  } else {
+    emit8(jit, 0x0F);
+    emit8(jit, 0x80 | cc);
+  }
+  emit32(jit, 0);
+  return jit->used - 4;
+}
+
+static void patch_jump(Jit *jit, size_t at, const unsigned char *target) {
+  int rel = (int)(target - (jit->buffer + at + 4));
+  memcpy(jit->buffer + at, &rel, 4);
+}
+
+static void emit_jump_to(Jit *jit, int cc, const unsigned char *target) {
+  patch_jump(jit, emit_jump(jit, cc), target);
+}
+
+/* Load a guest data word into dst: [data + index] */
+static void emit_load_data(Jit *jit, int dst, int index) {
+  emit_mem_op(jit, 0, 0x8B, dst, HOST_DATA, index, 0, 0);
+}
+
+/* Flag the line of data memory at byte address index as written:
+ * mov r11d, index; shr r11d, DIRTY_LINE_SHIFT; mov byte [dirty + r11], 1 */
+static void emit_mark_dirty(Jit *jit, int index) {
+  emit_reg_op(jit, 0, 0x89, index, R11);
+  emit_reg_op(jit, 0, 0xC1, 5, R11);
+  emit8(jit, DIRTY_LINE_SHIFT);
+  emit_mem_op(jit, 0, 0xC6, 0, HOST_DIRTY, R11, 0, 0);
+  emit8(jit, 1);
+}
+
+/* Store src into the guest data word at [data + index] */
+static void emit_store_data(Jit *jit, int src, int index) {
+  emit_mem_op(jit, 0, 0x89, src, HOST_DATA, index, 0, 0);
+  emit_mark_dirty(jit, index);
+}
+
+/*** block compiler ***/
+
+typedef struct Fixups {
+  size_t at[JIT_MAX_FIXUPS];
+  int count;
+} Fixups;
+
+/* Jump to the side exit of the current instruction when cc holds */
+static void emit_check(Jit *jit, Fixups *fail, int cc) {
+  fail->at[fail->count++] = emit_jump(jit, cc);
+}
+
+/* Compute the address of a memory operand into RDX and check it the way the
+ * execute_* functions do: 0 <= address <= (size - 1) * 4, aligned */
+static void emit_address(Jit *jit, Fixups *fail, MemoryType operand) {
+  emit_lea(jit, RDX, host_reg[operand.reg], operand.value);
+  emit_test_imm(jit, RDX, 3);
+  emit_check(jit, fail, CC_NE);
+  emit_cmp_imm(jit, RDX, (jit->memory_size - 1) * 4);
+  emit_check(jit, fail, CC_A);
+}
+
+/* Load the value of a register, constant or memory operand into dst */
+static void emit_operand(Jit *jit, Fixups *fail, int dst, MemoryType operand) {
+  if (operand.type == REG) {
+    emit_reg_op(jit, 0, 0x89, host_reg[operand.reg], dst);
+  } else if (operand.type == CONST) {
+    emit_mov_imm(jit, dst, operand.value);
+  } else {
+    emit_address(jit, fail, operand);
+    emit_load_data(jit, dst, RDX);
+  }
+}
+
+/* Check that new_esp (in ECX) is a valid slot to push to */
+static void emit_push_check(Jit *jit, Fixups *fail) {
+  emit_test_imm(jit, RCX, 3);
+  emit_check(jit, fail, CC_NE);
+  emit_cmp_imm(jit, RCX, 4);
+  emit_check(jit, fail, CC_L);
+  emit_cmp_imm(jit, RCX, jit->memory_size * 4);
+  emit_check(jit, fail, CC_GE);
+}
+
+/* Check that ESP points at a valid slot to pop from */
+static void emit_pop_check(Jit *jit, Fixups *fail) {
+  emit_test_imm(jit, host_reg[ESP], 3);
+  emit_check(jit, fail, CC_NE);
+  emit_cmp_imm(jit, host_reg[ESP], (jit->memory_size - 1) * 4);
+  emit_check(jit, fail, CC_A);
+}
+
+/* Continue at instruction idx: jump to its block if it has one, otherwise
+ * leave native code with EIP = idx * 4 */
+static void emit_goto(Jit *jit, int idx) {
+  emit_mov_imm(jit, RCX, idx * 4);
+  emit_mem_op(jit, 1, 0x8B, RDX, HOST_TABLE, -1, 0, idx * 8);
+  emit_reg_op(jit, 1, 0x85, RDX, RDX);
+  emit_jump_to(jit, CC_E, jit->dispatch_exit);
+  emit_reg_op(jit, 0, 0xFF, 4, RDX);  // jmp rdx
+}
+
+static void emit_exit(Jit *jit, int status, int idx) {
+  emit_mov_imm(jit, RCX, idx * 4);
+  emit_mov_imm(jit, RAX, status);
+  emit_jump_to(jit, -1, jit->exit_stub);
+}
+
+static int is_pinned(MemoryType operand) {
+  return (operand.type == REG || operand.type == MEM) && operand.reg >= EAX &&
+         operand.reg <= EBP;
+}
+
+/* Whether the JIT translates this instruction, or leaves it to the
+ * interpreter. Everything left out either fails or touches EIP */
+static int is_compilable(const Instruction *inst) {
+  switch (inst->opcode) {
+    case OP_MOVL:
+    case OP_ADDL:
+      return inst->dst.type != CONST && is_pinned(inst->dst) &&
+             (inst->src.type == CONST || is_pinned(inst->src)) &&
+             !(inst->src.type == MEM && inst->dst.type == MEM);
+    case OP_CMPL:
+      return (inst->src.type == CONST || is_pinned(inst->src)) &&
+             (inst->dst.type == CONST || is_pinned(inst->dst)) &&
+             !(inst->src.type == MEM && inst->dst.type == MEM);
+    case OP_PUSHL:
+      return inst->src.type == CONST || is_pinned(inst->src);
+    case OP_POPL:
+      return is_pinned(inst->src);
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JNEVER:
+    case OP_CALL:
+      return inst->target != -1;
+    default:
+      return 1;
+  }
+}
+
+/* Instruction index execution continues at after a jump or call from idx to
+ * target; a jump to itself just moves on, as in execute_instructions */
+static int successor(int idx, int target) {
+  return target == idx * 4 ? idx + 1 : target / 4;
+}
+
+/* Translate one instruction, return 1 if it ends the block */
+static int compile_instruction(Jit *jit, const Instruction *inst, int idx,
+                               Fixups *fail) {
+  size_t not_taken;
+
+  switch (inst->opcode) {
+    case OP_MOVL:
+      if (inst->dst.type == REG) {
+        emit_operand(jit, fail, host_reg[inst->dst.reg], inst->src);
+      } else {
+        emit_address(jit, fail, inst->dst);
+        emit_operand(jit, fail, RAX, inst->src);
+        emit_store_data(jit, RAX, RDX);
+      }
+      return 0;
+
+    case OP_ADDL:
+      emit_operand(jit, fail, RAX, inst->src);
+      if (inst->dst.type == REG) {
+        emit_reg_op(jit, 0, 0x01, RAX, host_reg[inst->dst.reg]);
+      } else {
+        emit_address(jit, fail, inst->dst);
+        emit_mem_op(jit, 0, 0x01, RAX, HOST_DATA, RDX, 0, 0);
+        emit_mark_dirty(jit, RDX);
+      }
+      return 0;
+
+    case OP_CMPL:
+      emit_operand(jit, fail, RAX, inst->src);
+      emit_operand(jit, fail, RCX, inst->dst);
+      emit_reg_op(jit, 0, 0x39, RAX, RCX);  // cmp ecx, eax
+      emit8(jit, 0x0F); emit8(jit, 0x9F); emit8(jit, 0xC0);  // setg al
+      emit8(jit, 0x0F); emit8(jit, 0x9C); emit8(jit, 0xC1);  // setl cl
+      emit8(jit, 0x0F); emit8(jit, 0xB6); emit8(jit, 0xC0);  // movzx eax, al
+      emit8(jit, 0x0F); emit8(jit, 0xB6); emit8(jit, 0xC9);  // movzx ecx, cl
+      emit_reg_op(jit, 0, 0x29, RCX, RAX);  // sub eax, ecx
+      emit_reg_op(jit, 0, 0x89, RAX, HOST_FLAG);
+      return 0;
+
+    case OP_PUSHL:
+      emit_operand(jit, fail, RAX, inst->src);
+      emit_lea(jit, RCX, host_reg[ESP], -4);
+      emit_push_check(jit, fail);
+      emit_store_data(jit, RAX, RCX);
+      emit_reg_op(jit, 0, 0x89, RCX, host_reg[ESP]);
+      return 0;
+
+    case OP_POPL:
+      emit_pop_check(jit, fail);
+      emit_load_data(jit, RAX, host_reg[ESP]);
+      if (inst->src.type == REG && inst->src.reg == ESP) {
+        // execute_pop adds 4 to the popped value in this case
+        emit_lea(jit, host_reg[ESP], RAX, 4);
+        return 0;
+      }
+      if (inst->src.type == REG) {
+        emit_reg_op(jit, 0, 0x89, RAX, host_reg[inst->src.reg]);
+      } else {
+        emit_address(jit, fail, inst->src);
+        emit_store_data(jit, RAX, RDX);
+      }
+      emit_add_imm(jit, host_reg[ESP], 4);
+      return 0;
+
+    case OP_JMP:
+      emit_goto(jit, successor(idx, inst->target));
+      return 1;
+
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+      emit_cmp_imm(jit, HOST_FLAG, inst->opcode == OP_JL   ? -1
+                                   : inst->opcode == OP_JG ? 1
+                                                           : 0);
+      not_taken = emit_jump(jit, inst->opcode == OP_JNE ? CC_E : CC_NE);
+      emit_goto(jit, successor(idx, inst->target));
+      patch_jump(jit, not_taken, jit->buffer + jit->used);
+      emit_goto(jit, idx + 1);
+      return 1;
+
+    case OP_JNEVER:
+      emit_goto(jit, idx + 1);
+      return 1;
+
+    case OP_CALL:
+      emit_lea(jit, RCX, host_reg[ESP], -4);
+      emit_push_check(jit, fail);
+      // mov dword [data + rcx], return address
+      emit_mem_op(jit, 0, 0xC7, 0, HOST_DATA, RCX, 0, 0);
+      emit32(jit, (idx + 1) * 4);
+      emit_mark_dirty(jit, RCX);
+      emit_reg_op(jit, 0, 0x89, RCX, host_reg[ESP]);
+      emit_goto(jit, successor(idx, inst->target));
+      return 1;
+
+    case OP_RET:
+      emit_pop_check(jit, fail);
+      emit_load_data(jit, RCX, host_reg[ESP]);
+      emit_test_imm(jit, RCX, 3);
+      emit_check(jit, fail, CC_NE);
+      emit_cmp_imm(jit, RCX, jit->num_instructions * 4);
+      emit_check(jit, fail, CC_AE);
+      emit_add_imm(jit, host_reg[ESP], 4);
+      // returning to the RET itself moves on to the next instruction
+      emit_cmp_imm(jit, RCX, idx * 4);
+      not_taken = emit_jump(jit, CC_NE);
+      emit_add_imm(jit, RCX, 4);
+      patch_jump(jit, not_taken, jit->buffer + jit->used);
+      // mov edx, ecx; shr edx, 2; mov rdx, [table + rdx * 8]
+      emit_reg_op(jit, 0, 0x89, RCX, RDX);
+      emit_reg_op(jit, 0, 0xC1, 5, RDX);
+      emit8(jit, 2);
+      emit_mem_op(jit, 1, 0x8B, RDX, HOST_TABLE, RDX, 3, 0);
+      emit_reg_op(jit, 1, 0x85, RDX, RDX);
+      emit_jump_to(jit, CC_E, jit->dispatch_exit);
+      emit_reg_op(jit, 0, 0xFF, 4, RDX);
+      return 1;
+
+    case OP_END:
+      emit_exit(jit, JIT_EXIT_END, idx);
+      return 1;
+
+    default:  // labels and unrecognized instructions
+      return 0;
+  }
+}
+
+/* Make the code buffer writable (1) or executable (0) */
+static int set_writable(Jit *jit, int writable) {
+  return mprotect(jit->buffer, JIT_BUFFER_SIZE,
+                  writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+}
+
+/* Drop every compiled block and start over with an empty buffer */
+static void flush_blocks(Jit *jit) {
+  jit->used = jit->stubs_end;
+  memset(jit->table, 0, (jit->num_instructions + 1) * sizeof(void *));
+  memset(jit->hits, 0, jit->num_instructions * sizeof(int));
+}
+
+/* Translate the block starting at instruction start, return its native entry
+ * or NULL if the first instruction cannot be translated */
+static void *compile_block(Jit *jit, const System *sys, int start) {
+  const Instruction *code = sys->memory.code;
+  if (!is_compilable(&code[start])) {
+    jit->uncompilable[start] = 1;
+    return NULL;
+  }
+  if (jit->used + JIT_MAX_BLOCK * JIT_MAX_INSTRUCTION > JIT_BUFFER_SIZE) {
+    flush_blocks(jit);
+  }
+  if (set_writable(jit, 1) != 0) return NULL;
+
+  unsigned char *entry = jit->buffer + jit->used;
+  Fixups fails[JIT_MAX_BLOCK];
+  int idx = start, ended = 0;
+
+  for (; idx < jit->num_instructions && idx - start < JIT_MAX_BLOCK; idx++) {
+    Fixups *fail = &fails[idx - start];
+    fail->count = 0;
+    if (!is_compilable(&code[idx])) {
+      emit_exit(jit, JIT_EXIT_FALLBACK, idx);
+      ended = 1;
+      break;
+    }
+    if (compile_instruction(jit, &code[idx], idx, fail)) {
+      ended = 1;
+      idx++;
+      break;
+    }
+  }
+  if (!ended) emit_goto(jit, idx);
+
+  // side exits: leave the instruction to the interpreter, nothing changed yet
+  for (int i = start; i < idx; i++) {
+    Fixups *fail = &fails[i - start];
+    if (fail->count == 0) continue;
+    for (int f = 0; f < fail->count; f++) {
+      patch_jump(jit, fail->at[f], jit->buffer + jit->used);
+    }
+    emit_exit(jit, JIT_EXIT_FALLBACK, i);
+  }
+
+  set_writable(jit, 0);
+  jit->table[start] = entry;
+  return entry;
+}
+
+/* Emit the entry stub, which loads the pinned registers and jumps to a block,
+ * and the exit stubs, which store them back */
+static void emit_stubs(Jit *jit) {
+  static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+
+  jit->enter = (JitEntry)(void *)(jit->buffer + jit->used);
+  for (int i = 0; i < 6; i++) {
+    emit_rex(jit, 0, 0, 0, saved[i]);
+    emit8(jit, 0x50 + (saved[i] & 7));  // push
+  }
+  for (int reg = EAX; reg <= EBP; reg++) {
+    emit_mem_op(jit, 0, 0x8B, host_reg[reg], HOST_SYS, -1, 0, REG_OFFSET(reg));
+  }
+  emit_mem_op(jit, 0, 0x8B, HOST_FLAG, HOST_SYS, -1, 0, FLAG_OFFSET);
+  emit_mem_op(jit, 1, 0x8B, HOST_DATA, HOST_SYS, -1, 0, DATA_OFFSET);
+  emit_mem_op(jit, 1, 0x8B, HOST_DIRTY, HOST_SYS, -1, 0, DIRTY_OFFSET);
+  emit_reg_op(jit, 0, 0xFF, 4, RDX);  // jmp rdx
+
+  jit->exit_stub = jit->buffer + jit->used;
+  emit_mem_op(jit, 0, 0x89, RCX, HOST_SYS, -1, 0, REG_OFFSET(EIP));
+  for (int reg = EAX; reg <= EBP; reg++) {
+    emit_mem_op(jit, 0, 0x89, host_reg[reg], HOST_SYS, -1, 0, REG_OFFSET(reg));
+  }
+  emit_mem_op(jit, 0, 0x89, HOST_FLAG, HOST_SYS, -1, 0, FLAG_OFFSET);
+  for (int i = 5; i >= 0; i--) {
+    emit_rex(jit, 0, 0, 0, saved[i]);
+    emit8(jit, 0x58 + (saved[i] & 7));  // pop
+  }
+  emit8(jit, 0xC3);  // ret
+
+  jit->dispatch_exit = jit->buffer + jit->used;
+  emit_mov_imm(jit, RAX, JIT_EXIT_DISPATCH);
+  emit_jump_to(jit, -1, jit->exit_stub);
+
+  jit->stubs_end = jit->used;
+}
+
+static void jit_destroy(Jit *jit) {
+  release_program(jit->program);
+  if (jit->buffer != NULL) munmap(jit->buffer, JIT_BUFFER_SIZE);
+  free(jit->table);
+  free(jit->hits);
+  free(jit->uncompilable);
+  free(jit);
+}
+
+static Jit *jit_create(const System *sys) {
+  Jit *jit = (Jit *)calloc(1, sizeof(Jit));
+  if (jit == NULL) return NULL;
+  jit->program = sys->memory.program;
+  __atomic_add_fetch(&jit->program->refcount, 1, __ATOMIC_RELAXED);
+  jit->revision = jit->program->revision;
+  jit->code = sys->memory.code;
+  jit->num_instructions = sys->memory.num_instructions;
+  jit->memory_size = sys->memory.size;
+  jit->table = (void **)calloc(jit->num_instructions + 1, sizeof(void *));
+  jit->hits = (int *)calloc(jit->num_instructions + 1, sizeof(int));
+  jit->uncompilable = (unsigned char *)calloc(jit->num_instructions + 1, 1);
+  jit->buffer = (unsigned char *)mmap(NULL, JIT_BUFFER_SIZE,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->buffer == MAP_FAILED) jit->buffer = NULL;
+  if (jit->table == NULL || jit->hits == NULL || jit->uncompilable == NULL ||
+      jit->buffer == NULL) {
+    jit_destroy(jit);
+    return NULL;
+  }
+  emit_stubs(jit);
+  if (set_writable(jit, 0) != 0) {
+    jit_destroy(jit);
+    return NULL;
+  }
+  return jit;
+}
+
+static pthread_key_t kept_jit;  // the JIT of this thread, see above
+static pthread_once_t kept_jit_once = PTHREAD_ONCE_INIT;
+
+static void drop_kept_jit(void *jit) { jit_destroy((Jit *)jit); }
+
+static void create_kept_jit(void) {
+  pthread_key_create(&kept_jit, drop_kept_jit);
+}
+
+/* The JIT this thread kept for the program of the system, or a new one that
+ * it keeps in place of any other. Returns NULL if it cannot be created */
+static Jit *get_jit(const System *sys) {
+  pthread_once(&kept_jit_once, create_kept_jit);
+  Jit *jit = (Jit *)pthread_getspecific(kept_jit);
+  if (jit != NULL && jit->program == sys->memory.program &&
+      jit->revision == sys->memory.program->revision &&
+      jit->code == sys->memory.code &&
+      jit->num_instructions == sys->memory.num_instructions &&
+      jit->memory_size == sys->memory.size) {
+    return jit;
+  }
+  if (jit != NULL) jit_destroy(jit);
+  jit = jit_create(sys);
+  pthread_setspecific(kept_jit, jit);
+  return jit;
+}
+
+/*
+Run the program with the JIT. The result is the same as execute_instructions;
+if executable memory cannot be set up, the program is simply interpreted.
+*/
+void execute_instructions_jit(System *sys) {
+  if (sys->memory.num_decoded != sys->memory.num_instructions) {
+    decode_instructions(sys);
+  }
+  Jit *jit = get_jit(sys);
+  if (jit == NULL) {
+    execute_instructions(sys);
+    return;
+  }
+
+  for (;;) {
+    int instruction_idx = sys->registers[EIP] / 4;
+    if (instruction_idx < 0 || instruction_idx >= jit->num_instructions) break;
+
+    // blocks assume an aligned EIP, which only an ADDL to %EIP can break
+    int aligned = sys->registers[EIP] % 4 == 0;
+    void *block = aligned ? jit->table[instruction_idx] : NULL;
+    if (aligned && block == NULL && !jit->uncompilable[instruction_idx] &&
+        ++jit->hits[instruction_idx] >= JIT_HOT_THRESHOLD) {
+      block = compile_block(jit, sys, instruction_idx);
+    }
+    if (block != NULL) {
+      int status = jit->enter(sys, jit->table, block);
+      if (status == JIT_EXIT_END) break;
+      if (status == JIT_EXIT_DISPATCH) continue;
+      // JIT_EXIT_FALLBACK: interpret the instruction at EIP
+      instruction_idx = sys->registers[EIP] / 4;
+    }
+
+    const Instruction *inst = &sys->memory.code[instruction_idx];
+    if (inst->opcode == OP_END) break;
+    if (execute_decoded(sys, inst) != SUCCESS) break;
+  }
+}
+
+#else
+
+void execute_instructions_jit(System *sys) { execute_instructions(sys); }
+
+#endif
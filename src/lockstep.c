@@ -0,0 +1,368 @@
+#include <limits.h>
+#include <string.h>
+#include "interpreter.h"
+
+/*
+Lockstep execution of many systems running the same program.
+
+execute_instructions_lockstep runs up to LOCKSTEP_LANES systems at a time, one
+per lane. The registers and comparison flags of a group are kept as
+struct-of-arrays vectors (GCC vector extensions, which become AVX2 or SSE
+instructions depending on the target), so one decoded instruction is fetched
+and dispatched once for the whole group and runs on every lane with vector
+operations under a lane mask.
+
+Lanes diverge when a jump is taken by some of them only. The group then always
+executes the instruction with the smallest EIP among the lanes still running,
+masked to the lanes that are at that EIP: the lanes ahead wait until the others
+catch up, which is where the paths of loops and if/else join again. Each lane
+still executes exactly the instructions it would on its own, in the same
+order, so the result of every system is the same as with execute_instructions.
+
+Data memory stays in the System of each lane, so memory operands and the stack
+are read and written lane by lane (gather/scatter) once the addresses have
+been computed and checked as vectors. Operand combinations that can only fail
+are left to execute_decoded on each lane.
+*/
+
+// Vectors are only passed between the static functions of this file, so the
+// ABI note about 256-bit vectors without AVX does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// Everything a group runs is inlined into execute_group, which is built for
+// AVX2 as well as for the baseline when the compiler can pick at load time
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_TARGETS
+#endif
+#define LANE_INLINE static inline __attribute__((always_inline))
+
+typedef int LaneVector
+    __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int))));
+typedef unsigned LaneUnsigned
+    __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int))));
+
+typedef struct Lanes {
+  LaneVector registers[6];
+  LaneVector comparison_flag;
+  LaneVector running;  // all bits set in lanes that have not stopped
+  int memory_size;     // words of data memory, the same in every lane
+} Lanes;
+
+/* Take the lanes of mask from a, the others from b */
+LANE_INLINE LaneVector blend(LaneVector mask, LaneVector a, LaneVector b) {
+  return (mask & a) | (~mask & b);
+}
+
+LANE_INLINE LaneVector splat(int value) {
+  LaneVector vector;
+  for (int lane = 0; lane < LOCKSTEP_LANES; lane++) vector[lane] = value;
+  return vector;
+}
+
+/* Register or constant operand of every lane */
+LANE_INLINE LaneVector operand_vector(const Lanes *lanes,
+                                      MemoryType operand) {
+  return operand.type == CONST ? splat(operand.value)
+                               : lanes->registers[operand.reg];
+}
+
+LANE_INLINE void load_lane(Lanes *lanes, int lane, const System *sys) {
+  for (int reg = EAX; reg <= EIP; reg++) {
+    lanes->registers[reg][lane] = sys->registers[reg];
+  }
+  lanes->comparison_flag[lane] = sys->comparison_flag;
+}
+
+LANE_INLINE void store_lane(const Lanes *lanes, int lane, System *sys) {
+  for (int reg = EAX; reg <= EIP; reg++) {
+    sys->registers[reg] = lanes->registers[reg][lane];
+  }
+  sys->comparison_flag = lanes->comparison_flag[lane];
+}
+
+LANE_INLINE LaneVector wrapping_add(LaneVector a, LaneVector b) {
+  return (LaneVector)((LaneUnsigned)a + (LaneUnsigned)b);
+}
+
+/* Lanes where the address is a valid data memory address */
+LANE_INLINE LaneVector valid_address(const Lanes *lanes, LaneVector address) {
+  return (address >= 0) & (address <= (lanes->memory_size - 1) * 4) &
+         ((address & 3) == 0);
+}
+
+/* Lanes where ESP can be decremented to the given value by a push */
+LANE_INLINE LaneVector valid_push(const Lanes *lanes, LaneVector new_esp) {
+  return (new_esp >= 4) & (new_esp < lanes->memory_size * 4) &
+         ((new_esp & 3) == 0);
+}
+
+LANE_INLINE LaneVector gather(const System *systems, LaneVector address,
+                                LaneVector mask) {
+  LaneVector value = splat(0);
+  for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+    if (mask[lane]) value[lane] = systems[lane].memory.data[address[lane] / 4];
+  }
+  return value;
+}
+
+LANE_INLINE void scatter(System *systems, LaneVector address,
+                           LaneVector value, LaneVector mask) {
+  for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+    if (mask[lane]) {
+      systems[lane].memory.data[address[lane] / 4] = value[lane];
+      systems[lane].memory.dirty[address[lane] >> DIRTY_LINE_SHIFT] = 1;
+    }
+  }
+}
+
+/* Lanes of the active mask where the jump is taken */
+LANE_INLINE LaneVector jump_taken(const Lanes *lanes, Opcode opcode) {
+  LaneVector flag = lanes->comparison_flag;
+
+  switch (opcode) {
+    case OP_JMP:
+      return splat(-1);
+    case OP_JE:
+      return flag == 0;
+    case OP_JNE:
+      return flag != 0;
+    case OP_JL:
+      return flag == -1;
+    case OP_JG:
+      return flag == 1;
+    default:
+      return splat(0);
+  }
+}
+
+/*
+MOVL, ADDL or CMPL on the lanes of ok, which keeps only the lanes where the
+instruction succeeds. Returns 0 without changing anything for the operand
+combinations that always fail (unknown operands, memory to memory, constant
+destination of MOVL or ADDL).
+*/
+LANE_INLINE int step_data(Lanes *lanes, System *systems,
+                          const Instruction *inst, LaneVector *ok) {
+  MemoryType src = inst->src, dst = inst->dst;
+
+  if (src.type == UNKNOWN || dst.type == UNKNOWN) return 0;
+  if (src.type == MEM && dst.type == MEM) return 0;
+  if (inst->opcode != OP_CMPL && dst.type == CONST) return 0;
+
+  // at most one operand is in memory
+  MemoryType mem = src.type == MEM ? src : dst;
+  LaneVector address = splat(0);
+  if (mem.type == MEM) {
+    address = wrapping_add(lanes->registers[mem.reg], splat(mem.value));
+    *ok &= valid_address(lanes, address);
+  }
+
+  LaneVector src_value = src.type == MEM ? gather(systems, address, *ok)
+                                         : operand_vector(lanes, src);
+  LaneVector dst_value = dst.type == MEM ? gather(systems, address, *ok)
+                                         : operand_vector(lanes, dst);
+  LaneVector value = src_value;
+
+  switch (inst->opcode) {
+    case OP_CMPL:
+      // comparisons give -1 where true: 1 if dst > src, -1 if dst < src
+      lanes->comparison_flag = blend(*ok, (dst_value < src_value) -
+                                              (dst_value > src_value),
+                                     lanes->comparison_flag);
+      return 1;
+    case OP_ADDL:
+      value = wrapping_add(dst_value, src_value);
+      break;
+    default:
+      break;
+  }
+  if (dst.type == REG) {
+    lanes->registers[dst.reg] = blend(*ok, value, lanes->registers[dst.reg]);
+  } else {
+    scatter(systems, address, value, *ok);
+  }
+  return 1;
+}
+
+/*
+Execute one instruction on the lanes of mask, which are all at the same EIP, and
+update their EIP the way execute_instructions does. Lanes where the
+instruction fails stop running.
+*/
+LANE_INLINE void step_lanes(Lanes *lanes, System *systems,
+                            const Instruction *inst,
+                            const LaneVector *mask) {
+  LaneVector active = *mask;
+  LaneVector *reg = lanes->registers;
+  LaneVector before = reg[EIP];
+  LaneVector ok = active;  // lanes where the instruction succeeds
+
+  switch (inst->opcode) {
+    case OP_NOP:
+      // Labels and unrecognized instructions
+      reg[EIP] = blend(active, before + 4, before);
+      return;
+
+    case OP_MOVL:
+    case OP_ADDL:
+    case OP_CMPL:
+      if (!step_data(lanes, systems, inst, &ok)) goto lane_by_lane;
+      break;
+
+    case OP_PUSHL: {
+      if (inst->src.type == UNKNOWN) goto lane_by_lane;
+      LaneVector value;
+      if (inst->src.type == MEM) {
+        LaneVector address = wrapping_add(reg[inst->src.reg],
+                                          splat(inst->src.value));
+        ok &= valid_address(lanes, address);
+        value = gather(systems, address, ok);
+      } else {
+        value = operand_vector(lanes, inst->src);
+      }
+      LaneVector new_esp = reg[ESP] - 4;
+      ok &= valid_push(lanes, new_esp);
+      scatter(systems, new_esp, value, ok);
+      reg[ESP] = blend(ok, new_esp, reg[ESP]);
+      break;
+    }
+
+    case OP_POPL: {
+      MemoryType dst = inst->src;
+      if (dst.type == UNKNOWN || dst.type == CONST) goto lane_by_lane;
+      LaneVector old_esp = reg[ESP];
+      ok &= valid_address(lanes, old_esp);
+      LaneVector value = gather(systems, old_esp, ok);
+      if (dst.type == REG) {
+        // ESP is incremented after the write, so POPL %ESP adds 4 to the value
+        reg[dst.reg] = blend(ok, value, reg[dst.reg]);
+        reg[ESP] = blend(ok, reg[ESP] + 4, reg[ESP]);
+      } else {
+        LaneVector address = wrapping_add(reg[dst.reg], splat(dst.value));
+        ok &= valid_address(lanes, address);
+        scatter(systems, address, value, ok);
+        reg[ESP] = blend(ok, old_esp + 4, reg[ESP]);
+      }
+      break;
+    }
+
+    case OP_CALL: {
+      if (inst->target == -1) {
+        ok = splat(0);  // PC_ERROR
+        break;
+      }
+      LaneVector new_esp = reg[ESP] - 4;
+      ok &= valid_push(lanes, new_esp);
+      scatter(systems, new_esp, before + 4, ok);
+      reg[ESP] = blend(ok, new_esp, reg[ESP]);
+      reg[EIP] = blend(ok, splat(inst->target), reg[EIP]);
+      break;
+    }
+
+    case OP_RET: {
+      LaneVector esp = reg[ESP];
+      ok &= valid_address(lanes, esp);
+      LaneVector ret_addr = gather(systems, esp, ok);
+      ok &= (ret_addr >= 0) &
+            (ret_addr < systems[0].memory.num_instructions * 4) &
+            ((ret_addr & 3) == 0);
+      reg[EIP] = blend(ok, ret_addr, reg[EIP]);
+      reg[ESP] = blend(ok, esp + 4, esp);
+      break;
+    }
+
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JNEVER: {
+      if (inst->target == -1) {
+        ok = splat(0);  // PC_ERROR
+        break;
+      }
+      LaneVector taken = active & jump_taken(lanes, inst->opcode);
+      reg[EIP] = blend(taken, splat(inst->target),
+                       blend(active, before + 4, before));
+      break;
+    }
+
+    default:
+      goto lane_by_lane;
+  }
+
+  lanes->running &= ~active | ok;
+  // an instruction that leaves EIP alone, a jump to itself included, moves on
+  reg[EIP] = blend(ok & (reg[EIP] == before), reg[EIP] + 4, reg[EIP]);
+  return;
+
+lane_by_lane:
+  // Operands that always fail: let execute_decoded report it for each lane
+  for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+    if (!active[lane]) continue;
+    store_lane(lanes, lane, &systems[lane]);
+    if (execute_decoded(&systems[lane], inst) != SUCCESS) {
+      lanes->running[lane] = 0;
+    }
+    load_lane(lanes, lane, &systems[lane]);
+  }
+}
+
+/* Run one group of at most LOCKSTEP_LANES systems until every lane stops */
+LOCKSTEP_TARGETS static void execute_group(System *systems, int count) {
+  const Instruction *code = systems[0].memory.code;
+  int num_instructions = systems[0].memory.num_instructions;
+  Lanes lanes;
+
+  memset(&lanes, 0, sizeof(lanes));
+  lanes.memory_size = systems[0].memory.size;
+  for (int lane = 0; lane < count; lane++) {
+    load_lane(&lanes, lane, &systems[lane]);
+    lanes.running[lane] = -1;
+  }
+
+  for (;;) {
+    // the smallest EIP of the running lanes is executed next
+    int pc = INT_MAX, any = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+      if (lanes.running[lane] && lanes.registers[EIP][lane] <= pc) {
+        pc = lanes.registers[EIP][lane];
+        any = 1;
+      }
+    }
+    if (!any) break;
+
+    LaneVector active = lanes.running & (lanes.registers[EIP] == pc);
+    int instruction_idx = pc / 4;
+    if (instruction_idx < 0 || instruction_idx >= num_instructions ||
+        code[instruction_idx].opcode == OP_END) {
+      lanes.running &= ~active;
+      continue;
+    }
+    step_lanes(&lanes, systems, &code[instruction_idx], &active);
+  }
+
+  for (int lane = 0; lane < count; lane++) {
+    store_lane(&lanes, lane, &systems[lane]);
+  }
+}
+
+/*
+Run the program in each of the count systems, which must all hold the same
+loaded program and memory size (copies of one system, see copy_system), and
+leave every system exactly as execute_instructions would. Superinstructions are
+not used, so fusion_hits stays unchanged.
+*/
+void execute_instructions_lockstep(System *systems, int count) {
+  for (int i = 0; i < count; i++) {
+    if (systems[i].memory.num_decoded != systems[i].memory.num_instructions) {
+      decode_instructions(&systems[i]);
+    }
+  }
+  for (int first = 0; first < count; first += LOCKSTEP_LANES) {
+    int group = count - first < LOCKSTEP_LANES ? count - first : LOCKSTEP_LANES;
+    execute_group(&systems[first], group);
+  }
+}
@@ -1,31 +1,177 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "batch.h"
 #include "interpreter.h"
+#include "profile.h"
+#include "program_file.h"
+#include "server.h"
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <instruction_file>\n", argv[0]);
+  Engine engine = ENGINE_SWITCH;
+  int opt, stats = 0, profiled = 0, guarded = 0, num_threads = 0;
+  int memory_size = MEMORY_SIZE;
+  const char *batch_file = NULL, *folded_file = NULL;
+  const char *serve_socket = NULL, *client_socket = NULL;
+
+  while ((opt = getopt(argc, argv, "e:spGg:b:j:m:S:C:")) != -1) {
+    if (opt == 'e' && get_engine_by_name(optarg) != -1) {
+      engine = (Engine)get_engine_by_name(optarg);
+    } else if (opt == 's') {
+      stats = 1;
+    } else if (opt == 'p') {
+      profiled = 1;
+    } else if (opt == 'G') {
+      guarded = 1;
+    } else if (opt == 'g') {
+      folded_file = optarg;
+    } else if (opt == 'b') {
+      batch_file = optarg;
+    } else if (opt == 'j') {
+      num_threads = atoi(optarg);
+    } else if (opt == 'm') {
+      memory_size = atoi(optarg);
+    } else if (opt == 'S') {
+      serve_socket = optarg;
+    } else if (opt == 'C') {
+      client_socket = optarg;
+    } else {
+      optind = argc + 1;  // report usage below
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    printf("Usage: %s [-e switch|threaded|jit|aot|lockstep] [-s] [-p] "
+           "[-g <folded_file>] [-m words] [-G] "
+           "[-b <inputs_file> [-j threads]] [-S <socket>|-] [-C <socket>] "
+           "<instruction_file>\n",
+           argv[0]);
     return EXIT_FAILURE;
   }
 
+  // Run on an interpreter server instead, see server.h
+  if (client_socket != NULL) {
+    int text_bytes, fd = connect_server(client_socket);
+    char *text = read_program_text(argv[optind], &text_bytes);
+    if (fd < 0 || text == NULL) {
+      perror(fd < 0 ? "Error connecting to server" : "Error opening file");
+      return EXIT_FAILURE;
+    }
+    ServerRequest request = {0, text_bytes, 1, 5, 3, 2, 0};
+    ServerResponse response;
+    if (send_server_request(fd, &request, text) != 0 ||
+        read_server_response(fd, &response) != 0) {
+      perror("Error talking to server");
+      return EXIT_FAILURE;
+    }
+    if (response.status != SERVER_OK) {
+      fprintf(stderr, "%s: rejected by the server\n", argv[optind]);
+      return EXIT_FAILURE;
+    }
+    printf("Register EAX: %d\n", response.registers[EAX]);
+    printf("Register EDX: %d\n", response.registers[EDX]);
+    printf("Register ECX: %d\n", response.registers[ECX]);
+    free(text);
+    close(fd);
+    return 0;
+  }
+
   System sys;
-  initialize_system(&sys);
+  if (initialize_system_with_size(&sys, memory_size) != 0) {
+    fprintf(stderr, "Invalid data memory size: %d words (at least %d)\n",
+            memory_size, MIN_MEMORY_SIZE);
+    return EXIT_FAILURE;
+  }
+  // Data memory between guard pages, so that the switch engine can leave out
+  // the bounds checks
+  if (guarded && guard_data_memory(&sys) != 0) {
+    perror("Error mapping guard pages");
+    return EXIT_FAILURE;
+  }
 
-  // Load instructions from the file specified in the program argument
-  load_instructions_from_file(&sys, argv[1]);
+  // Load instructions from the file specified in the program argument, or
+  // map them from the program file cache if it has been loaded before
+  if (load_instructions_cached(&sys, argv[optind]) > 0) {
+    return EXIT_FAILURE;
+  }
+
+  // Fold constants, drop moves and jumps that do nothing, and thread jumps
+  // (images mapped from the cache were optimized when they were saved)
+  optimize_instructions(&sys);
+  if (stats) {
+    fprintf(stderr, "Optimizer removed %d instructions\n",
+            sys.memory.program->removed);
+  }
+
+  // Serve runs of this and other programs until stopped, see server.h
+  if (serve_socket != NULL) {
+    Server *server = create_server(memory_size);
+    if (server == NULL || add_server_program(server, sys.memory.program) != 0 ||
+        run_server(server, strcmp(serve_socket, "-") == 0 ? NULL
+                                                          : serve_socket) != 0) {
+      perror("Error serving");
+      return EXIT_FAILURE;
+    }
+    destroy_server(server);
+    return 0;
+  }
+
+  // Run once per line of the inputs file and print one line per run
+  if (batch_file != NULL) {
+    BatchInput *inputs;
+    int count = read_batch_inputs(batch_file, &inputs);
+    if (count < 0) return EXIT_FAILURE;
+    BatchResult *results = (BatchResult *)malloc(count * sizeof(BatchResult) + 1);
+    if (results == NULL ||
+        run_batch(&sys, inputs, results, count, num_threads, engine) != 0) {
+      return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+      printf("%d %d %d\n", results[i].registers[EAX],
+             results[i].registers[EDX], results[i].registers[ECX]);
+    }
+    free(results);
+    free(inputs);
+    return 0;
+  }
 
   // Initialize some registers for testing
   sys.registers[EAX] = 5;
   sys.registers[EDX] = 3;
   sys.registers[ECX] = 2;
 
-  // Execute instructions
-  execute_instructions(&sys);
+  // Execute instructions, with the profiling interpreter if asked to
+  Profile *profile =
+      profiled || folded_file != NULL ? create_profile(&sys) : NULL;
+  if (profile != NULL) {
+    execute_instructions_profiled(&sys, profile);
+  } else {
+    execute_with_engine(&sys, engine);
+  }
 
   // Print the result
   printf("Register EAX: %d\n", sys.registers[EAX]);
   printf("Register EDX: %d\n", sys.registers[EDX]);
   printf("Register ECX: %d\n", sys.registers[ECX]);
 
+  // Superinstruction statistics of the interpreting engines
+  if (stats) print_fusion_stats(&sys, stderr);
+
+  // Where the time went, per opcode and per source line
+  if (profile != NULL && profiled) print_profile(&sys, profile, stderr);
+
+  // Instructions executed per call stack, for flame graphs
+  if (profile != NULL && folded_file != NULL) {
+    FILE *folded = fopen(folded_file, "w");
+    if (folded == NULL) {
+      perror("Error opening folded stacks file");
+    } else {
+      print_folded_stacks(&sys, profile, folded);
+      fclose(folded);
+    }
+  }
+  destroy_profile(profile);
+
   return 0;
 }
@@ -0,0 +1,190 @@
+#include <string.h>
+#include "interpreter.h"
+
+/*
+Peephole optimizer.
+
+optimize_instructions rewrites the decoded program between loading and
+execution. Every rewrite keeps the behavior of the program the same wherever
+execution enters it, since jumps, RET and writes to EIP can go to any
+instruction, and addresses are observable (CALL pushes them):
+- Instructions that only move on to the next one become OP_NOP: moves from a
+  register to itself, ADDL $0 to a register, and jumps whose target is reached
+  by falling through labels anyway (the next instruction, or the jump itself,
+  which moves on as well). JNEVER with a defined label is one of them.
+- Jumps to a label are pointed past the labels and no-ops that follow it, and
+  through the unconditional jumps (or jumps on the same condition) they lead
+  to: jump chains are threaded. Calls keep their target, the instruction after
+  the label, which profiles name the function called by (profile_call).
+- A MOVL or ADDL of a constant to a register, followed by more constant MOVL
+  and ADDL to the same register and no-ops, is folded: the first instruction
+  records the sum of the constants in target and the number of instructions
+  after it in folded, and the interpreters run the whole sequence as one
+  FUSION_CONST_FOLD superinstruction. The instructions after it keep their own
+  records, so that jumping into the middle of the sequence still works.
+
+PUSHL %X followed by POPL %X is not removed: it writes the stack slot below
+ESP, which is observable, and is already run as a FUSION_PUSH_POP.
+*/
+
+static int is_jump(Opcode opcode) {
+  return opcode >= OP_JMP && opcode <= OP_JNEVER;
+}
+
+/* Instruction that only moves on to the next one, apart from labels */
+static int is_no_op(const Instruction *inst) {
+  switch (inst->opcode) {
+    case OP_MOVL:
+      return inst->src.type == REG && inst->dst.type == REG &&
+             inst->src.reg == inst->dst.reg;
+    case OP_ADDL:
+      return inst->src.type == CONST && inst->src.value == 0 &&
+             inst->dst.type == REG;
+    case OP_JNEVER:
+      return inst->target >= 0;  // an undefined label still has to fail
+    default:
+      return 0;
+  }
+}
+
+/* Index of the first instruction from i on that is not a label or OP_NOP, or
+ * the last one if they all are */
+static int skip_no_ops(const Instruction *code, int num, int i) {
+  while (i + 1 < num && code[i].opcode == OP_NOP) i++;
+  return i;
+}
+
+/* Address the jump at index i ends up at when it is taken: past no-ops, and
+ * through the jumps that are sure to be taken after it. Returns its own target
+ * when that cannot be improved */
+static int thread_target(const Instruction *code, int num, int i) {
+  int target = code[i].target;
+  for (int steps = 0; steps < num && target / 4 < num; steps++) {
+    int next = skip_no_ops(code, num, target / 4);
+    const Instruction *at = &code[next];
+    if (at->opcode == OP_JMP || at->opcode == code[i].opcode) {
+      // a jump to itself moves on, and an undefined label has to fail there
+      if (at->target < 0 || at->target == next * 4) return next * 4;
+      target = at->target;
+    } else {
+      return next * 4;
+    }
+  }
+  // a label at the very end, or a cycle of jumps
+  return target / 4 < num ? code[i].target : target;
+}
+
+/* A jump to itself, or to an instruction that falling through the no-ops
+ * after it reaches as well */
+static int jumps_to_next(const Instruction *code, int num, int i) {
+  int target = code[i].target;
+  if (target < 0 || target % 4 != 0) return 0;
+  return target == i * 4 || (i + 1 < num && target / 4 > i &&
+                             target / 4 <= skip_no_ops(code, num, i + 1));
+}
+
+/* Register a constant MOVL or ADDL writes, or NOT_REG */
+static RegisterName constant_register(const Instruction *inst) {
+  if ((inst->opcode != OP_MOVL && inst->opcode != OP_ADDL) ||
+      inst->src.type != CONST || inst->dst.type != REG ||
+      inst->dst.reg == EIP) {
+    return NOT_REG;
+  }
+  return inst->dst.reg;
+}
+
+/*
+Fold the sequence of constant MOVL and ADDL to one register that starts at
+index i into it, see above. A sequence that starts with ADDL ends before the
+next MOVL, which then starts one of its own. Returns the number of
+instructions other than no-ops that were folded in.
+*/
+static int fold_constants(Instruction *code, int num, int i) {
+  RegisterName reg = constant_register(&code[i]);
+  code[i].folded = 0;
+  if (reg == NOT_REG) return 0;
+
+  unsigned sum = (unsigned)code[i].src.value;
+  int removed = 0;
+  for (int j = i + 1; j < num; j++) {
+    if (code[j].opcode != OP_NOP) {
+      if (constant_register(&code[j]) != reg ||
+          (code[j].opcode == OP_MOVL && code[i].opcode == OP_ADDL)) {
+        break;
+      }
+      sum = code[j].opcode == OP_MOVL ? (unsigned)code[j].src.value
+                                      : sum + (unsigned)code[j].src.value;
+      removed++;
+    }
+    code[i].folded = j - i;
+  }
+  code[i].target = (int)sum;
+  return removed;
+}
+
+/*
+Optimize the decoded program of the system, see above, and mark its
+superinstructions and verify it again. The program image is changed in place,
+for every system it is attached to. An image that has been optimized already,
+such as one mapped from a program file, is left alone, so that its pages are
+not written. Returns the number of instructions removed: those turned into
+no-ops, and those folded into another, or 0 for an optimized image.
+*/
+int optimize_instructions(System *sys) {
+  if (sys->memory.num_decoded != sys->memory.num_instructions) {
+    decode_instructions(sys);
+  } else if (sys->memory.program->optimized) {
+    return 0;
+  }
+  Instruction *code = sys->memory.code;
+  int num = sys->memory.num_instructions;
+  int removed = 0;
+
+  for (int i = 0; i < num; i++) {
+    if (is_no_op(&code[i])) {
+      code[i].opcode = OP_NOP;
+      removed++;
+    }
+  }
+  for (int i = 0; i < num; i++) {
+    if (is_jump(code[i].opcode) && code[i].target >= 0) {
+      int target = thread_target(code, num, i);
+      if (target != i * 4) code[i].target = target;
+    }
+  }
+  for (int i = 0; i < num; i++) {
+    if (is_jump(code[i].opcode) && jumps_to_next(code, num, i)) {
+      code[i].opcode = OP_NOP;
+      removed++;
+    }
+  }
+  // every instruction of a sequence is folded, for jumps into the middle, but
+  // only the first counts
+  for (int i = 0, counted = -1; i < num; i++) {
+    int folded = fold_constants(code, num, i);
+    if (i > counted) {
+      removed += folded;
+      counted = i + code[i].folded;
+    }
+  }
+  fuse_instructions(sys);
+  verify_instructions(sys);
+  sys->memory.program->optimized = 1;
+  sys->memory.program->removed = removed;
+  sys->memory.program->revision++;
+  return removed;
+}
+
+/*
+Optimize an image that is not attached to a system yet, such as one just
+loaded to be cached or shared, see optimize_instructions. Returns the number of
+instructions removed, or -1 if memory cannot be allocated.
+*/
+int optimize_program(Program *program) {
+  System loader;  // only holds the image
+  if (initialize_system_with_size(&loader, MIN_MEMORY_SIZE) != 0) return -1;
+  attach_program(&loader, program);
+  int removed = optimize_instructions(&loader);
+  destroy_system(&loader);
+  return removed;
+}
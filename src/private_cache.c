@@ -0,0 +1,73 @@
+#include "private_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Cache directories that only the user running the program can write to.
+
+Caches hold files that are mapped or loaded as code (program files and
+compiled shared objects), so whoever can write a file into a cache can make the
+process run anything. A cache directory is therefore only used when it belongs
+to the user and is not writable by group or others, and so are the files read
+from it; a directory that does not exist yet is created with mode 0700.
+*/
+
+/* The file or directory at path belongs to this user, and only it can write
+ * to it */
+static int is_private(const struct stat *st) {
+  return st->st_uid == getuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/*
+Put the directory of the cache called name into dir: the directory named by
+the environment variable, or name under $XDG_CACHE_HOME, or /tmp/name-<uid>.
+It is created if it does not exist. Returns 0 on success, and -1 if it cannot
+be created, the path does not fit, or it is not a private directory of this
+user (errno is EPERM then).
+*/
+int private_cache_directory(const char *variable, const char *name, char *dir,
+                            size_t size) {
+  int length;
+  if (getenv(variable) != NULL) {
+    length = snprintf(dir, size, "%s", getenv(variable));
+  } else if (getenv("XDG_CACHE_HOME") != NULL &&
+             getenv("XDG_CACHE_HOME")[0] == '/') {
+    length = snprintf(dir, size, "%s/%s", getenv("XDG_CACHE_HOME"), name);
+  } else {
+    length = snprintf(dir, size, "/tmp/%s-%d", name, (int)getuid());
+  }
+  if (length < 0 || (size_t)length >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+  struct stat st;
+  if (lstat(dir, &st) != 0) return -1;
+  if (!S_ISDIR(st.st_mode) || !is_private(&st)) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+Open a file of a private cache for reading. Symbolic links are not followed,
+and the file has to be a regular file of this user that only it can write to.
+Returns the descriptor, or -1 (errno is EPERM for a file that is not private).
+*/
+int open_private_file(const char *path) {
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !is_private(&st)) {
+    close(fd);
+    errno = EPERM;
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,237 @@
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Profiler report. execute_instructions_profiled (in interpreter.c) does the
+counting; this file sets up profiles and prints them.
+*/
+
+static const char *opcode_names[] = {
+    [OP_NOP] = "label/NOP", [OP_MOVL] = "MOVL", [OP_ADDL] = "ADDL",
+    [OP_PUSHL] = "PUSHL",   [OP_POPL] = "POPL", [OP_CMPL] = "CMPL",
+    [OP_JMP] = "JMP",       [OP_JE] = "JE",     [OP_JNE] = "JNE",
+    [OP_JL] = "JL",         [OP_JG] = "JG",     [OP_JNEVER] = "J(never)",
+    [OP_CALL] = "CALL",     [OP_RET] = "RET",   [OP_END] = "END"};
+
+#define INITIAL_CONTEXTS 64
+
+/* An empty profile for the program loaded in the system, or NULL if memory
+ * cannot be allocated */
+Profile *create_profile(const System *sys) {
+  int num = sys->memory.num_instructions;
+  Profile *profile = (Profile *)calloc(
+      1, sizeof(Profile) +
+             num * (2 * sizeof(long long) + sizeof(unsigned long long)));
+  if (profile == NULL) return NULL;
+  profile->num_instructions = num;
+  profile->executions = (long long *)(profile + 1);
+  profile->cycles = (unsigned long long *)(profile->executions + num);
+  profile->taken = (long long *)(profile->cycles + num);
+
+  // the program starts in the root context, with an empty call stack
+  profile->context_capacity = INITIAL_CONTEXTS;
+  profile->contexts =
+      (CallContext *)malloc(INITIAL_CONTEXTS * sizeof(CallContext));
+  profile->context_table = (int *)calloc(2 * INITIAL_CONTEXTS, sizeof(int));
+  if (profile->contexts == NULL || profile->context_table == NULL) {
+    destroy_profile(profile);
+    return NULL;
+  }
+  profile->contexts[0].parent = -1;
+  profile->contexts[0].function = -1;
+  profile->contexts[0].executions = 0;
+  profile->num_contexts = 1;
+  return profile;
+}
+
+void destroy_profile(Profile *profile) {
+  if (profile == NULL) return;
+  free(profile->contexts);
+  free(profile->context_table);
+  free(profile->stack);
+  free(profile);
+}
+
+static unsigned int hash_context(int parent, int function) {
+  return ((unsigned)parent * 2654435761u) ^ ((unsigned)function * 40503u);
+}
+
+/* Slot of context_table for the call of function from parent: the one holding
+ * it, or the empty one where it goes */
+static unsigned int find_context(const Profile *profile, int parent,
+                                 int function) {
+  unsigned int mask = 2 * profile->context_capacity - 1;
+  unsigned int slot = hash_context(parent, function) & mask;
+  while (profile->context_table[slot] != 0) {
+    const CallContext *context =
+        &profile->contexts[profile->context_table[slot] - 1];
+    if (context->parent == parent && context->function == function) break;
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/* Double the room for contexts, and rehash them. Returns -1 if memory cannot
+ * be allocated */
+static int grow_contexts(Profile *profile) {
+  int capacity = 2 * profile->context_capacity;
+  CallContext *contexts = (CallContext *)realloc(
+      profile->contexts, capacity * sizeof(CallContext));
+  if (contexts == NULL) return -1;
+  profile->contexts = contexts;
+  int *table = (int *)calloc(2 * capacity, sizeof(int));
+  if (table == NULL) return -1;
+  free(profile->context_table);
+  profile->context_table = table;
+  profile->context_capacity = capacity;
+  for (int i = 0; i < profile->num_contexts; i++) {
+    unsigned int slot =
+        find_context(profile, contexts[i].parent, contexts[i].function);
+    table[slot] = i + 1;
+  }
+  return 0;
+}
+
+/* The context for a call of function from parent, created the first time.
+ * Returns -1 if memory cannot be allocated */
+static int enter_context(Profile *profile, int parent, int function) {
+  unsigned int slot = find_context(profile, parent, function);
+  if (profile->context_table[slot] != 0) {
+    return profile->context_table[slot] - 1;
+  }
+  if (profile->num_contexts == profile->context_capacity) {
+    if (grow_contexts(profile) != 0) return -1;
+    slot = find_context(profile, parent, function);
+  }
+  int context = profile->num_contexts++;
+  profile->contexts[context].parent = parent;
+  profile->contexts[context].function = function;
+  profile->contexts[context].executions = 0;
+  profile->context_table[slot] = context + 1;
+  return context;
+}
+
+/*
+Push a frame for the CALL at call_address, which has just jumped to the
+instruction after the label it calls. Calls nested more than PROFILE_MAX_DEPTH
+deep still get a frame, so that returns match up, but stay in the context of
+their caller. If memory runs out the call is not followed.
+*/
+void profile_call(Profile *profile, const System *sys, int call_address) {
+  if (profile->depth == profile->stack_capacity) {
+    int capacity = profile->stack_capacity ? 2 * profile->stack_capacity : 64;
+    CallFrame *stack =
+        (CallFrame *)realloc(profile->stack, capacity * sizeof(CallFrame));
+    if (stack == NULL) return;
+    profile->stack = stack;
+    profile->stack_capacity = capacity;
+  }
+  int context = profile->context;
+  if (profile->depth < PROFILE_MAX_DEPTH) {
+    // the label called is the line before its target
+    int entered = enter_context(profile, context,
+                                sys->registers[EIP] / 4 - 1);
+    if (entered >= 0) context = entered;
+  }
+  profile->stack[profile->depth].context = context;
+  profile->stack[profile->depth].return_address = call_address + 4;
+  profile->depth++;
+  profile->context = context;
+}
+
+/*
+Pop the frame a RET returned to. The program can rearrange its stack, so this
+is the innermost frame whose return address is the new EIP, and the frames
+above it are dropped as well; if there is none, one frame is popped.
+*/
+void profile_return(Profile *profile, const System *sys) {
+  if (profile->depth == 0) return;
+  int depth = profile->depth - 1;
+  while (depth > 0 &&
+         profile->stack[depth].return_address != sys->registers[EIP]) {
+    depth--;
+  }
+  if (profile->stack[depth].return_address != sys->registers[EIP]) {
+    depth = profile->depth - 1;
+  }
+  profile->depth = depth;
+  profile->context = depth > 0 ? profile->stack[depth - 1].context : 0;
+}
+
+static double percent(unsigned long long part, unsigned long long total) {
+  return total ? 100.0 * part / total : 0;
+}
+
+/*
+Print the profile: executions and cycles of every opcode, then every
+instruction that was executed, in program order, with its share of the cycles,
+the taken and not taken counts of jumps, and its source line.
+*/
+void print_profile(const System *sys, const Profile *profile, FILE *out) {
+  unsigned long long total = 0;
+  for (int op = OP_NOP; op <= OP_END; op++) total += profile->opcode_cycles[op];
+
+  fprintf(out, "%-10s %14s %16s %8s\n", "opcode", "executions", "cycles",
+          "cycles%");
+  for (int op = OP_NOP; op <= OP_END; op++) {
+    if (profile->opcode_executions[op] == 0) continue;
+    fprintf(out, "%-10s %14lld %16llu %7.2f%%\n", opcode_names[op],
+            profile->opcode_executions[op], profile->opcode_cycles[op],
+            percent(profile->opcode_cycles[op], total));
+  }
+
+  fprintf(out, "\n%8s %14s %16s %8s %12s %12s  %s\n", "address", "executions",
+          "cycles", "cycles%", "taken", "not-taken", "line");
+  for (int i = 0; i < profile->num_instructions; i++) {
+    if (profile->executions[i] == 0) continue;
+    const char *line = i < sys->memory.num_instructions &&
+                               sys->memory.instruction[i] != NULL
+                           ? sys->memory.instruction[i]
+                           : "";
+    fprintf(out, "%8d %14lld %16llu %7.2f%% ", i * 4, profile->executions[i],
+            profile->cycles[i], percent(profile->cycles[i], total));
+    Opcode opcode = i < sys->memory.num_decoded ? sys->memory.code[i].opcode
+                                                : OP_NOP;
+    if (opcode >= OP_JMP && opcode <= OP_JNEVER) {
+      fprintf(out, "%12lld %12lld", profile->taken[i],
+              profile->executions[i] - profile->taken[i]);
+    } else {
+      fprintf(out, "%12s %12s", "", "");
+    }
+    fprintf(out, "  %s\n", line);
+  }
+}
+
+/* Name of the function of a context, as it is written in folded stacks */
+static const char *context_name(const System *sys, const CallContext *context) {
+  if (context->function < 0) return "program";
+  if (context->function >= sys->memory.num_instructions ||
+      sys->memory.instruction[context->function] == NULL) {
+    return "?";
+  }
+  return sys->memory.instruction[context->function];
+}
+
+/*
+Print the instructions executed in every calling context in the folded stack
+format of flame graph tools: one line per context, the functions called from
+the start of the program separated by semicolons, and the count. Functions are
+named after the labels called, the start of the program is "program".
+*/
+void print_folded_stacks(const System *sys, const Profile *profile, FILE *out) {
+  int *path = (int *)malloc((PROFILE_MAX_DEPTH + 1) * sizeof(int));
+  if (path == NULL) return;
+  for (int i = 0; i < profile->num_contexts; i++) {
+    if (profile->contexts[i].executions == 0) continue;
+    int depth = 0;
+    for (int c = i; c >= 0; c = profile->contexts[c].parent) path[depth++] = c;
+    while (depth-- > 0) {
+      fputs(context_name(sys, &profile->contexts[path[depth]]), out);
+      fputc(depth > 0 ? ';' : ' ', out);
+    }
+    fprintf(out, "%lld\n", profile->contexts[i].executions);
+  }
+  free(path);
+}
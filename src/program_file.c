@@ -0,0 +1,450 @@
+#include "program_file.h"
+#include "private_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Program files: a loaded and decoded program image, saved in binary form so
+that it can be mapped back and run without parsing anything.
+
+A program file holds a ProgramFileHeader, the offset of each line in the text,
+the decoded instructions, the label table, the text of the lines and the source
+the image was loaded from, in that order. map_program maps the file and points
+a new image at the arrays inside the mapping; only the table of line pointers
+is built at load time.
+
+The interpreters index registers, handlers and instructions with the decoded
+records unchecked, so a mapped file is not trusted: every opcode, operand,
+target and label table entry is checked to be in range, and the fusions and
+safe_size of the instructions are computed again (fuse_instructions,
+verify_instructions) rather than taken from the file.
+
+load_program_cached keeps program files in a cache directory, named after the
+hash of the source file they were loaded from, so a program is parsed once per
+machine; a cached file is only used when the source it holds is the same as
+the source file. The cache lives in the directory named by the
+ASSEMBLY_PROGRAM_CACHE environment variable, or by default in
+PROGRAM_CACHE_NAME under $XDG_CACHE_HOME or in /tmp/PROGRAM_CACHE_NAME-<uid>.
+Only a directory and files that belong to the user, and that nobody else can
+write, are used (see private_cache.c).
+
+Images are saved optimized (optimize_instructions), and a program file holds
+no pointers, only offsets, so it can be mapped anywhere. Every process that
+maps the same program file shares its pages with the others: the mapping is
+private, but the image is never written once it is optimized, so no page is
+ever copied. Many workers running one program hold one copy of it between
+them, and start without parsing it. To keep the files in memory as well, point
+ASSEMBLY_PROGRAM_CACHE at a directory on a tmpfs, such as
+/dev/shm/assembly_program_cache-<uid>. This is not the default, since /dev/shm
+is shared by every user and memory it takes is not given back by itself.
+
+The cache holds at most PROGRAM_CACHE_MAX_BYTES of program files, or the number
+of bytes in ASSEMBLY_PROGRAM_CACHE_LIMIT: saving a file removes the oldest
+others until the cache fits.
+
+Program files hold Instruction records as they are laid out in memory, so they
+are only read back by the same build: PROGRAM_FILE_VERSION has to change
+whenever decoding does.
+*/
+
+#define PROGRAM_FILE_MAGIC "ASMPROG"
+#define PROGRAM_FILE_VERSION 6
+#define PROGRAM_CACHE_NAME "assembly_program_cache"
+#define PROGRAM_CACHE_MAX_BYTES (256ll << 20)
+
+typedef struct ProgramFileHeader {
+  char magic[8];
+  int version;
+  int instruction_size;  // sizeof(Instruction)
+  int num_instructions;
+  int label_table_size;
+  int optimized;  // see Program
+  int removed;
+  unsigned long long text_bytes;
+  unsigned long long body_hash;     // of everything after the header
+  unsigned long long source_bytes;  // size and hash of the source, or 0
+  unsigned long long source_hash;
+} ProgramFileHeader;
+
+/* Hash of the bytes, continuing from hash. The bytes are taken eight at a time
+ * so that hashing keeps up with reading them */
+static unsigned long long hash_bytes(const void *data, size_t size,
+                                     unsigned long long hash) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  unsigned long long word;
+  for (; size >= 8; size -= 8, bytes += 8) {
+    memcpy(&word, bytes, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 32;
+  }
+  word = 0;
+  memcpy(&word, bytes, size);
+  hash = (hash ^ word ^ size) * 0x9e3779b97f4a7c15ull;
+  return hash ^ (hash >> 32);
+}
+
+/* Bytes of the arrays of the image that follow the header of a program file,
+ * which the source follows */
+static size_t image_bytes(const ProgramFileHeader *header) {
+  return (size_t)header->num_instructions *
+             (sizeof(unsigned int) + sizeof(Instruction)) +
+         (size_t)header->label_table_size * sizeof(int) + header->text_bytes;
+}
+
+/* Text of a line as it is saved, lines that were never set are END lines */
+static const char *line_text(const Program *program, int i) {
+  return program->instruction[i] ? program->instruction[i] : "END";
+}
+
+/*
+Write the image to a program file, followed by the source_bytes of source it
+was loaded from. The body is assembled in memory first, since its hash goes
+into the header. Returns 0 on success, and -1 if the image is not decoded or
+the file cannot be written.
+*/
+static int write_program_file(const Program *program, const char *filename,
+                              const char *source, size_t source_bytes,
+                              unsigned long long source_hash) {
+  if (program->num_decoded != program->num_instructions) {
+    errno = EINVAL;
+    return -1;
+  }
+  ProgramFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PROGRAM_FILE_MAGIC, sizeof(header.magic));
+  header.version = PROGRAM_FILE_VERSION;
+  header.instruction_size = sizeof(Instruction);
+  header.num_instructions = program->num_instructions;
+  header.label_table_size = program->label_table_size;
+  header.optimized = program->optimized;
+  header.removed = program->removed;
+  for (int i = 0; i < program->num_instructions; i++) {
+    header.text_bytes += strlen(line_text(program, i)) + 1;
+  }
+  if (header.text_bytes > UINT_MAX) {  // line offsets are 32 bits
+    errno = EFBIG;
+    return -1;
+  }
+  header.source_bytes = source_bytes;
+  header.source_hash = source_hash;
+
+  size_t bytes = image_bytes(&header);
+  char *body = (char *)malloc(bytes + 1);
+  if (body == NULL) return -1;
+  unsigned int *offsets = (unsigned int *)body;
+  char *code = body + header.num_instructions * sizeof(unsigned int);
+  char *label_table = code + header.num_instructions * sizeof(Instruction);
+  char *text = label_table + header.label_table_size * sizeof(int);
+  memcpy(code, program->code, header.num_instructions * sizeof(Instruction));
+  memcpy(label_table, program->label_table,
+         header.label_table_size * sizeof(int));
+  size_t offset = 0;
+  for (int i = 0; i < header.num_instructions; i++) {
+    const char *line = line_text(program, i);
+    size_t length = strlen(line) + 1;
+    offsets[i] = offset;
+    memcpy(text + offset, line, length);
+    offset += length;
+  }
+  header.body_hash = hash_bytes(source, source_bytes,
+                                hash_bytes(body, bytes, header.version));
+
+  FILE *out = fopen(filename, "wb");
+  int written = out != NULL && fwrite(&header, sizeof(header), 1, out) == 1 &&
+                fwrite(body, 1, bytes, out) == bytes &&
+                fwrite(source, 1, source_bytes, out) == source_bytes;
+  if (out != NULL && fclose(out) != 0) written = 0;
+  free(body);
+  return written ? 0 : -1;
+}
+
+/* Write the image to a program file, see map_program. Returns 0 on success,
+ * and -1 if the image is not decoded or the file cannot be written */
+int save_program(const Program *program, const char *filename) {
+  return write_program_file(program, filename, NULL, 0, 0);
+}
+
+/* The operand is of a known type, and a register or memory operand names one
+ * of the registers */
+static int is_valid_operand(MemoryType operand) {
+  if ((int)operand.type < REG || (int)operand.type > UNKNOWN ||
+      (int)operand.reg < EAX || (int)operand.reg > NOT_REG) {
+    return 0;
+  }
+  return (operand.type != REG && operand.type != MEM) || operand.reg != NOT_REG;
+}
+
+/*
+Check the records of a mapped image: opcodes, fusions and operands are in
+range, jumps and calls go to an instruction or just past the last one, folded
+sequences are constant MOVL or ADDL to a register that stay inside the program,
+and the label table holds instructions and has an empty slot.
+*/
+static int is_valid_image(const Program *program) {
+  int num = program->num_instructions;
+  for (int i = 0; i < num; i++) {
+    const Instruction *inst = &program->code[i];
+    if ((int)inst->opcode < OP_NOP || (int)inst->opcode > OP_END ||
+        (int)inst->fusion < FUSION_NONE || (int)inst->fusion >= NUM_FUSIONS ||
+        !is_valid_operand(inst->src) || !is_valid_operand(inst->dst) ||
+        inst->folded < 0 || inst->folded >= num - i) {
+      return 0;
+    }
+    if (inst->opcode >= OP_JMP && inst->opcode <= OP_CALL &&
+        inst->target != -1 &&
+        (inst->target < 0 || inst->target % 4 != 0 || inst->target / 4 > num)) {
+      return 0;
+    }
+    if (inst->folded > 0 &&
+        ((inst->opcode != OP_MOVL && inst->opcode != OP_ADDL) ||
+         inst->src.type != CONST || inst->dst.type != REG ||
+         inst->dst.reg == EIP)) {
+      return 0;
+    }
+  }
+  int used = 0;
+  for (int slot = 0; slot < program->label_table_size; slot++) {
+    int entry = program->label_table[slot];
+    if (entry < 0 || entry > num) return 0;
+    if (entry != 0) used++;
+  }
+  return used < program->label_table_size;  // lookups stop at an empty slot
+}
+
+/* Compute the fusions and safe_size of a mapped image again, see above.
+ * Returns -1 if memory cannot be allocated */
+static int check_image(Program *program) {
+  System loader;  // only holds the image
+  if (initialize_system_with_size(&loader, MEMORY_SIZE) != 0) return -1;
+  attach_program(&loader, program);
+  fuse_instructions(&loader);
+  verify_instructions(&loader);
+  destroy_system(&loader);
+  return 0;
+}
+
+/*
+Map the program file open at fd, which is closed, and return a new image
+pointing into it, with its header in *header; the source it holds is at
+*source. The file is mapped privately, so the image can still be written to
+without changing the file. Returns NULL if the file cannot be mapped or is not
+a valid program file of this build.
+*/
+static Program *map_program_file(int fd, ProgramFileHeader *header,
+                                 const char **source) {
+  if (fd < 0) return NULL;
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ProgramFileHeader)) {
+    mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
+
+  size_t bytes = st.st_size;
+  memcpy(header, mapping, sizeof(*header));
+  char *body = (char *)mapping + sizeof(*header);
+
+  Program *program = NULL;
+  if (memcmp(header->magic, PROGRAM_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+      header->version == PROGRAM_FILE_VERSION &&
+      header->instruction_size == (int)sizeof(Instruction) &&
+      header->num_instructions >= 0 && header->label_table_size > 0 &&
+      (header->label_table_size & (header->label_table_size - 1)) == 0 &&
+      header->text_bytes <= bytes && header->source_bytes <= bytes &&
+      image_bytes(header) + header->source_bytes == bytes - sizeof(*header) &&
+      hash_bytes(body + image_bytes(header), header->source_bytes,
+                 hash_bytes(body, image_bytes(header), header->version)) ==
+          header->body_hash) {
+    program = (Program *)malloc(sizeof(Program) +
+                                header->num_instructions * sizeof(char *));
+  }
+  if (program == NULL) {
+    munmap(mapping, bytes);
+    return NULL;
+  }
+  const unsigned int *offsets = (const unsigned int *)body;
+  char *code = body + header->num_instructions * sizeof(unsigned int);
+  char *label_table = code + header->num_instructions * sizeof(Instruction);
+  char *text = label_table + header->label_table_size * sizeof(int);
+
+  program->refcount = 1;
+  program->num_instructions = header->num_instructions;
+  program->num_decoded = header->num_instructions;
+  program->capacity = header->num_instructions;
+  program->instruction = (char **)(program + 1);
+  program->code = (Instruction *)code;
+  program->label_table_size = header->label_table_size;
+  program->label_table = (int *)label_table;
+  program->free_lines = 0;
+  program->optimized = header->optimized;
+  program->removed = header->removed;
+  program->revision = 0;
+  program->mapping = mapping;
+  program->mapping_bytes = bytes;
+  for (int i = 0; i < header->num_instructions; i++) {
+    // every line has to end inside the text
+    if (offsets[i] >= header->text_bytes || text[header->text_bytes - 1]) {
+      release_program(program);
+      return NULL;
+    }
+    program->instruction[i] = text + offsets[i];
+  }
+  if (!is_valid_image(program) || check_image(program) != 0) {
+    release_program(program);
+    return NULL;
+  }
+  *source = body + image_bytes(header);
+  return program;
+}
+
+/* Map a program file written by save_program into a new image, which the
+ * caller holds the only reference to. Returns NULL if the file cannot be
+ * mapped or is not a valid program file of this build */
+Program *map_program(const char *filename) {
+  ProgramFileHeader header;
+  const char *source;
+  return map_program_file(open(filename, O_RDONLY | O_CLOEXEC), &header,
+                          &source);
+}
+
+/* Map the contents of a regular file, and put their size in *bytes. Returns
+ * NULL if the file cannot be mapped, empty files included */
+static char *map_source(const char *filename, size_t *bytes) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void *source = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (source == MAP_FAILED) return NULL;
+  madvise(source, st.st_size, MADV_SEQUENTIAL);
+  *bytes = st.st_size;
+  return (char *)source;
+}
+
+typedef struct CachedFile {
+  char name[22];  // <hash>.prog
+  long long bytes;
+  time_t modified;
+} CachedFile;
+
+static int compare_modified(const void *a, const void *b) {
+  time_t x = ((const CachedFile *)a)->modified;
+  time_t y = ((const CachedFile *)b)->modified;
+  return (x > y) - (x < y);
+}
+
+/* Remove the oldest program files of the cache directory but the one called
+ * kept until they add up to no more than the limit of the cache, see above */
+static void trim_cache(const char *dir, const char *kept) {
+  long long limit = PROGRAM_CACHE_MAX_BYTES;
+  if (getenv("ASSEMBLY_PROGRAM_CACHE_LIMIT") != NULL) {
+    limit = atoll(getenv("ASSEMBLY_PROGRAM_CACHE_LIMIT"));
+  }
+  DIR *files = opendir(dir);
+  if (files == NULL) return;
+  CachedFile *cached = NULL;
+  int num = 0, capacity = 0;
+  long long total = 0;
+  struct dirent *file;
+  while ((file = readdir(files)) != NULL) {
+    // cached files only, not files being written
+    struct stat st;
+    if (strlen(file->d_name) != 21 || strcmp(file->d_name + 16, ".prog") != 0 ||
+        fstatat(dirfd(files), file->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    total += st.st_size;
+    if (strcmp(file->d_name, kept) == 0) continue;
+    if (num == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      CachedFile *grown =
+          (CachedFile *)realloc(cached, capacity * sizeof(CachedFile));
+      if (grown == NULL) break;
+      cached = grown;
+    }
+    memcpy(cached[num].name, file->d_name, 22);
+    cached[num].bytes = st.st_size;
+    cached[num].modified = st.st_mtime;
+    num++;
+  }
+  qsort(cached, num, sizeof(CachedFile), compare_modified);
+  for (int i = 0; i < num && total > limit; i++) {
+    if (unlinkat(dirfd(files), cached[i].name, 0) == 0) {
+      total -= cached[i].bytes;
+    }
+  }
+  free(cached);
+  closedir(files);
+}
+
+/*
+Load a program from a file into a new image like load_program, and optimize
+it, through the program file cache: the image is mapped from the cache when
+the source has been loaded before, and saved to it otherwise. Sources that
+cannot be mapped, such as pipes, are loaded without the cache and are not
+optimized; when the cache cannot be used or written, the image is only not
+saved. Returns NULL if the file cannot be read or memory cannot be allocated.
+*/
+Program *load_program_cached(const char *filename) {
+  char dir[4000], cached[4096], temporary[4096];
+  size_t source_bytes;
+  char *source = map_source(filename, &source_bytes);
+  if (source == NULL) return load_program(filename);
+  unsigned long long source_hash =
+      hash_bytes(source, source_bytes, PROGRAM_FILE_VERSION);
+  int cache = private_cache_directory("ASSEMBLY_PROGRAM_CACHE",
+                                      PROGRAM_CACHE_NAME, dir,
+                                      sizeof(dir)) == 0;
+  snprintf(cached, sizeof(cached), "%s/%016llx.prog", dir, source_hash);
+
+  ProgramFileHeader header;
+  const char *saved_source;
+  Program *program = cache ? map_program_file(open_private_file(cached),
+                                              &header, &saved_source)
+                           : NULL;
+  if (program != NULL && header.source_bytes == source_bytes &&
+      header.source_hash == source_hash &&
+      memcmp(saved_source, source, source_bytes) == 0) {
+    munmap(source, source_bytes);
+    return program;
+  }
+  release_program(program);
+
+  program = load_program_text(source, source_bytes);
+  if (program != NULL && optimize_program(program) < 0) {
+    release_program(program);
+    program = NULL;
+  }
+  if (program != NULL && cache) {
+    snprintf(temporary, sizeof(temporary), "%s/%016llx.%d.prog", dir,
+             source_hash, (int)getpid());
+    if (write_program_file(program, temporary, source, source_bytes,
+                           source_hash) != 0 ||
+        chmod(temporary, 0600) != 0 || rename(temporary, cached) != 0) {
+      unlink(temporary);
+    } else {
+      trim_cache(dir, strrchr(cached, '/') + 1);
+    }
+  }
+  munmap(source, source_bytes);
+  return program;
+}
+
+/* Same as load_instructions_from_file, through the program file cache */
+int load_instructions_cached(System *sys, const char *filename) {
+  return attach_loaded_program(sys, load_program_cached(filename), filename);
+}
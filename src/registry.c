@@ -0,0 +1,281 @@
+#include "registry.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Program registry: one decoded image per distinct program in the process.
+
+load_program_registered hashes the source the way the loader sees it, with the
+lines run through reformat and empty lines left out, so texts that only differ
+in spacing share an entry. A text seen before gets a new reference to the
+registered image; any other text is loaded, optimized and registered. Images
+are shared by every caller and system they are attached to, and must not be
+changed (optimize_instructions has already run on them).
+
+The registry holds at most max_programs images, and drops its reference to the
+least recently used one to make room for a new one; an image that is dropped
+stays alive for as long as someone else holds it. Entries are found by the
+hash of the normalized source, and keep a copy of it, which a text has to
+match byte for byte to share the image.
+
+Every registered image gets an id, which get_registered_program finds it by
+while it is registered. Ids start at 1 and are not given out again, so the id
+of an image that was dropped finds nothing, and its text gets a new id when it
+is loaded again. Once INT_MAX has been given out, new texts are no longer
+registered: they are still decoded, but get id 0 like an image that could not
+be registered, and images registered before keep their ids.
+*/
+
+typedef struct Entry {
+  unsigned long long hash;  // of the normalized source
+  char *text;               // the normalized source
+  size_t bytes;
+  Program *program;         // the registry's reference
+  int id;
+  struct Entry *newer, *older;  // use order
+  struct Entry *next;           // in the same bucket
+  struct Entry *next_id;        // in the same bucket of ids
+} Entry;
+
+struct Registry {
+  pthread_mutex_t lock;
+  Entry **buckets;  // num_buckets chains, a power of two
+  Entry **ids;      // num_buckets chains by id
+  int num_buckets;
+  int next_id;  // 0 once the ids have run out
+  Entry *newest, *oldest;
+  int max_programs;
+  RegistryStats stats;
+};
+
+/* Copy the source into text, which has room for size + 1 bytes, with its lines
+ * normalized as in reformat and empty lines left out; each line ends with a
+ * newline. Returns the bytes copied */
+static size_t normalize(const char *source, size_t size, char *text) {
+  size_t count = 0, line_bytes = 0;
+  int after_break = 1;  // the previous byte was a space or newline
+
+  for (size_t i = 0; i <= size; i++) {
+    char c = i < size ? source[i] : '\n';
+    int is_space = c == ' ';
+    if ((is_space && after_break) || (c == '\n' && line_bytes == 0)) {
+      after_break = 1;
+      continue;
+    }
+    after_break = is_space || c == '\n';
+    line_bytes = c == '\n' ? 0 : line_bytes + 1;
+    text[count++] = c;
+  }
+  return count;
+}
+
+/* Hash of the normalized source, taken eight bytes at a time */
+static unsigned long long hash_text(const char *text, size_t bytes) {
+  unsigned long long hash = 0, word;
+  size_t i = 0;
+  for (; i + 8 <= bytes; i += 8) {
+    memcpy(&word, text + i, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 32;
+  }
+  word = 0;
+  memcpy(&word, text + i, bytes - i);
+  hash = (hash ^ word ^ bytes) * 0x9e3779b97f4a7c15ull;
+  return hash ^ (hash >> 32);
+}
+
+/* New registry holding up to max_programs images. Returns NULL if memory
+ * cannot be allocated */
+Registry *create_registry(int max_programs) {
+  Registry *registry = (Registry *)calloc(1, sizeof(Registry));
+  if (registry == NULL) return NULL;
+  registry->max_programs = max_programs > 0 ? max_programs : 1;
+  registry->num_buckets = 16;
+  while (registry->num_buckets < 2 * registry->max_programs) {
+    registry->num_buckets *= 2;
+  }
+  registry->buckets = (Entry **)calloc(registry->num_buckets, sizeof(Entry *));
+  registry->ids = (Entry **)calloc(registry->num_buckets, sizeof(Entry *));
+  if (registry->buckets == NULL || registry->ids == NULL) {
+    free(registry->buckets);
+    free(registry->ids);
+    free(registry);
+    return NULL;
+  }
+  registry->next_id = 1;
+  pthread_mutex_init(&registry->lock, NULL);
+  return registry;
+}
+
+static void unlink_used(Registry *registry, Entry *entry) {
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    registry->newest = entry->older;
+  }
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    registry->oldest = entry->newer;
+  }
+}
+
+static void link_newest(Registry *registry, Entry *entry) {
+  entry->newer = NULL;
+  entry->older = registry->newest;
+  if (registry->newest != NULL) registry->newest->newer = entry;
+  registry->newest = entry;
+  if (registry->oldest == NULL) registry->oldest = entry;
+}
+
+/* Registered entry for the normalized source, made the most recently used, or
+ * NULL. The lock is held */
+static Entry *find_entry(Registry *registry, unsigned long long hash,
+                         const char *text, size_t bytes) {
+  Entry *entry = registry->buckets[hash & (registry->num_buckets - 1)];
+  while (entry != NULL &&
+         (entry->hash != hash || entry->bytes != bytes ||
+          memcmp(entry->text, text, bytes) != 0)) {
+    entry = entry->next;
+  }
+  if (entry != NULL && entry != registry->newest) {
+    unlink_used(registry, entry);
+    link_newest(registry, entry);
+  }
+  return entry;
+}
+
+/* Drop the least recently used entry. The lock is held */
+static void evict_oldest(Registry *registry) {
+  Entry *entry = registry->oldest;
+  Entry **link = &registry->buckets[entry->hash & (registry->num_buckets - 1)];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  link = &registry->ids[entry->id & (registry->num_buckets - 1)];
+  while (*link != entry) link = &(*link)->next_id;
+  *link = entry->next_id;
+  unlink_used(registry, entry);
+  release_program(entry->program);
+  free(entry->text);
+  free(entry);
+  registry->stats.num_programs--;
+  registry->stats.evictions++;
+}
+
+/* Load and optimize a program that is not registered. Returns NULL if memory
+ * cannot be allocated */
+static Program *load_optimized(const char *source, size_t size) {
+  Program *program = load_program_text(source, size);
+  if (program != NULL && optimize_program(program) < 0) {
+    release_program(program);
+    return NULL;
+  }
+  return program;
+}
+
+/*
+The decoded, optimized image of the program in size bytes of source text, from
+the registry if the same program has been loaded before, see above. Its id goes
+into *id unless id is NULL, 0 if the image could not be registered. Returns
+NULL if memory cannot be allocated; the caller holds a reference to the image.
+*/
+Program *load_program_registered(Registry *registry, const char *source,
+                                 size_t size, int *id) {
+  char *text = (char *)malloc(size + 1);
+  if (text == NULL) return NULL;
+  size_t bytes = normalize(source, size, text);
+  unsigned long long hash = hash_text(text, bytes);
+  pthread_mutex_lock(&registry->lock);
+  Entry *entry = find_entry(registry, hash, text, bytes);
+  if (entry != NULL) {
+    registry->stats.hits++;
+    __atomic_add_fetch(&entry->program->refcount, 1, __ATOMIC_RELAXED);
+    if (id != NULL) *id = entry->id;
+    pthread_mutex_unlock(&registry->lock);
+    free(text);
+    return entry->program;
+  }
+  pthread_mutex_unlock(&registry->lock);
+
+  // decoded without the lock; a thread that loaded the same text meanwhile
+  // registers it first
+  Program *program = load_optimized(source, size);
+  if (program == NULL) {
+    free(text);
+    return NULL;
+  }
+  pthread_mutex_lock(&registry->lock);
+  registry->stats.misses++;
+  entry = find_entry(registry, hash, text, bytes);
+  if (entry != NULL) {
+    release_program(program);
+    program = entry->program;
+    free(text);
+  } else if (registry->next_id != 0 &&
+             (entry = (Entry *)malloc(sizeof(Entry))) != NULL) {
+    if (registry->stats.num_programs == registry->max_programs) {
+      evict_oldest(registry);
+    }
+    entry->hash = hash;
+    entry->text = text;
+    entry->bytes = bytes;
+    entry->program = program;
+    entry->id = registry->next_id;
+    registry->next_id =
+        registry->next_id == INT_MAX ? 0 : registry->next_id + 1;
+    Entry **bucket = &registry->buckets[hash & (registry->num_buckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    bucket = &registry->ids[entry->id & (registry->num_buckets - 1)];
+    entry->next_id = *bucket;
+    *bucket = entry;
+    link_newest(registry, entry);
+    registry->stats.num_programs++;
+  } else {
+    pthread_mutex_unlock(&registry->lock);
+    free(text);
+    if (id != NULL) *id = 0;
+    return program;  // not registered, the caller holds the only reference
+  }
+  __atomic_add_fetch(&program->refcount, 1, __ATOMIC_RELAXED);
+  if (id != NULL) *id = entry->id;
+  pthread_mutex_unlock(&registry->lock);
+  return program;
+}
+
+/* The registered image with the id, made the most recently used, or NULL if
+ * no image has it (any more). The caller holds a reference to the image */
+Program *get_registered_program(Registry *registry, int id) {
+  pthread_mutex_lock(&registry->lock);
+  Entry *entry = registry->ids[id & (registry->num_buckets - 1)];
+  while (entry != NULL && entry->id != id) entry = entry->next_id;
+  if (entry != NULL && entry != registry->newest) {
+    unlink_used(registry, entry);
+    link_newest(registry, entry);
+  }
+  Program *program = entry != NULL ? entry->program : NULL;
+  if (program != NULL) {
+    __atomic_add_fetch(&program->refcount, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&registry->lock);
+  return program;
+}
+
+/* Hits, misses and evictions so far, and the images registered now */
+void get_registry_stats(Registry *registry, RegistryStats *stats) {
+  pthread_mutex_lock(&registry->lock);
+  *stats = registry->stats;
+  pthread_mutex_unlock(&registry->lock);
+}
+
+/* Free the registry and release its images */
+void destroy_registry(Registry *registry) {
+  if (registry == NULL) return;
+  while (registry->oldest != NULL) evict_oldest(registry);
+  free(registry->buckets);
+  free(registry->ids);
+  pthread_mutex_destroy(&registry->lock);
+  free(registry);
+}
@@ -0,0 +1,122 @@
+#include "scheduler.h"
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <new>
+
+/*
+Coroutine executor: many guest programs on one thread.
+
+Every guest is a coroutine (run_guest) that runs its system with run_for, one
+slice of instructions at a time, and goes to the back of the ready queue each
+time it runs out of budget. run_scheduler resumes the guest at the front of the
+queue until none are left, so a guest stuck in an endless loop only ever takes
+its turn. A guest costs its System and a coroutine frame of a few dozen bytes,
+rather than a thread and its stack; run_for keeps all of the state of a run in
+the system, so there is nothing else to save when a guest yields.
+
+A scheduler belongs to the thread that runs it; a pool of threads runs one
+scheduler each. The instruction set has no I/O instructions, so guests only
+yield when their slice is used up.
+*/
+
+struct Guest {
+  struct promise_type {
+    Guest get_return_object() {
+      return Guest{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    // frames come from the nothrow operator new, see spawn_guest
+    static Guest get_return_object_on_allocation_failure() {
+      return Guest{nullptr};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    // kept until run_scheduler sees that the guest is done
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+struct Scheduler {
+  long long slice;  // instructions per turn, see run_for
+  std::deque<std::coroutine_handle<>> ready;
+  int num_guests;  // spawned and not finished
+};
+
+/* Suspend the guest, and queue it for its next turn */
+struct Yield {
+  Scheduler *scheduler;
+  bool await_ready() noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> guest) {
+    scheduler->ready.push_back(guest);
+  }
+  void await_resume() noexcept {}
+};
+
+/* The coroutine of a guest: run the system a slice at a time, and store how
+ * the run ended in *status */
+static Guest run_guest(Scheduler *scheduler, System *sys, RunStatus *status) {
+  RunStatus result;
+  while ((result = run_for(sys, scheduler->slice)) == RUN_BUDGET) {
+    co_await Yield{scheduler};
+  }
+  *status = result;
+}
+
+/* New scheduler giving each guest slice instructions per turn. Returns NULL if
+ * memory cannot be allocated */
+Scheduler *create_scheduler(long long slice) {
+  Scheduler *scheduler = new (std::nothrow) Scheduler();
+  if (scheduler == NULL) return NULL;
+  scheduler->slice = slice;
+  scheduler->num_guests = 0;
+  return scheduler;
+}
+
+/*
+Add a guest that runs the program loaded in sys from its current state. The
+system must stay in place, and must not be used by anything else, until the
+guest is done; how its run ended is written to *status then. Returns 0 on
+success, and -1 if memory cannot be allocated.
+*/
+int spawn_guest(Scheduler *scheduler, System *sys, RunStatus *status) {
+  Guest guest = run_guest(scheduler, sys, status);
+  if (!guest.handle) return -1;
+  try {
+    scheduler->ready.push_back(guest.handle);
+  } catch (const std::bad_alloc &) {
+    guest.handle.destroy();
+    return -1;
+  }
+  scheduler->num_guests++;
+  return 0;
+}
+
+/* Run the guests in turn until all of them are done, guests spawned while
+ * running included. Returns the number of turns taken */
+long long run_scheduler(Scheduler *scheduler) {
+  long long turns = 0;
+  while (!scheduler->ready.empty()) {
+    std::coroutine_handle<> guest = scheduler->ready.front();
+    scheduler->ready.pop_front();
+    guest.resume();
+    turns++;
+    if (guest.done()) {
+      guest.destroy();
+      scheduler->num_guests--;
+    }
+  }
+  return turns;
+}
+
+/* Guests that are not done yet */
+int count_guests(const Scheduler *scheduler) { return scheduler->num_guests; }
+
+/* Free the scheduler, and the guests that are not done; their systems are
+ * left where they stopped */
+void destroy_scheduler(Scheduler *scheduler) {
+  if (scheduler == NULL) return;
+  for (std::coroutine_handle<> guest : scheduler->ready) guest.destroy();
+  delete scheduler;
+}
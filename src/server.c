@@ -0,0 +1,315 @@
+#include "server.h"
+#include "registry.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+Interpreter server: a long-running process that runs programs for its clients,
+so that a job costs a request and a response instead of starting assembly_app,
+loading its program and printing the registers.
+
+Clients write ServerRequest records on a Unix domain socket (or a pipe to the
+server's stdin and stdout), and read one ServerResponse per request back, in
+order; both are binary, in the byte order of the machine. A request either
+carries program text, which the server loads, optimizes and caches, or names a
+cached program by the id the server gave it. The cache is a program registry
+(registry.c), which gives out the ids: the same program sent again, by any
+client, is not decoded again and keeps its id. The registry keeps the
+SERVER_REGISTRY_PROGRAMS programs used last; the id of a program it dropped is
+unknown from then on, and the text of that program gets a new id when it is
+sent again. The program assembly_app -S was started with is program 0, and
+stays cached for as long as the server runs.
+
+Every connection is served by a thread of its own, with a System of its own
+that has the program attached and is reset between runs (reset_system_dirty).
+Runs go through run_for, so that a request can put a limit on the instructions
+its run takes, and a program that never ends cannot hold the connection.
+*/
+
+struct Server {
+  Program *program;    // program 0, see add_server_program
+  int memory_size;     // words of data memory of every run
+  Registry *registry;  // the program texts sent, by id
+};
+
+typedef struct Connection {
+  Server *server;
+  int fd;
+} Connection;
+
+/* Read exactly bytes bytes. Returns 1 on success, 0 at end of input before
+ * any byte, and -1 on errors and on input that ends in the middle */
+static int read_all(int fd, void *buffer, size_t bytes) {
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t got = read(fd, (char *)buffer + done, bytes - done);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return got == 0 && done == 0 ? 0 : -1;
+    done += got;
+  }
+  return 1;
+}
+
+/* Write all bytes bytes. Returns 0 on success and -1 on errors */
+static int write_all(int fd, const void *buffer, size_t bytes) {
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t put = write(fd, (const char *)buffer + done, bytes - done);
+    if (put < 0 && errno == EINTR) continue;
+    if (put < 0) return -1;
+    done += put;
+  }
+  return 0;
+}
+
+/* New server without programs, running them with memory_size words of data
+ * memory. Returns NULL if memory cannot be allocated */
+Server *create_server(int memory_size) {
+  Server *server = (Server *)calloc(1, sizeof(Server));
+  if (server == NULL) return NULL;
+  server->registry = create_registry(SERVER_REGISTRY_PROGRAMS);
+  if (server->registry == NULL) {
+    free(server);
+    return NULL;
+  }
+  server->memory_size = memory_size;
+  return server;
+}
+
+/* Make the program, which the server takes a reference to, its program 0, in
+ * place of any it had. Connections may not be served yet. Returns the id 0 */
+int add_server_program(Server *server, Program *program) {
+  __atomic_add_fetch(&program->refcount, 1, __ATOMIC_RELAXED);
+  release_program(server->program);
+  server->program = program;
+  return 0;
+}
+
+/* Cached program with the id, or NULL. The caller holds a reference to it */
+static Program *find_program(Server *server, int id) {
+  if (id == 0 && server->program != NULL) {
+    __atomic_add_fetch(&server->program->refcount, 1, __ATOMIC_RELAXED);
+    return server->program;
+  }
+  return id > 0 ? get_registered_program(server->registry, id) : NULL;
+}
+
+/* Load and cache the program text, through the registry, and put its id in
+ * *id. Returns the program, which the caller holds a reference to, or NULL if
+ * it jumps or calls to undefined labels or memory cannot be allocated */
+static Program *load_text(Server *server, const char *text, int text_bytes,
+                          int *id) {
+  Program *program =
+      load_program_registered(server->registry, text, text_bytes, id);
+  if (program == NULL || *id == 0) {
+    release_program(program);
+    return NULL;
+  }
+  for (int i = 0; i < program->num_instructions; i++) {
+    Opcode opcode = program->code[i].opcode;
+    if (opcode >= OP_JMP && opcode <= OP_CALL &&
+        program->code[i].target == -1) {
+      release_program(program);
+      return NULL;
+    }
+  }
+  return program;
+}
+
+/* Answer one request on the system of the connection */
+static void serve_request(Server *server, System *sys,
+                          const ServerRequest *request, const char *text,
+                          ServerResponse *response) {
+  memset(response, 0, sizeof(*response));
+  response->program = request->program;
+  Program *program;
+  if (request->text_bytes > 0) {
+    program = load_text(server, text, request->text_bytes, &response->program);
+    if (program == NULL) {
+      response->program = -1;
+      response->status = SERVER_BAD_PROGRAM;
+      return;
+    }
+  } else {
+    program = find_program(server, response->program);
+    if (program == NULL) {
+      response->status = SERVER_UNKNOWN_PROGRAM;
+      return;
+    }
+  }
+  if (request->run && sys->memory.program != program) {
+    attach_program(sys, program);
+  }
+  release_program(program);  // the system holds its own reference
+  if (!request->run) return;
+
+  reset_system_dirty(sys);
+  sys->registers[EAX] = request->eax;
+  sys->registers[EDX] = request->edx;
+  sys->registers[ECX] = request->ecx;
+  response->run_status =
+      run_for(sys, request->budget > 0 ? request->budget : LLONG_MAX);
+  memcpy(response->registers, sys->registers, sizeof(response->registers));
+  response->comparison_flag = sys->comparison_flag;
+}
+
+/*
+Answer the requests read from in_fd on out_fd until in_fd ends. Returns 0 when
+it ends after a whole request, and -1 on read and write errors, malformed
+requests, and when memory cannot be allocated.
+*/
+int serve_connection(Server *server, int in_fd, int out_fd) {
+  System sys;
+  if (initialize_system_with_size(&sys, server->memory_size) != 0) return -1;
+  char *text = NULL;
+  int capacity = 0, result = -1;
+
+  for (;;) {
+    ServerRequest request;
+    int got = read_all(in_fd, &request, sizeof(request));
+    if (got <= 0) {
+      result = got;
+      break;
+    }
+    if (request.text_bytes < 0 || request.text_bytes > SERVER_MAX_TEXT) break;
+    if (request.text_bytes > capacity) {
+      char *grown = (char *)realloc(text, request.text_bytes);
+      if (grown == NULL) break;
+      text = grown;
+      capacity = request.text_bytes;
+    }
+    if (read_all(in_fd, text, request.text_bytes) != 1) break;
+
+    ServerResponse response;
+    serve_request(server, &sys, &request, text, &response);
+    if (write_all(out_fd, &response, sizeof(response)) != 0) break;
+  }
+  free(text);
+  destroy_system(&sys);
+  return result;
+}
+
+/* Thread serving one client of run_server */
+static void *connection_thread(void *arg) {
+  Connection *connection = (Connection *)arg;
+  serve_connection(connection->server, connection->fd, connection->fd);
+  close(connection->fd);
+  free(connection);
+  return NULL;
+}
+
+/*
+Serve clients connecting to a Unix domain socket at socket_path, each on a
+thread of its own; a file left at the path is replaced. With a NULL path, serve
+the requests on stdin and stdout instead. Returns -1 if the socket cannot be
+set up, and 0 once stdin ends; a socket is served until the process ends.
+*/
+int run_server(Server *server, const char *socket_path) {
+  signal(SIGPIPE, SIG_IGN);  // a client that goes away ends its connection
+  if (socket_path == NULL) {
+    return serve_connection(server, STDIN_FILENO, STDOUT_FILENO) == 0 ? 0 : -1;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) return -1;
+  unlink(socket_path);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    close(listener);
+    return -1;
+  }
+
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) continue;  // interrupted, or a client that already went away
+    Connection *connection = (Connection *)malloc(sizeof(Connection));
+    pthread_t thread;
+    if (connection != NULL) {
+      connection->server = server;
+      connection->fd = fd;
+      if (pthread_create(&thread, NULL, connection_thread, connection) == 0) {
+        pthread_detach(thread);
+        continue;
+      }
+    }
+    free(connection);
+    close(fd);
+  }
+}
+
+/* Free the server and release its programs; no connection may be served any
+ * more */
+void destroy_server(Server *server) {
+  if (server == NULL) return;
+  release_program(server->program);
+  destroy_registry(server->registry);
+  free(server);
+}
+
+/* Connect to a server listening at socket_path. Returns the socket, or -1 */
+int connect_server(const char *socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Send a request, followed by request->text_bytes of text. Returns 0 on
+ * success and -1 on errors */
+int send_server_request(int fd, const ServerRequest *request, const char *text) {
+  if (write_all(fd, request, sizeof(*request)) != 0) return -1;
+  if (request->text_bytes <= 0) return 0;
+  return write_all(fd, text, request->text_bytes);
+}
+
+/* Read the response to the oldest request that has not been answered. Returns
+ * 0 on success and -1 on errors */
+int read_server_response(int fd, ServerResponse *response) {
+  return read_all(fd, response, sizeof(*response)) == 1 ? 0 : -1;
+}
+
+/* Read a whole program file into a new buffer, for a request. Returns NULL if
+ * it cannot be read or is longer than SERVER_MAX_TEXT */
+char *read_program_text(const char *filename, int *text_bytes) {
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) return NULL;
+  char *text = (char *)malloc(SERVER_MAX_TEXT);
+  size_t got = text != NULL ? fread(text, 1, SERVER_MAX_TEXT, file) : 0;
+  if (text == NULL || ferror(file) || fgetc(file) != EOF) {
+    free(text);
+    text = NULL;
+  } else {
+    *text_bytes = (int)got;
+    char *fitted = (char *)realloc(text, got + 1);
+    if (fitted != NULL) text = fitted;
+  }
+  fclose(file);
+  return text;
+}
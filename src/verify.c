@@ -0,0 +1,639 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interpreter.h"
+
+/*
+Static range verifier.
+
+verify_instructions runs an abstract interpretation of the decoded program
+that tracks the range of values each of EAX, EDX, ECX, ESP and EBP can hold,
+and marks the instructions whose data memory accesses it proves to be in
+bounds and aligned: their safe_size is the smallest memory size (in words) the
+proof holds for. The interpreter runs marked instructions without bounds
+checks; every other instruction keeps them, so MEMORY_ERROR is reported
+exactly as before.
+
+The analysis assumes a run that starts the way reset_system leaves a system:
+EIP at 0, and ESP and EBP at the initial stack pointer, size - 256 (a
+multiple of 4 when the size is). EAX, EDX and ECX can hold anything. Stack
+pointers are tracked as offsets from the initial stack pointer, so one proof
+covers every memory size; other values as plain ranges. Data memory is not
+tracked, values loaded from it can be anything.
+
+Values are kept per basic block. Loops are widened, first to the constants
+that appear in the program and then to the full range, and the comparison of
+a register with a constant narrows its range along the jump that follows.
+RET and instructions that write EIP can go to any instruction: whatever state
+they leave is merged into every instruction.
+*/
+
+#define STACK_LIMIT (1 << 30)  // stack offsets that stay far from wrapping
+#define WIDEN_AFTER 2          // changes of a block state before widening
+#define WIDEN_LIMIT 12         // changes before widening to the full range
+
+typedef enum RangeKind { RANGE_ABS, RANGE_STACK } RangeKind;
+
+// Values lo to hi; for RANGE_STACK, offsets from the initial stack pointer
+typedef struct Range {
+  signed char kind;
+  signed char aligned;  // every value is a multiple of 4
+  int lo, hi;
+} Range;
+
+typedef struct RangeState {
+  signed char reachable;
+  signed char cmp_reg;  // register the last CMPL compared with a constant
+  signed char cmp_reg_is_dst;
+  unsigned char changes;  // times the state grew, see merge_state
+  int cmp_value;
+  Range reg[EIP];  // EAX to EBP
+} RangeState;
+
+typedef struct Verifier {
+  Instruction *code;
+  int num;
+  int *slot;           // state of each block leader, -1 for other instructions
+  RangeState *states;  // one per block leader
+  int *leader;         // instruction of each state
+  int num_states;
+  RangeState any;  // state anything jumping to EIP leaves, see jump_anywhere
+  int *work;       // states to visit again
+  int num_work;
+  char *queued;
+  int *thresholds;  // sorted constants of the program, see widen
+  int num_thresholds;
+  int *safe;  // safe_size of each instruction, stored once all are known
+} Verifier;
+
+static Range full_range(int aligned) {
+  Range range = {RANGE_ABS, (signed char)aligned, INT_MIN, INT_MAX};
+  return range;
+}
+
+static Range constant_range(int value) {
+  Range range = {RANGE_ABS, (signed char)(value % 4 == 0), value, value};
+  return range;
+}
+
+/* The range lo to hi of the given kind, or the full range if its values could
+ * wrap around */
+static Range make_range(int kind, int aligned, long long lo, long long hi) {
+  long long min = kind == RANGE_STACK ? -STACK_LIMIT : INT_MIN;
+  long long max = kind == RANGE_STACK ? STACK_LIMIT : INT_MAX;
+  if (lo < min || hi > max) return full_range(aligned);
+  Range range = {(signed char)kind, (signed char)aligned, (int)lo, (int)hi};
+  return range;
+}
+
+static Range add_ranges(Range a, Range b) {
+  int aligned = a.aligned && b.aligned;
+  if (a.kind == RANGE_STACK && b.kind == RANGE_STACK) {
+    return full_range(aligned);
+  }
+  return make_range(a.kind == RANGE_STACK ? a.kind : b.kind, aligned,
+                    (long long)a.lo + b.lo, (long long)a.hi + b.hi);
+}
+
+static Range join_ranges(Range a, Range b) {
+  int aligned = a.aligned && b.aligned;
+  if (a.kind != b.kind) return full_range(aligned);
+  return make_range(a.kind, aligned, a.lo < b.lo ? a.lo : b.lo,
+                    a.hi > b.hi ? a.hi : b.hi);
+}
+
+/* Index of the first threshold at least value */
+static int first_threshold(const Verifier *v, long long value) {
+  int lo = 0, hi = v->num_thresholds;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (v->thresholds[mid] < value) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Widen the bounds of range that moved past old to the next constant of the
+ * program, or all the way when there is none or full is set */
+static Range widen(const Verifier *v, Range range, Range old, int full) {
+  if (range.kind != old.kind) return range;
+  long long lo = range.lo, hi = range.hi;
+  if (range.lo < old.lo) {
+    int i = first_threshold(v, (long long)range.lo + 1);  // the last <= lo
+    lo = full || i == 0 ? INT_MIN : v->thresholds[i - 1];
+  }
+  if (range.hi > old.hi) {
+    int i = first_threshold(v, range.hi);
+    hi = full || i == v->num_thresholds ? INT_MAX : v->thresholds[i];
+  }
+  if (range.kind == RANGE_STACK && (lo < -STACK_LIMIT || hi > STACK_LIMIT)) {
+    return full_range(range.aligned);
+  }
+  return make_range(range.kind, range.aligned, lo, hi);
+}
+
+static int same_range(Range a, Range b) {
+  return a.kind == b.kind && a.aligned == b.aligned && a.lo == b.lo &&
+         a.hi == b.hi;
+}
+
+static int same_state(const RangeState *a, const RangeState *b) {
+  if (a->reachable != b->reachable || a->cmp_reg != b->cmp_reg ||
+      (a->cmp_reg >= 0 && (a->cmp_reg_is_dst != b->cmp_reg_is_dst ||
+                           a->cmp_value != b->cmp_value))) {
+    return 0;
+  }
+  for (int reg = EAX; reg < EIP; reg++) {
+    if (!same_range(a->reg[reg], b->reg[reg])) return 0;
+  }
+  return 1;
+}
+
+/* Join from into state. Returns whether state changed */
+static int join_state(RangeState *state, const RangeState *from) {
+  if (!from->reachable) return 0;
+  if (!state->reachable) {
+    unsigned char changes = state->changes;
+    *state = *from;
+    state->changes = changes;
+    return 1;
+  }
+  RangeState joined = *state;
+  for (int reg = EAX; reg < EIP; reg++) {
+    joined.reg[reg] = join_ranges(state->reg[reg], from->reg[reg]);
+  }
+  if (joined.cmp_reg != from->cmp_reg ||
+      joined.cmp_reg_is_dst != from->cmp_reg_is_dst ||
+      joined.cmp_value != from->cmp_value) {
+    joined.cmp_reg = -1;
+  }
+  if (same_state(&joined, state)) return 0;
+  *state = joined;
+  return 1;
+}
+
+/* Join from into the state of a block, widening when the state keeps growing.
+ * Returns whether state changed */
+static int merge_state(const Verifier *v, RangeState *state,
+                       const RangeState *from) {
+  if (same_state(state, from)) return 0;  // loops that are already stable
+  RangeState merged = *state;
+  if (!join_state(&merged, from)) return 0;
+  if (!state->reachable) {
+    *state = merged;
+    return 1;
+  }
+  if (merged.changes < UCHAR_MAX) merged.changes++;
+  if (merged.changes > WIDEN_AFTER) {
+    for (int reg = EAX; reg < EIP; reg++) {
+      merged.reg[reg] = widen(v, merged.reg[reg], state->reg[reg],
+                              merged.changes > WIDEN_LIMIT);
+    }
+  }
+  *state = merged;
+  return 1;
+}
+
+static void queue_state(Verifier *v, int slot) {
+  if (v->queued[slot]) return;
+  v->queued[slot] = 1;
+  v->work[v->num_work++] = slot;
+}
+
+/* Continue at the instruction idx, which is a block leader */
+static void jump_to(Verifier *v, int idx, const RangeState *state) {
+  if (idx < 0 || idx >= v->num) return;
+  int slot = v->slot[idx];
+  if (merge_state(v, &v->states[slot], state)) queue_state(v, slot);
+}
+
+/* Continue anywhere: RET, and instructions that write EIP */
+static void jump_anywhere(Verifier *v, const RangeState *state) {
+  if (!merge_state(v, &v->any, state)) return;
+  for (int slot = 0; slot < v->num_states; slot++) queue_state(v, slot);
+}
+
+static void set_register(RangeState *state, int reg, Range range) {
+  state->reg[reg] = range;
+  if (state->cmp_reg == reg) state->cmp_reg = -1;
+}
+
+/* Range of the register an operand names. EIP holds the address of the
+ * instruction being executed, plus whatever a write to EIP left it unaligned
+ * by, since the instruction at idx runs for EIP from idx * 4 to idx * 4 + 3 */
+static Range register_range(const RangeState *state, RegisterName reg,
+                            int idx) {
+  if (reg != EIP) return state->reg[reg];
+  return make_range(RANGE_ABS, 0, (long long)idx * 4, (long long)idx * 4 + 3);
+}
+
+/* Range of the value of an operand */
+static Range operand_range(const RangeState *state, MemoryType operand,
+                           int idx) {
+  if (operand.type == CONST) return constant_range(operand.value);
+  if (operand.type == REG) return register_range(state, operand.reg, idx);
+  return full_range(0);  // data memory is not tracked
+}
+
+/* Whether execute_decoded returns INSTRUCTION_ERROR for the operands */
+static int is_malformed(const Instruction *inst) {
+  MemoryType src = inst->src, dst = inst->dst;
+  switch (inst->opcode) {
+    case OP_MOVL:
+    case OP_ADDL:
+      if (dst.type == CONST) return 1;
+      // fall through
+    case OP_CMPL:
+      return src.type == UNKNOWN || dst.type == UNKNOWN ||
+             (src.type == MEM && dst.type == MEM);
+    case OP_PUSHL:
+      return src.type == UNKNOWN;
+    case OP_POPL:
+      return src.type == UNKNOWN || src.type == CONST;
+    default:
+      return 0;
+  }
+}
+
+static int writes_eip(const Instruction *inst) {
+  MemoryType written = inst->opcode == OP_POPL ? inst->src : inst->dst;
+  return (inst->opcode == OP_MOVL || inst->opcode == OP_ADDL ||
+          inst->opcode == OP_POPL) &&
+         written.type == REG && written.reg == EIP;
+}
+
+/* Whether execution can go on with the next instruction */
+static int falls_through(const Instruction *inst) {
+  switch (inst->opcode) {
+    case OP_NOP:
+      return 1;
+    case OP_MOVL:
+    case OP_ADDL:
+    case OP_CMPL:
+    case OP_PUSHL:
+    case OP_POPL:
+      return !is_malformed(inst) && !writes_eip(inst);
+    default:
+      return 0;
+  }
+}
+
+/*
+Narrow the state along one way out of a conditional jump, using the last
+comparison of a register with a constant. Returns 0 if the jump can never go
+that way.
+*/
+static int narrow(RangeState *state, Opcode opcode, int taken) {
+  // comparison flags (-1, 0, 1 as bits 0, 1, 2) that go this way
+  int flags;
+  switch (opcode) {
+    case OP_JE: flags = 2; break;
+    case OP_JNE: flags = 5; break;
+    case OP_JL: flags = 1; break;
+    case OP_JG: flags = 4; break;
+    default: return 1;
+  }
+  if (!taken) flags ^= 7;
+  if (state->cmp_reg < 0 ||
+      state->reg[(int)state->cmp_reg].kind != RANGE_ABS) {
+    return 1;
+  }
+  // the flag is the sign of dst - src: flip it when the register is src
+  if (!state->cmp_reg_is_dst) {
+    flags = ((flags & 1) << 2) | (flags & 2) | (flags >> 2);
+  }
+
+  Range *range = &state->reg[(int)state->cmp_reg];
+  long long c = state->cmp_value, lo = LLONG_MAX, hi = LLONG_MIN;
+  long long pieces[3][2] = {{range->lo, c - 1}, {c, c}, {c + 1, range->hi}};
+  for (int sign = 0; sign < 3; sign++) {
+    if (!(flags & (1 << sign))) continue;
+    long long piece_lo = pieces[sign][0], piece_hi = pieces[sign][1];
+    if (range->aligned) {
+      piece_lo = (piece_lo + 3) & ~3LL;
+      piece_hi &= ~3LL;
+    }
+    if (piece_lo > piece_hi) continue;
+    if (piece_lo < lo) lo = piece_lo;
+    if (piece_hi > hi) hi = piece_hi;
+  }
+  if (lo > hi) return 0;
+  range->lo = (int)lo;
+  range->hi = (int)hi;
+  return 1;
+}
+
+/*
+Execute the instruction at idx on state, sending the states it leaves at other
+instructions to them. Returns whether execution goes on with the next
+instruction, with state updated.
+*/
+static int transfer(Verifier *v, const Instruction *inst, int idx,
+                    RangeState *state) {
+  RangeState taken;
+  int target = inst->target < 0 ? -1 : inst->target / 4;
+
+  if (is_malformed(inst)) return 0;
+  switch (inst->opcode) {
+    case OP_NOP:
+      return 1;
+
+    case OP_MOVL:
+    case OP_ADDL:
+      if (inst->dst.type == REG) {
+        Range value = operand_range(state, inst->src, idx);
+        if (inst->opcode == OP_ADDL) {
+          value = add_ranges(register_range(state, inst->dst.reg, idx), value);
+        }
+        if (inst->dst.reg == EIP) {
+          jump_anywhere(v, state);
+          return 0;
+        }
+        set_register(state, inst->dst.reg, value);
+      }
+      return 1;
+
+    case OP_CMPL:
+      state->cmp_reg = -1;
+      if (inst->src.type == CONST && inst->dst.type == REG &&
+          inst->dst.reg != EIP) {
+        state->cmp_reg = inst->dst.reg;
+        state->cmp_reg_is_dst = 1;
+        state->cmp_value = inst->src.value;
+      } else if (inst->src.type == REG && inst->src.reg != EIP &&
+                 inst->dst.type == CONST) {
+        state->cmp_reg = inst->src.reg;
+        state->cmp_reg_is_dst = 0;
+        state->cmp_value = inst->dst.value;
+      }
+      return 1;
+
+    case OP_PUSHL:
+      set_register(state, ESP, add_ranges(state->reg[ESP], constant_range(-4)));
+      return 1;
+
+    case OP_POPL:
+      if (inst->src.type == REG) {
+        if (inst->src.reg == EIP) {
+          set_register(state, ESP,
+                       add_ranges(state->reg[ESP], constant_range(4)));
+          jump_anywhere(v, state);
+          return 0;
+        }
+        set_register(state, inst->src.reg, full_range(0));
+        if (inst->src.reg == ESP) return 1;  // ESP = value + 4
+      }
+      set_register(state, ESP, add_ranges(state->reg[ESP], constant_range(4)));
+      return 1;
+
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JNEVER:
+      if (target < 0) return 0;
+      // a jump to itself moves on, like any instruction that leaves EIP alone
+      if (target == idx) return 1;
+      if (inst->opcode != OP_JNEVER) {
+        taken = *state;
+        if (narrow(&taken, inst->opcode, 1)) jump_to(v, target, &taken);
+      }
+      return inst->opcode != OP_JMP && narrow(state, inst->opcode, 0);
+
+    case OP_CALL:
+      if (target < 0) return 0;
+      set_register(state, ESP, add_ranges(state->reg[ESP], constant_range(-4)));
+      if (target == idx) return 1;
+      jump_to(v, target, state);
+      return 0;
+
+    case OP_RET:
+      set_register(state, ESP, add_ranges(state->reg[ESP], constant_range(4)));
+      jump_anywhere(v, state);
+      return 0;
+
+    default:  // END
+      return 0;
+  }
+}
+
+/*
+Smallest memory size for which every address in base + offset is at least
+min_address, at most the address of the last word, and aligned; LLONG_MAX if
+there is none.
+*/
+static long long access_size(Range base, int offset, int min_address) {
+  if (!base.aligned || offset % 4 != 0) return LLONG_MAX;
+  long long lo = (long long)base.lo + offset, hi = (long long)base.hi + offset;
+  if (base.kind == RANGE_ABS) {
+    if (lo < min_address || hi > INT_MAX) return LLONG_MAX;
+    return hi / 4 + 1;
+  }
+  // addresses are size - 256 + offset: size - 256 + lo >= min_address and
+  // size - 256 + hi <= (size - 1) * 4
+  long long size = min_address + 256 - lo;
+  long long upper = hi > 252 ? (hi - 252 + 2) / 3 : 0;
+  return size > upper ? size : upper;
+}
+
+static long long operand_size(const RangeState *state, MemoryType operand,
+                              int idx) {
+  if (operand.type != MEM) return 0;
+  return access_size(register_range(state, operand.reg, idx), operand.value, 0);
+}
+
+/* safe_size of the instruction at idx, reached with state */
+static int safe_size(const Instruction *inst, int idx,
+                     const RangeState *state) {
+  long long size = 0, other = 0;
+  if (is_malformed(inst) || writes_eip(inst)) return INT_MAX;
+  switch (inst->opcode) {
+    case OP_MOVL:
+    case OP_ADDL:
+    case OP_CMPL:
+      if (inst->src.type != MEM && inst->dst.type != MEM) return INT_MAX;
+      size = operand_size(state, inst->src, idx);
+      other = operand_size(state, inst->dst, idx);
+      break;
+    case OP_PUSHL:
+      size = operand_size(state, inst->src, idx);
+      other = access_size(state->reg[ESP], -4, 4);
+      break;
+    case OP_POPL:
+      size = operand_size(state, inst->src, idx);
+      other = access_size(state->reg[ESP], 0, 0);
+      break;
+    case OP_CALL:
+      if (inst->target < 0) return INT_MAX;
+      other = access_size(state->reg[ESP], -4, 4);
+      break;
+    case OP_RET:
+      other = access_size(state->reg[ESP], 0, 0);
+      break;
+    default:
+      return INT_MAX;
+  }
+  if (other > size) size = other;
+  if (size < MIN_MEMORY_SIZE) size = MIN_MEMORY_SIZE;
+  return size > INT_MAX ? INT_MAX : (int)size;
+}
+
+/* Run the block starting at the leader of slot. When mark is set, the state is
+ * final and the instructions of the block are marked */
+static void run_block(Verifier *v, int slot, int mark) {
+  RangeState state = v->states[slot];
+  for (int idx = v->leader[slot]; idx < v->num; idx++) {
+    if (idx != v->leader[slot] && v->slot[idx] >= 0) {
+      jump_to(v, idx, &state);
+      return;
+    }
+    if (v->any.reachable) join_state(&state, &v->any);
+    if (!state.reachable) return;
+    if (mark) v->safe[idx] = safe_size(&v->code[idx], idx, &state);
+    if (!transfer(v, &v->code[idx], idx, &state)) return;
+  }
+}
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Collect the distinct constants and memory offsets of the program, sorted.
+ * Programs repeat a few constants many times, so they are told apart with a
+ * hash set first, which grows with the number of distinct ones. Returns -1 if
+ * memory cannot be allocated */
+static int collect_thresholds(Verifier *v) {
+  int capacity = 256, count = 0;
+  int *set = (int *)malloc((size_t)capacity * sizeof(int));
+  char *used = (char *)calloc(capacity, 1);
+  v->thresholds = (int *)malloc((size_t)capacity / 2 * sizeof(int));
+  for (int i = 0; i < v->num && set != NULL && used != NULL &&
+                  v->thresholds != NULL;
+       i++) {
+    const MemoryType operands[] = {v->code[i].src, v->code[i].dst};
+    for (int k = 0; k < 2; k++) {
+      if (operands[k].type != CONST && operands[k].type != MEM) continue;
+      int value = operands[k].value;
+      unsigned int slot = ((unsigned int)value * 2654435761u) & (capacity - 1);
+      while (used[slot] && set[slot] != value) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      if (used[slot]) continue;
+      used[slot] = 1;
+      set[slot] = value;
+      v->thresholds[count++] = value;
+      if (count < capacity / 2) continue;
+
+      // rehash the distinct values into a set twice the size
+      capacity *= 2;
+      free(set);
+      free(used);
+      set = (int *)malloc((size_t)capacity * sizeof(int));
+      used = (char *)calloc(capacity, 1);
+      int *grown =
+          (int *)realloc(v->thresholds, (size_t)capacity / 2 * sizeof(int));
+      if (grown != NULL) v->thresholds = grown;
+      if (set == NULL || used == NULL || grown == NULL) {
+        free(set);
+        set = NULL;
+        break;
+      }
+      for (int j = 0; j < count; j++) {
+        unsigned int at =
+            ((unsigned int)v->thresholds[j] * 2654435761u) & (capacity - 1);
+        while (used[at]) at = (at + 1) & (capacity - 1);
+        used[at] = 1;
+        set[at] = v->thresholds[j];
+      }
+    }
+  }
+  int failed = set == NULL || used == NULL || v->thresholds == NULL;
+  free(set);
+  free(used);
+  if (failed) return -1;
+  qsort(v->thresholds, count, sizeof(int), compare_ints);
+  v->num_thresholds = count;
+  return 0;
+}
+
+/*
+Mark the instructions of the decoded program whose data accesses are proven to
+be in bounds and aligned, see safe_size in Instruction. Instructions that are
+not proven, and all of them if memory runs out, get INT_MAX. Only the records
+whose safe_size changes are written, so that verifying a mapped image again
+leaves its pages shared (see program_file.c).
+*/
+void verify_instructions(System *sys) {
+  Verifier v;
+  memset(&v, 0, sizeof(v));
+  v.code = sys->memory.code;
+  v.num = sys->memory.num_instructions;
+  if (v.num <= 0) return;
+  v.safe = (int *)malloc((size_t)v.num * sizeof(int));
+  if (v.safe == NULL) {
+    for (int i = 0; i < v.num; i++) v.code[i].safe_size = INT_MAX;
+    return;
+  }
+  for (int i = 0; i < v.num; i++) v.safe[i] = INT_MAX;
+
+  // blocks start at the entry, at jump targets and after anything that does
+  // not go on with the next instruction
+  v.slot = (int *)malloc((size_t)v.num * sizeof(int));
+  if (v.slot != NULL) {
+    for (int i = 0; i < v.num; i++) v.slot[i] = -1;
+    v.slot[0] = 0;
+    for (int i = 0; i < v.num; i++) {
+      const Instruction *inst = &v.code[i];
+      int target = inst->target < 0 ? -1 : inst->target / 4;
+      if ((inst->opcode >= OP_JMP && inst->opcode <= OP_CALL) && target >= 0 &&
+          target < v.num) {
+        v.slot[target] = 0;
+      }
+      if (!falls_through(inst) && i + 1 < v.num) v.slot[i + 1] = 0;
+    }
+    for (int i = 0; i < v.num; i++) {
+      if (v.slot[i] == 0) v.slot[i] = v.num_states++;
+    }
+    v.states = (RangeState *)calloc(v.num_states, sizeof(RangeState));
+    v.leader = (int *)malloc((size_t)v.num_states * sizeof(int));
+    v.work = (int *)malloc((size_t)v.num_states * sizeof(int));
+    v.queued = (char *)calloc(v.num_states, 1);
+  }
+  if (v.slot != NULL && v.states != NULL && v.leader != NULL &&
+      v.work != NULL && v.queued != NULL && collect_thresholds(&v) == 0) {
+    for (int i = 0; i < v.num; i++) {
+      if (v.slot[i] >= 0) v.leader[v.slot[i]] = i;
+    }
+
+    RangeState entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.reachable = 1;
+    entry.cmp_reg = -1;
+    for (int reg = EAX; reg < ESP; reg++) entry.reg[reg] = full_range(0);
+    entry.reg[ESP] = make_range(RANGE_STACK, 1, 0, 0);
+    entry.reg[EBP] = entry.reg[ESP];
+    jump_to(&v, 0, &entry);
+
+    while (v.num_work > 0) {
+      int slot = v.work[--v.num_work];
+      v.queued[slot] = 0;
+      run_block(&v, slot, 0);
+    }
+    for (int slot = 0; slot < v.num_states; slot++) run_block(&v, slot, 1);
+  }
+  for (int i = 0; i < v.num; i++) {
+    if (v.code[i].safe_size != v.safe[i]) v.code[i].safe_size = v.safe[i];
+  }
+  free(v.safe);
+  free(v.slot);
+  free(v.thresholds);
+  free(v.states);
+  free(v.leader);
+  free(v.work);
+  free(v.queued);
+}
@@ -1,9 +1,19 @@
 #include <gtest/gtest.h>
+#include <glob.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "batch.h"
 #include "interpreter.h"
+#include "profile.h"
+#include "program_file.h"
+#include "registry.h"
+#include "scheduler.h"
+#include "server.h"
 
 // Include these definitions to test against solution:
 // int soln_get_set(Cache *cache, address_type address);
@@ -447,3 +457,1318 @@ TEST(ProjectTests, test_movl_register_from_file) {
       << "ECX should be 3 and yours is " << sys.registers[ECX] << ".";
 }
 
+
+TEST(ProjectTests, test_decode_instructions) {
+  System sys;
+  initialize_system(&sys);
+
+  sys.memory.num_instructions = 6;
+  sys.memory.instruction[0] = strdup(".L1");             // address 0
+  sys.memory.instruction[1] = strdup("ADDL $-4 (%EBP)");  // address 4
+  sys.memory.instruction[2] = strdup("PUSHL %EAX");      // address 8
+  sys.memory.instruction[3] = strdup("JGE .L1");         // address 12
+  sys.memory.instruction[4] = strdup("CALL .L9");        // address 16
+  sys.memory.instruction[5] = strdup("END");             // address 20
+  decode_instructions(&sys);
+
+  ASSERT_EQ(sys.memory.num_decoded, 6);
+  ASSERT_EQ(sys.memory.code[0].opcode, OP_NOP);
+  ASSERT_EQ(sys.memory.code[1].opcode, OP_ADDL);
+  ASSERT_EQ(sys.memory.code[1].src.type, CONST);
+  ASSERT_EQ(sys.memory.code[1].src.value, -4);
+  ASSERT_EQ(sys.memory.code[1].dst.type, MEM);
+  ASSERT_EQ(sys.memory.code[1].dst.reg, EBP);
+  ASSERT_EQ(sys.memory.code[2].opcode, OP_PUSHL);
+  ASSERT_EQ(sys.memory.code[2].src.reg, EAX);
+  ASSERT_EQ(sys.memory.code[3].opcode, OP_JNEVER);
+  ASSERT_EQ(sys.memory.code[3].target, 4)
+      << "Jump target should be the address after label .L1";
+  ASSERT_EQ(sys.memory.code[4].opcode, OP_CALL);
+  ASSERT_EQ(sys.memory.code[4].target, -1)
+      << "Undefined label should decode to target -1";
+  ASSERT_EQ(sys.memory.code[5].opcode, OP_END);
+}
+
+TEST(ProjectTests, test_execute_loop) {
+  System sys;
+  initialize_system(&sys);
+
+  sys.memory.num_instructions = 7;
+  sys.memory.instruction[0] = strdup("MOVL $0 %EAX");   // address 0
+  sys.memory.instruction[1] = strdup(".LOOP");          // address 4
+  sys.memory.instruction[2] = strdup("ADDL %EDX %EAX");  // address 8
+  sys.memory.instruction[3] = strdup("ADDL $1 %ECX");   // address 12
+  sys.memory.instruction[4] = strdup("CMPL $10 %ECX");  // address 16
+  sys.memory.instruction[5] = strdup("JL .LOOP");       // address 20
+  sys.memory.instruction[6] = strdup("END");            // address 24
+
+  sys.registers[EDX] = 3;
+  sys.registers[ECX] = 0;
+  execute_instructions(&sys);
+
+  ASSERT_EQ(sys.registers[EAX], 30)
+      << "EAX should be 30 and yours is " << sys.registers[EAX] << ".";
+  ASSERT_EQ(sys.registers[ECX], 10)
+      << "ECX should be 10 and yours is " << sys.registers[ECX] << ".";
+  ASSERT_EQ(sys.registers[EIP], 24)
+      << "EIP should be 24 when reaching END instruction and yours is "
+      << sys.registers[EIP] << ".";
+}
+
+TEST(ProjectTests, test_undefined_label_from_file) {
+  System sys;
+  initialize_system(&sys);
+
+  int undefined = load_instructions_from_file(&sys, "test/undefined_label.txt");
+  ASSERT_EQ(undefined, 2)
+      << "JE .L2 and CALL .MISSING should be reported as undefined labels";
+  ASSERT_EQ(get_addr_from_label(&sys, ".L1"), 8)
+      << "Label .L1 should resolve to address 8";
+  ASSERT_EQ(sys.memory.code[4].target, 8)
+      << "JMP .L1 should be resolved to address 8 at load time";
+}
+
+TEST(ProjectTests, test_engines_match_switch) {
+  System loaded, sys;
+  initialize_system(&loaded);
+  load_instructions_from_file(&loaded, "bench/loop.txt");
+  loaded.registers[ECX] = 2000;
+
+  System expected;
+  ASSERT_EQ(copy_system(&expected, &loaded), 0);
+  execute_with_engine(&expected, ENGINE_SWITCH);
+
+  for (int engine = ENGINE_THREADED; engine <= ENGINE_LOCKSTEP; engine++) {
+    ASSERT_EQ(copy_system(&sys, &loaded), 0);
+    execute_with_engine(&sys, (Engine)engine);
+    for (int reg = EAX; reg <= EIP; reg++) {
+      ASSERT_EQ(sys.registers[reg], expected.registers[reg])
+          << "Register " << reg << " differs with engine " << engine << ".";
+    }
+    ASSERT_EQ(sys.comparison_flag, expected.comparison_flag);
+    ASSERT_EQ(memcmp(sys.memory.data, expected.memory.data,
+                     sys.memory.size * sizeof(int)), 0)
+        << "Data memory differs with engine " << engine << ".";
+    destroy_system(&sys);
+  }
+  destroy_system(&expected);
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_jit_memory_error) {
+  System loaded, sys;
+  initialize_system(&loaded);
+
+  // Pushes until the stack runs out, long after the loop has been compiled
+  loaded.memory.num_instructions = 6;
+  loaded.memory.instruction[0] = strdup(".LOOP");         // address 0
+  loaded.memory.instruction[1] = strdup("ADDL $1 %EAX");  // address 4
+  loaded.memory.instruction[2] = strdup("PUSHL %EAX");    // address 8
+  loaded.memory.instruction[3] = strdup("CMPL $0 %EAX");  // address 12
+  loaded.memory.instruction[4] = strdup("JG .LOOP");      // address 16
+  loaded.memory.instruction[5] = strdup("END");           // address 20
+  decode_instructions(&loaded);
+
+  System expected;
+  ASSERT_EQ(copy_system(&expected, &loaded), 0);
+  execute_instructions(&expected);
+  ASSERT_EQ(expected.registers[EIP], 8)
+      << "The interpreter should stop at PUSHL with a MEMORY_ERROR.";
+
+  ASSERT_EQ(copy_system(&sys, &loaded), 0);
+  execute_instructions_jit(&sys);
+  for (int reg = EAX; reg <= EIP; reg++) {
+    ASSERT_EQ(sys.registers[reg], expected.registers[reg])
+        << "Register " << reg << " differs after the MEMORY_ERROR.";
+  }
+  ASSERT_EQ(memcmp(sys.memory.data, expected.memory.data,
+                   sys.memory.size * sizeof(int)), 0)
+      << "Data memory differs after the MEMORY_ERROR.";
+  destroy_system(&sys);
+  destroy_system(&expected);
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_jit_kept_across_runs) {
+  System loaded, sys;
+  initialize_system(&loaded);
+  loaded.memory.num_instructions = 5;
+  loaded.memory.instruction[0] = strdup(".LOOP");            // address 0
+  loaded.memory.instruction[1] = strdup("ADDL $1 %EAX");     // address 4
+  loaded.memory.instruction[2] = strdup("CMPL $1000 %EAX");  // address 8
+  loaded.memory.instruction[3] = strdup("JL .LOOP");         // address 12
+  loaded.memory.instruction[4] = strdup("END");              // address 16
+  decode_instructions(&loaded);
+
+  // The second run goes on with the blocks compiled by the first
+  for (int run = 0; run < 2; run++) {
+    ASSERT_EQ(copy_system(&sys, &loaded), 0);
+    execute_instructions_jit(&sys);
+    ASSERT_EQ(sys.registers[EAX], 1000) << "Run " << run << " differs.";
+    ASSERT_EQ(sys.registers[EIP], 16);
+    destroy_system(&sys);
+  }
+
+  // Decoding the image again must not run the blocks of its old lines
+  free(loaded.memory.instruction[1]);
+  loaded.memory.instruction[1] = strdup("ADDL $3 %EAX");
+  decode_instructions(&loaded);
+  ASSERT_EQ(copy_system(&sys, &loaded), 0);
+  execute_instructions_jit(&sys);
+  ASSERT_EQ(sys.registers[EAX], 1002)
+      << "The JIT should compile the lines decoded again.";
+  destroy_system(&sys);
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_aot_cache) {
+  char dir[] = "/tmp/assembly_aot_testXXXXXX";
+  ASSERT_NE(mkdtemp(dir), nullptr);
+  setenv("ASSEMBLY_AOT_CACHE", dir, 1);
+
+  System sys;
+  initialize_system(&sys);
+  load_instructions_from_file(&sys, "test/movl_register.txt");
+
+  AotProgram first = compile_program_aot(&sys);
+  ASSERT_NE(first, nullptr) << "Program should compile with the system cc.";
+  AotProgram second = compile_program_aot(&sys);
+  ASSERT_EQ(first, second) << "The cached program should be reused.";
+
+  sys.registers[EAX] = 5;
+  sys.registers[EDX] = 3;
+  sys.registers[ECX] = 2;
+  execute_compiled(&sys, first);
+  ASSERT_EQ(sys.registers[EAX], 3);
+  ASSERT_EQ(sys.registers[EDX], 2);
+  ASSERT_EQ(sys.registers[ECX], 3);
+  ASSERT_EQ(sys.registers[EIP], 12);
+
+  // A shared object compiled from another text, as if their hashes
+  // collided, is compiled over instead of being run
+  std::string pattern = std::string(dir) + "/*.so";
+  glob_t found;
+  ASSERT_EQ(glob(pattern.c_str(), 0, NULL, &found), 0);
+  ASSERT_EQ(found.gl_pathc, 1u);
+  std::string compiled = found.gl_pathv[0];
+  globfree(&found);
+  System other;
+  initialize_system(&other);
+  const char text[] = "MOVL $7 %EAX\nEND\n";
+  Program *program = load_program_text(text, strlen(text));
+  ASSERT_NE(program, nullptr);
+  attach_program(&other, program);
+  release_program(program);
+  ASSERT_NE(compile_program_aot(&other), nullptr);
+  ASSERT_EQ(glob(pattern.c_str(), 0, NULL, &found), 0);
+  ASSERT_EQ(found.gl_pathc, 2u);
+  std::string other_library = found.gl_pathv[0] == compiled
+                                  ? found.gl_pathv[1]
+                                  : found.gl_pathv[0];
+  globfree(&found);
+  std::string copy =
+      "cp " + compiled + " " + dir + "/copy && mv " + dir + "/copy " +
+      other_library;
+  ASSERT_EQ(system(copy.c_str()), 0);
+  AotProgram recompiled = compile_program_aot(&other);
+  ASSERT_NE(recompiled, nullptr);
+  ASSERT_NE(recompiled, first) << "Another program's code should not run.";
+  execute_compiled(&other, recompiled);
+  ASSERT_EQ(other.registers[EAX], 7);
+  destroy_system(&other);
+
+  // A cache that others can write to is not used
+  ASSERT_EQ(chmod(dir, 0777), 0);
+  ASSERT_EQ(compile_program_aot(&sys), nullptr);
+  ASSERT_EQ(chmod(dir, 0700), 0);
+  unsetenv("ASSEMBLY_AOT_CACHE");
+  destroy_system(&sys);
+
+  std::string remove = std::string("rm -rf ") + dir;
+  ASSERT_EQ(system(remove.c_str()), 0);
+}
+
+TEST(ProjectTests, test_fused_counting_loop) {
+  System sys;
+  initialize_system(&sys);
+
+  sys.memory.num_instructions = 8;
+  sys.memory.instruction[0] = strdup(".LOOP");          // address 0
+  sys.memory.instruction[1] = strdup("PUSHL %ECX");     // address 4
+  sys.memory.instruction[2] = strdup("POPL %EAX");      // address 8
+  sys.memory.instruction[3] = strdup("ADDL $1 %ECX");   // address 12
+  sys.memory.instruction[4] = strdup("CMPL $10 %ECX");  // address 16
+  sys.memory.instruction[5] = strdup("JL .LOOP");       // address 20
+  sys.memory.instruction[6] = strdup("CMPL %EAX %ECX");  // address 24
+  sys.memory.instruction[7] = strdup("JE .LOOP");       // address 28
+  decode_instructions(&sys);
+
+  ASSERT_EQ(sys.memory.code[1].fusion, FUSION_PUSH_POP);
+  ASSERT_EQ(sys.memory.code[3].fusion, FUSION_ADDL_CMPL_JCC);
+  ASSERT_EQ(sys.memory.code[4].fusion, FUSION_CMPL_JCC)
+      << "Jumping to the CMPL should still run a fused CMPL+JL.";
+  ASSERT_EQ(sys.memory.code[6].fusion, FUSION_CMPL_JCC);
+
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EAX], 9)
+      << "EAX should be 9 and yours is " << sys.registers[EAX] << ".";
+  ASSERT_EQ(sys.registers[ECX], 10)
+      << "ECX should be 10 and yours is " << sys.registers[ECX] << ".";
+  ASSERT_EQ(sys.registers[EIP], 32);
+  ASSERT_EQ(sys.memory.data[(MEMORY_SIZE - 256) / 4 - 1], 9)
+      << "The fused PUSHL should still write the stack slot.";
+  ASSERT_EQ(sys.fusion_hits[FUSION_PUSH_POP], 10);
+  ASSERT_EQ(sys.fusion_hits[FUSION_ADDL_CMPL_JCC], 10);
+  ASSERT_EQ(sys.fusion_hits[FUSION_CMPL_JCC], 1);
+}
+
+TEST(ProjectTests, test_batch_matches_sequential) {
+  System loaded, sys;
+  initialize_system(&loaded);
+  load_instructions_from_file(&loaded, "bench/loop.txt");
+
+  const int count = 200;
+  BatchInput inputs[count];
+  BatchResult results[count];
+  for (int i = 0; i < count; i++) {
+    inputs[i].eax = i;
+    inputs[i].edx = -i;
+    inputs[i].ecx = (i * 37) % 500;  // uneven run lengths
+  }
+
+  ASSERT_EQ(copy_system(&sys, &loaded), 0);
+  for (int engine = ENGINE_SWITCH; engine <= ENGINE_LOCKSTEP; engine++) {
+    memset(results, 0, sizeof(results));
+    ASSERT_EQ(run_batch(&loaded, inputs, results, count, 4, (Engine)engine), 0);
+    for (int i = 0; i < count; i++) {
+      reset_system(&sys);
+      sys.registers[EAX] = inputs[i].eax;
+      sys.registers[EDX] = inputs[i].edx;
+      sys.registers[ECX] = inputs[i].ecx;
+      execute_instructions(&sys);
+      for (int reg = EAX; reg <= EIP; reg++) {
+        ASSERT_EQ(results[i].registers[reg], sys.registers[reg])
+            << "Register " << reg << " of input " << i << " differs with engine "
+            << engine << ".";
+      }
+      ASSERT_EQ(results[i].comparison_flag, sys.comparison_flag);
+    }
+  }
+  destroy_system(&sys);
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_lockstep_lanes) {
+  System loaded;
+  initialize_system(&loaded);
+
+  // Every lane counts ECX down on its own path: the loop, the call and the
+  // stack accesses diverge and join again at different times
+  loaded.memory.num_instructions = 14;
+  loaded.memory.instruction[0] = strdup(".LOOP");            // address 0
+  loaded.memory.instruction[1] = strdup("CMPL $0 %ECX");     // address 4
+  loaded.memory.instruction[2] = strdup("JE .DONE");         // address 8
+  loaded.memory.instruction[3] = strdup("CMPL $3 %ECX");     // address 12
+  loaded.memory.instruction[4] = strdup("JL .SMALL");        // address 16
+  loaded.memory.instruction[5] = strdup("CALL .TWICE");      // address 20
+  loaded.memory.instruction[6] = strdup(".SMALL");           // address 24
+  loaded.memory.instruction[7] = strdup("ADDL $-1 %ECX");    // address 28
+  loaded.memory.instruction[8] = strdup("JMP .LOOP");        // address 32
+  loaded.memory.instruction[9] = strdup(".TWICE");           // address 36
+  loaded.memory.instruction[10] = strdup("ADDL %EAX %EAX");  // address 40
+  loaded.memory.instruction[11] = strdup("MOVL %EAX 8(%EBP)");  // address 44
+  loaded.memory.instruction[12] = strdup("RET");             // address 48
+  loaded.memory.instruction[13] = strdup(".DONE");           // address 52
+  decode_instructions(&loaded);
+
+  const int count = LOCKSTEP_LANES + 3;  // a full group and a partial one
+  System lanes[count], sys;
+  for (int lane = 0; lane < count; lane++) {
+    ASSERT_EQ(copy_system(&lanes[lane], &loaded), 0);
+    lanes[lane].registers[EAX] = lane + 1;
+    lanes[lane].registers[ECX] = lane % 5;
+  }
+  lanes[2].registers[EBP] = MEMORY_SIZE * 4;  // fails with a MEMORY_ERROR
+  execute_instructions_lockstep(lanes, count);
+
+  for (int lane = 0; lane < count; lane++) {
+    ASSERT_EQ(copy_system(&sys, &loaded), 0);
+    sys.registers[EAX] = lane + 1;
+    sys.registers[ECX] = lane % 5;
+    if (lane == 2) sys.registers[EBP] = MEMORY_SIZE * 4;
+    execute_instructions(&sys);
+    for (int reg = EAX; reg <= EIP; reg++) {
+      ASSERT_EQ(lanes[lane].registers[reg], sys.registers[reg])
+          << "Register " << reg << " of lane " << lane << " differs.";
+    }
+    ASSERT_EQ(lanes[lane].comparison_flag, sys.comparison_flag);
+    ASSERT_EQ(memcmp(lanes[lane].memory.data, sys.memory.data,
+                     sys.memory.size * sizeof(int)), 0)
+        << "Data memory of lane " << lane << " differs.";
+    destroy_system(&sys);
+    destroy_system(&lanes[lane]);
+  }
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_sized_memory_and_long_program) {
+  System loaded, sys;
+  ASSERT_EQ(initialize_system_with_size(&loaded, MIN_MEMORY_SIZE - 1), -1);
+  ASSERT_EQ(initialize_system_with_size(&loaded, 1 << 20), 0);
+  ASSERT_EQ(loaded.registers[ESP], (1 << 20) - 256);
+
+  // Longer than the initial instruction segment, storing far past 4 KB
+  char path[] = "/tmp/assembly_long_programXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  FILE *file = fdopen(fd, "w");
+  for (int i = 0; i < 3 * MEMORY_SIZE; i++) fprintf(file, "ADDL $1 %%EAX\n");
+  fprintf(file, "MOVL %%EAX 3000000(%%EBP)\nEND\n");
+  fclose(file);
+  ASSERT_EQ(load_instructions_from_file(&loaded, path), 0);
+  unlink(path);
+  ASSERT_EQ(loaded.memory.num_instructions, 3 * MEMORY_SIZE + 2);
+
+  int slot = ((1 << 20) - 256 + 3000000) / 4;
+  for (int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; engine++) {
+    ASSERT_EQ(copy_system(&sys, &loaded), 0);
+    execute_with_engine(&sys, (Engine)engine);
+    ASSERT_EQ(sys.registers[EAX], 3 * MEMORY_SIZE)
+        << "EAX differs with engine " << engine << ".";
+    ASSERT_EQ(sys.memory.data[slot], 3 * MEMORY_SIZE)
+        << "The store past 4 KB is missing with engine " << engine << ".";
+    ASSERT_EQ(loaded.memory.data[slot], 0)
+        << "A copy should not share data memory with its original.";
+    destroy_system(&sys);
+  }
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_program_image_shared) {
+  ASSERT_EQ(load_program("test/no_such_program.txt"), nullptr);
+  Program *program = load_program("bench/loop.txt");
+  ASSERT_NE(program, nullptr);
+  ASSERT_EQ(program->refcount, 1);
+  ASSERT_EQ(program->num_decoded, program->num_instructions);
+
+  // The lines are packed one after the other inside the image
+  for (int i = 0; i + 1 < program->num_instructions; i++) {
+    ASSERT_EQ(program->instruction[i + 1],
+              program->instruction[i] + strlen(program->instruction[i]) + 1);
+  }
+
+  System a, b;
+  initialize_system(&a);
+  initialize_system(&b);
+  attach_program(&a, program);
+  attach_program(&b, program);
+  release_program(program);
+  ASSERT_EQ(program->refcount, 2);
+  ASSERT_EQ(a.memory.code, b.memory.code);
+
+  a.registers[ECX] = 10;
+  b.registers[ECX] = 20;
+  execute_instructions(&a);
+  destroy_system(&a);
+  ASSERT_EQ(program->refcount, 1);
+  execute_instructions(&b);
+  ASSERT_EQ(b.registers[EAX], 20)
+      << "The image should still be usable by the other system.";
+  destroy_system(&b);
+}
+
+TEST(ProjectTests, test_load_long_lines) {
+  // Lines longer than any line buffer, extra spaces, an empty line and a last
+  // line without a newline
+  std::string label = "." + std::string(300, 'L');
+  std::string source = "  MOVL   $7 %EAX\n\n" + label + "\nADDL $1 %EAX\n"
+                       "MOVL %EAX 4(%EAXAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA)\n"
+                       "CMPL $9 %EAX\nJL " + label + "\nEND";
+  char path[] = "/tmp/assembly_long_linesXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(write(fd, source.data(), source.size()), (ssize_t)source.size());
+  close(fd);
+  Program *program = load_program(path);
+  unlink(path);
+  ASSERT_NE(program, nullptr);
+
+  ASSERT_EQ(program->num_instructions, 7);
+  ASSERT_STREQ(program->instruction[0], "MOVL $7 %EAX");
+  ASSERT_EQ(program->instruction[1], label);
+  ASSERT_STREQ(program->instruction[6], "END");
+  ASSERT_EQ(program->code[3].src.type, REG);
+  ASSERT_EQ(program->code[3].dst.type, UNKNOWN);
+  ASSERT_EQ(program->code[5].target, 8);
+
+  System sys;
+  initialize_system(&sys);
+  attach_program(&sys, program);
+  release_program(program);
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EAX], 8)
+      << "The MOVL to the unknown register should stop the program.";
+  destroy_system(&sys);
+}
+
+TEST(ProjectTests, test_program_file_cache) {
+  char dir[] = "/tmp/assembly_program_cacheXXXXXX";
+  ASSERT_NE(mkdtemp(dir), nullptr);
+  setenv("ASSEMBLY_PROGRAM_CACHE", dir, 1);
+
+  // Parsed the first time, mapped from the cache the second
+  Program *loaded = load_program_cached("bench/loop.txt");
+  ASSERT_NE(loaded, nullptr);
+  ASSERT_EQ(loaded->mapping, nullptr);
+  Program *mapped = load_program_cached("bench/loop.txt");
+  unsetenv("ASSEMBLY_PROGRAM_CACHE");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_NE(mapped->mapping, nullptr);
+
+  ASSERT_EQ(mapped->num_instructions, loaded->num_instructions);
+  ASSERT_EQ(mapped->num_decoded, mapped->num_instructions);
+  ASSERT_TRUE(loaded->optimized) << "Images should be cached optimized.";
+  ASSERT_TRUE(mapped->optimized);
+  ASSERT_EQ(mapped->removed, loaded->removed)
+      << "The optimizer report should survive the cache.";
+  ASSERT_EQ(memcmp(mapped->code, loaded->code,
+                   loaded->num_instructions * sizeof(Instruction)), 0);
+  for (int i = 0; i < loaded->num_instructions; i++) {
+    ASSERT_STREQ(mapped->instruction[i], loaded->instruction[i]);
+  }
+
+  System sys;
+  initialize_system(&sys);
+  attach_program(&sys, mapped);
+  release_program(mapped);
+  // not optimized again, so the mapped pages stay shared with other processes
+  ASSERT_EQ(optimize_instructions(&sys), 0);
+  ASSERT_EQ(memcmp(mapped->code, loaded->code,
+                   loaded->num_instructions * sizeof(Instruction)), 0);
+  ASSERT_EQ(get_addr_from_label(&sys, ".LOOP"), 12);
+  sys.registers[ECX] = 10;
+  execute_with_engine(&sys, ENGINE_JIT);
+  ASSERT_EQ(sys.registers[EAX], 10);
+  destroy_system(&sys);
+
+  // Anything but a program file of this build is turned down
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/loop.prog", dir);
+  ASSERT_EQ(save_program(loaded, path), 0);
+  release_program(loaded);
+  mapped = map_program(path);
+  ASSERT_NE(mapped, nullptr);
+  release_program(mapped);
+  FILE *file = fopen(path, "r+b");
+  fseek(file, -2, SEEK_END);
+  fputc('X', file);
+  fclose(file);
+  ASSERT_EQ(map_program(path), nullptr);
+  ASSERT_EQ(map_program("bench/loop.txt"), nullptr);
+
+  // Records are checked, and safe_size is proven again, even in files whose
+  // hash is right
+  loaded = load_program("bench/loop.txt");
+  Program *forged = load_program("bench/loop.txt");
+  ASSERT_NE(forged, nullptr);
+  for (int i = 0; i < forged->num_instructions; i++) {
+    forged->code[i].safe_size = MIN_MEMORY_SIZE;
+  }
+  ASSERT_EQ(save_program(forged, path), 0);
+  mapped = map_program(path);
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_EQ(memcmp(mapped->code, loaded->code,
+                   loaded->num_instructions * sizeof(Instruction)), 0)
+      << "The stored safe_size should not be trusted.";
+  release_program(mapped);
+  int jump = forged->num_instructions - 2;
+  forged->code[jump].target = 4 * (forged->num_instructions + 8);
+  ASSERT_EQ(save_program(forged, path), 0);
+  ASSERT_EQ(map_program(path), nullptr);
+  forged->code[jump] = loaded->code[jump];
+  forged->code[0].src.reg = (RegisterName)100;
+  ASSERT_EQ(save_program(forged, path), 0);
+  ASSERT_EQ(map_program(path), nullptr);
+  forged->code[0] = loaded->code[0];
+  forged->code[0].opcode = (Opcode)100;
+  ASSERT_EQ(save_program(forged, path), 0);
+  ASSERT_EQ(map_program(path), nullptr);
+  release_program(forged);
+  release_program(loaded);
+
+  // Cached files and directories others can write to are not used
+  glob_t found;
+  std::string pattern = std::string(dir) + "/*.prog";
+  ASSERT_EQ(glob(pattern.c_str(), 0, NULL, &found), 0);
+  std::string cached;
+  for (size_t i = 0; i < found.gl_pathc; i++) {
+    if (strcmp(found.gl_pathv[i], path) != 0) cached = found.gl_pathv[i];
+  }
+  globfree(&found);
+  ASSERT_FALSE(cached.empty());
+  setenv("ASSEMBLY_PROGRAM_CACHE", dir, 1);
+  ASSERT_EQ(chmod(cached.c_str(), 0666), 0);
+  mapped = load_program_cached("bench/loop.txt");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_EQ(mapped->mapping, nullptr);
+  release_program(mapped);
+  ASSERT_EQ(chmod(dir, 0777), 0);
+  mapped = load_program_cached("bench/loop.txt");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_EQ(mapped->mapping, nullptr);
+  release_program(mapped);
+  ASSERT_EQ(chmod(dir, 0700), 0);
+  mapped = load_program_cached("bench/loop.txt");
+  unsetenv("ASSEMBLY_PROGRAM_CACHE");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_NE(mapped->mapping, nullptr)
+      << "The file saved again should be private to the user.";
+  release_program(mapped);
+
+  // Saving a program removes the oldest others once the cache is too large
+  setenv("ASSEMBLY_PROGRAM_CACHE_LIMIT", "1", 1);
+  setenv("ASSEMBLY_PROGRAM_CACHE", dir, 1);
+  mapped = load_program_cached("test/call_graph.txt");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_EQ(mapped->mapping, nullptr);
+  release_program(mapped);
+  mapped = load_program_cached("test/call_graph.txt");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_NE(mapped->mapping, nullptr) << "The newest file should be kept.";
+  release_program(mapped);
+  mapped = load_program_cached("bench/loop.txt");
+  unsetenv("ASSEMBLY_PROGRAM_CACHE");
+  unsetenv("ASSEMBLY_PROGRAM_CACHE_LIMIT");
+  ASSERT_NE(mapped, nullptr);
+  ASSERT_EQ(mapped->mapping, nullptr) << "The oldest file should be removed.";
+  release_program(mapped);
+
+  std::string remove = std::string("rm -rf ") + dir;
+  ASSERT_EQ(system(remove.c_str()), 0);
+}
+
+TEST(ProjectTests, test_profile_counts) {
+  System sys, plain;
+  initialize_system(&sys);
+  ASSERT_EQ(load_instructions_from_file(&sys, "bench/loop.txt"), 0);
+  ASSERT_EQ(copy_system(&plain, &sys), 0);
+  sys.registers[ECX] = plain.registers[ECX] = 10;
+
+  Profile *profile = create_profile(&sys);
+  ASSERT_NE(profile, nullptr);
+  execute_instructions_profiled(&sys, profile);
+  execute_instructions(&plain);
+  ASSERT_EQ(memcmp(sys.registers, plain.registers, sizeof(sys.registers)), 0)
+      << "Profiling should not change what the program does.";
+
+  // JL .LOOP, the last jump, loops back 9 times and falls through once
+  int loop_jump = sys.memory.num_instructions - 2;
+  ASSERT_EQ(sys.memory.code[loop_jump].opcode, OP_JL);
+  ASSERT_EQ(profile->executions[loop_jump], 10);
+  ASSERT_EQ(profile->taken[loop_jump], 9);
+  ASSERT_EQ(profile->opcode_executions[OP_ADDL], 20);
+
+  long long executions = 0;
+  for (int i = 0; i < profile->num_instructions; i++) {
+    executions += profile->executions[i];
+  }
+  long long by_opcode = 0;
+  for (int op = OP_NOP; op <= OP_END; op++) {
+    by_opcode += profile->opcode_executions[op];
+  }
+  ASSERT_EQ(executions, by_opcode);
+
+  char *report;
+  size_t size;
+  FILE *out = open_memstream(&report, &size);
+  print_profile(&sys, profile, out);
+  fclose(out);
+  ASSERT_NE(strstr(report, "JL .LOOP"), nullptr);
+  free(report);
+  destroy_profile(profile);
+  destroy_system(&sys);
+  destroy_system(&plain);
+}
+
+TEST(ProjectTests, test_folded_call_stacks) {
+  System sys;
+  ASSERT_EQ(initialize_system_with_size(&sys, 4096), 0);
+  ASSERT_EQ(load_instructions_from_file(&sys, "test/call_graph.txt"), 0);
+  Profile *profile = create_profile(&sys);
+  ASSERT_NE(profile, nullptr);
+  execute_instructions_profiled(&sys, profile);
+  ASSERT_EQ(profile->depth, 0) << "Every call should have returned.";
+
+  char *folded;
+  size_t size;
+  FILE *out = open_memstream(&folded, &size);
+  print_folded_stacks(&sys, profile, out);
+  fclose(out);
+  ASSERT_STREQ(folded,
+               "program 4\n"
+               "program;.DOWN 7\n"
+               "program;.DOWN;.LEAF 2\n"
+               "program;.DOWN;.DOWN 7\n"
+               "program;.DOWN;.DOWN;.LEAF 2\n"
+               "program;.DOWN;.DOWN;.DOWN 7\n"
+               "program;.DOWN;.DOWN;.DOWN;.LEAF 2\n"
+               "program;.DOWN;.DOWN;.DOWN;.DOWN 3\n"
+               "program;.LEAF 2\n");
+  free(folded);
+  destroy_profile(profile);
+  destroy_system(&sys);
+
+  // Optimized images name the labels called as well, even when the function
+  // starts with a no-op
+  const char text[] = "JMP .MAIN\n.F\nMOVL %EAX %EAX\nADDL $1 %EAX\nRET\n"
+                      ".MAIN\nCALL .F\nEND\n";
+  Program *program = load_program_text(text, strlen(text));
+  ASSERT_NE(program, nullptr);
+  ASSERT_EQ(initialize_system_with_size(&sys, 4096), 0);
+  attach_program(&sys, program);
+  release_program(program);
+  ASSERT_GT(optimize_instructions(&sys), 0);
+  profile = create_profile(&sys);
+  ASSERT_NE(profile, nullptr);
+  execute_instructions_profiled(&sys, profile);
+  out = open_memstream(&folded, &size);
+  print_folded_stacks(&sys, profile, out);
+  fclose(out);
+  ASSERT_STREQ(folded, "program 2\nprogram;.F 3\n");
+  free(folded);
+  destroy_profile(profile);
+  destroy_system(&sys);
+}
+
+TEST(ProjectTests, test_snapshot_restore) {
+  // Larger than what reset_system clears in place
+  System sys, other;
+  ASSERT_EQ(initialize_system_with_size(&sys, 1 << 16), 0);
+  ASSERT_EQ(load_instructions_from_file(&sys, "bench/loop.txt"), 0);
+  sys.registers[ECX] = 10;
+  execute_instructions(&sys);
+  int slot = sys.registers[EBP] / 4 - 1;  // -4(%EBP), written by the loop
+  int saved = sys.memory.data[slot];
+  ASSERT_NE(saved, 0);
+
+  Snapshot *snapshot = take_snapshot(&sys);
+  ASSERT_NE(snapshot, nullptr);
+
+  // Variants branch off the snapshot without changing it
+  for (int variant = 0; variant < 3; variant++) {
+    ASSERT_EQ(restore_snapshot(&sys, snapshot), 0);
+    ASSERT_EQ(sys.registers[EAX], 10);
+    ASSERT_EQ(sys.memory.data[slot], saved);
+    sys.memory.data[slot] = variant;
+    sys.memory.data[0] = variant;
+  }
+  ASSERT_EQ(restore_snapshot(&sys, snapshot), 0);
+  ASSERT_EQ(sys.memory.data[slot], saved);
+  ASSERT_EQ(sys.memory.data[0], 0);
+
+  // Other systems start from it too, sharing the program
+  initialize_system(&other);
+  ASSERT_EQ(restore_snapshot(&other, snapshot), 0);
+  ASSERT_EQ(other.memory.size, 1 << 16);
+  ASSERT_EQ(other.memory.code, sys.memory.code);
+  ASSERT_EQ(other.memory.data[slot], saved);
+  release_snapshot(snapshot);
+  ASSERT_EQ(other.memory.data[slot], saved)
+      << "Restored systems keep their data after the snapshot is released.";
+
+  reset_system(&other);
+  ASSERT_EQ(other.memory.data[slot], 0)
+      << "Resetting should clear the data that came from the snapshot.";
+  destroy_system(&sys);
+  destroy_system(&other);
+}
+
+TEST(ProjectTests, test_reset_dirty_lines) {
+  const char *programs[] = {"bench/loop.txt", "test/call_graph.txt"};
+  for (const char *program : programs) {
+    for (int engine = ENGINE_SWITCH; engine <= ENGINE_LOCKSTEP; engine++) {
+      System sys;
+      ASSERT_EQ(initialize_system_with_size(&sys, 1 << 16), 0);
+      ASSERT_EQ(load_instructions_from_file(&sys, program), 0);
+      int registers[6];
+      for (int run = 0; run < 2; run++) {
+        sys.registers[ECX] = 100;
+        execute_with_engine(&sys, (Engine)engine);
+        if (run == 0) memcpy(registers, sys.registers, sizeof(registers));
+        ASSERT_EQ(memcmp(registers, sys.registers, sizeof(registers)), 0)
+            << program << " runs differently after a reset with engine "
+            << engine << ".";
+
+        int lines = 0;
+        for (int word = 0; word < sys.memory.size; word++) {
+          int line = word * 4 >> DIRTY_LINE_SHIFT;
+          if (sys.memory.data[word] != 0) {
+            ASSERT_TRUE(sys.memory.dirty[line])
+                << "Word " << word << " of " << program
+                << " was written without flagging its line, engine "
+                << engine << ".";
+          }
+          int first_word = word % ((1 << DIRTY_LINE_SHIFT) / 4) == 0;
+          if (first_word && sys.memory.dirty[line]) lines++;
+        }
+        ASSERT_GT(lines, 0);
+        ASSERT_LT(lines, 8) << "Only the lines near the stack are written.";
+
+        reset_system_dirty(&sys);
+        ASSERT_EQ(sys.registers[ESP], sys.memory.size - 256);
+        for (int word = 0; word < sys.memory.size; word++) {
+          ASSERT_EQ(sys.memory.data[word], 0);
+          ASSERT_EQ(sys.memory.dirty[word * 4 >> DIRTY_LINE_SHIFT], 0);
+        }
+      }
+      destroy_system(&sys);
+    }
+  }
+}
+
+TEST(ProjectTests, test_verified_bounds_checks) {
+  System sys;
+  initialize_system(&sys);
+  ASSERT_EQ(load_instructions_from_file(&sys, "test/array_loop.txt"), 0);
+  const Instruction *code = sys.memory.code;
+  ASSERT_LE(code[2].safe_size, MEMORY_SIZE) << "Stores below the loop bound.";
+  ASSERT_LE(code[3].safe_size, MEMORY_SIZE) << "PUSHL at the initial ESP.";
+  ASSERT_LE(code[4].safe_size, MEMORY_SIZE);
+  ASSERT_EQ(code[9].safe_size, 501) << "Address 2000 needs 501 words.";
+  ASSERT_EQ(code[10].safe_size, INT_MAX) << "ECX can hold anything.";
+  ASSERT_EQ(code[5].safe_size, INT_MAX) << "No memory operand.";
+
+  for (int engine = ENGINE_SWITCH; engine <= ENGINE_THREADED; engine++) {
+    reset_system(&sys);
+    execute_with_engine(&sys, (Engine)engine);
+    ASSERT_EQ(sys.registers[EIP], 44);
+    for (int i = 1; i < 100; i++) ASSERT_EQ(sys.memory.data[i], 4 * i);
+    ASSERT_EQ(sys.memory.data[500], 400);
+    ASSERT_EQ(sys.memory.data[0], 400) << "Stored through ECX = 0.";
+  }
+
+  // The store to 2000 is not proven for a smaller memory, and still fails
+  System small;
+  ASSERT_EQ(initialize_system_with_size(&small, 264), 0);
+  ASSERT_EQ(load_instructions_from_file(&small, "test/array_loop.txt"), 0);
+  for (int engine = ENGINE_SWITCH; engine <= ENGINE_THREADED; engine++) {
+    reset_system(&small);
+    execute_with_engine(&small, (Engine)engine);
+    ASSERT_EQ(small.registers[EIP], 36);
+    ASSERT_EQ(small.registers[EAX], 400);
+    ASSERT_EQ(small.memory.data[99], 396);
+  }
+
+  // Nor does anything hold for a run that does not start where the verifier
+  // assumes: pushing from ESP = 0 has to fail
+  reset_system(&sys);
+  sys.registers[ESP] = 0;
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EIP], 12);
+  ASSERT_EQ(sys.registers[ESP], 0);
+  destroy_system(&small);
+  destroy_system(&sys);
+
+  // A write to EIP can leave it unaligned, and addresses based on it with it
+  System loaded;
+  initialize_system(&loaded);
+  loaded.memory.num_instructions = 3;
+  loaded.memory.instruction[0] = strdup("MOVL $1 %EIP");
+  loaded.memory.instruction[1] = strdup("MOVL 0(%EIP) %EAX");
+  loaded.memory.instruction[2] = strdup("END");
+  decode_instructions(&loaded);
+  ASSERT_EQ(loaded.memory.code[1].safe_size, INT_MAX);
+  for (int run = 0; run < 4; run++) {
+    ASSERT_EQ(copy_system(&sys, &loaded), 0);
+    if (run == 2) {
+      ASSERT_EQ(guard_data_memory(&sys), 0);
+    }
+    if (run == 3) optimize_instructions(&sys);
+    sys.registers[EAX] = 5;
+    execute_with_engine(&sys, run == 1 ? ENGINE_THREADED : ENGINE_SWITCH);
+    ASSERT_EQ(sys.registers[EIP], 5) << "MEMORY_ERROR in run " << run << ".";
+    ASSERT_EQ(sys.registers[EAX], 5);
+    destroy_system(&sys);
+  }
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_guarded_memory) {
+  System loaded;
+  initialize_system(&loaded);
+
+  // Stores down through memory until the address goes below 0, then pops up
+  // through it until ESP goes past the end
+  loaded.memory.num_instructions = 8;
+  loaded.memory.instruction[0] = strdup(".DOWN");             // address 0
+  loaded.memory.instruction[1] = strdup("ADDL $-4 %ECX");     // address 4
+  loaded.memory.instruction[2] = strdup("MOVL %ECX 0(%ECX)"); // address 8
+  loaded.memory.instruction[3] = strdup("JMP .DOWN");         // address 12
+  loaded.memory.instruction[4] = strdup(".UP");               // address 16
+  loaded.memory.instruction[5] = strdup("POPL %EAX");         // address 20
+  loaded.memory.instruction[6] = strdup("JMP .UP");           // address 24
+  loaded.memory.instruction[7] = strdup("END");               // address 28
+  decode_instructions(&loaded);
+
+  System expected, sys;
+  ASSERT_EQ(copy_system(&expected, &loaded), 0);
+  ASSERT_EQ(copy_system(&sys, &loaded), 0);
+  ASSERT_EQ(guard_data_memory(&sys), 0);
+  ASSERT_NE(sys.memory.guard, nullptr);
+
+  // EIP, ECX and ESP to start from
+  int starts[][3] = {
+      {0, 4000, 768}, {0, 4001, 768}, {16, 0, 768}, {16, 0, 770}};
+  for (auto &start : starts) {
+    for (System *s : {&expected, &sys}) {
+      reset_system(s);
+      s->registers[EIP] = start[0];
+      s->registers[ECX] = start[1];
+      s->registers[ESP] = start[2];
+      s->registers[EAX] = 7;
+      execute_instructions(s);
+    }
+    for (int reg = EAX; reg <= EIP; reg++) {
+      ASSERT_EQ(sys.registers[reg], expected.registers[reg])
+          << "Register " << reg << " differs after the MEMORY_ERROR, from "
+          << start[0] << ".";
+    }
+    ASSERT_EQ(memcmp(sys.memory.data, expected.memory.data,
+                     sys.memory.size * sizeof(int)), 0)
+        << "Data memory differs after the MEMORY_ERROR.";
+  }
+  ASSERT_EQ(sys.registers[EIP], 20) << "Stops at POPL from a misaligned ESP.";
+
+  reset_system(&sys);
+  sys.registers[ECX] = 4000;
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EIP], 8);
+  ASSERT_EQ(sys.registers[ECX], -4) << "The store below 0 faults.";
+  ASSERT_EQ(sys.memory.data[999], 3996);
+  reset_system(&sys);
+  sys.registers[EIP] = 16;
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[ESP], 4096) << "The pop past the end faults.";
+
+  // Copies are guarded too; memory that is not a whole number of pages cannot
+  // be, and keeps its checks
+  System copy, small;
+  ASSERT_EQ(copy_system(&copy, &sys), 0);
+  ASSERT_NE(copy.memory.guard, nullptr);
+  ASSERT_EQ(initialize_system_with_size(&small, 300), 0);
+  ASSERT_EQ(guard_data_memory(&small), -1);
+  ASSERT_EQ(small.memory.guard, nullptr);
+  destroy_system(&small);
+  destroy_system(&copy);
+  destroy_system(&sys);
+  destroy_system(&expected);
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_optimize_instructions) {
+  const char *lines[] = {
+      "MOVL $1 %EAX",      // address 0, folds the ADDLs up to CMPL
+      "ADDL $2 %EAX",      // address 4
+      ".MID",              // address 8
+      "ADDL $3 %EAX",      // address 12
+      "MOVL %EDX %EDX",    // address 16, no-op
+      "JMP .NEXT",         // address 20, jumps to the next instruction
+      ".NEXT",             // address 24
+      "CMPL $6 %EAX",      // address 28
+      "JE .HOP",           // address 32, threaded through JMP .DONE
+      "ADDL $100 %ECX",    // address 36
+      ".HOP",              // address 40
+      "JMP .DONE",         // address 44
+      "ADDL $1000 %ECX",   // address 48
+      ".DONE",             // address 52
+      "ADDL $0 %ECX",      // address 56, no-op
+      "END"};              // address 60
+  int num = sizeof(lines) / sizeof(lines[0]);
+  System sys, expected;
+  initialize_system(&sys);
+  initialize_system(&expected);
+  for (System *s : {&sys, &expected}) {
+    s->memory.num_instructions = num;
+    for (int i = 0; i < num; i++) s->memory.instruction[i] = strdup(lines[i]);
+    decode_instructions(s);
+  }
+
+  ASSERT_EQ(optimize_instructions(&sys), 5)
+      << "Two no-ops, a jump to the next instruction and two folded ADDLs.";
+  ASSERT_EQ(sys.memory.program->removed, 5);
+  const Instruction *code = sys.memory.code;
+  ASSERT_EQ(code[0].fusion, FUSION_CONST_FOLD);
+  ASSERT_EQ(code[0].folded, 6);
+  ASSERT_EQ(code[0].target, 6);
+  ASSERT_EQ(code[3].fusion, FUSION_CONST_FOLD)
+      << "Jumping into the middle of the fold still runs the rest of it.";
+  ASSERT_EQ(code[4].opcode, OP_NOP);
+  ASSERT_EQ(code[5].opcode, OP_NOP);
+  ASSERT_EQ(code[14].opcode, OP_NOP);
+  ASSERT_EQ(code[8].target, 60) << "JE .HOP should go straight to END.";
+  ASSERT_EQ(code[11].target, 60);
+
+  // Same registers and memory from anywhere in the program, with the
+  // comparison going either way
+  int starts[][2] = {{0, 0}, {4, 0}, {12, 5}, {16, 0}, {36, 0}, {44, 0}};
+  for (auto &start : starts) {
+    for (System *s : {&sys, &expected}) {
+      reset_system(s);
+      s->registers[EIP] = start[0];
+      s->registers[EAX] = start[1];
+      s->registers[EDX] = 7;
+      execute_instructions(s);
+    }
+    for (int reg = EAX; reg <= EIP; reg++) {
+      ASSERT_EQ(sys.registers[reg], expected.registers[reg])
+          << "Register " << reg << " differs when starting at " << start[0]
+          << ".";
+    }
+    ASSERT_EQ(sys.comparison_flag, expected.comparison_flag);
+  }
+  reset_system(&sys);
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EAX], 6);
+  ASSERT_EQ(sys.registers[EIP], 60);
+  ASSERT_EQ(sys.fusion_hits[FUSION_CONST_FOLD], 1);
+  destroy_system(&expected);
+  destroy_system(&sys);
+
+  // A jump that is never taken is a no-op, unless its label is undefined
+  const char never[] = ".TOP\nJGE .TOP\nJGE .MISSING\nEND\n";
+  Program *program = load_program_text(never, strlen(never));
+  ASSERT_NE(program, nullptr);
+  initialize_system(&sys);
+  attach_program(&sys, program);
+  release_program(program);
+  ASSERT_EQ(optimize_instructions(&sys), 1);
+  ASSERT_EQ(sys.memory.code[1].opcode, OP_NOP);
+  ASSERT_EQ(sys.memory.code[2].opcode, OP_JNEVER);
+  destroy_system(&sys);
+}
+
+TEST(ProjectTests, test_run_for_budget) {
+  System loaded, sys, expected;
+  initialize_system(&loaded);
+  load_instructions_from_file(&loaded, "bench/loop.txt");
+  loaded.registers[ECX] = 2000;
+  ASSERT_EQ(copy_system(&expected, &loaded), 0);
+  execute_instructions(&expected);
+
+  // Slices of 100 instructions end up where one run does
+  ASSERT_EQ(copy_system(&sys, &loaded), 0);
+  int slices = 1;
+  RunStatus status;
+  while ((status = run_for(&sys, 100)) == RUN_BUDGET) {
+    ASSERT_EQ(sys.pause.verified, MEMORY_SIZE)
+        << "The slices should go on without the proven bounds checks.";
+    slices++;
+  }
+  ASSERT_EQ(status, RUN_FINISHED);
+  ASSERT_GT(slices, 100);
+  for (int reg = EAX; reg <= EIP; reg++) {
+    ASSERT_EQ(sys.registers[reg], expected.registers[reg])
+        << "Register " << reg << " differs after " << slices << " slices.";
+  }
+  ASSERT_EQ(sys.comparison_flag, expected.comparison_flag);
+  ASSERT_EQ(memcmp(sys.memory.data, expected.memory.data,
+                   sys.memory.size * sizeof(int)), 0);
+  destroy_system(&sys);
+  destroy_system(&expected);
+  destroy_system(&loaded);
+
+  // An endless loop comes back once its budget is used up, at the jump
+  initialize_system(&sys);
+  sys.memory.num_instructions = 3;
+  sys.memory.instruction[0] = strdup(".LOOP");         // address 0
+  sys.memory.instruction[1] = strdup("ADDL $1 %EAX");  // address 4
+  sys.memory.instruction[2] = strdup("JMP .LOOP");     // address 8
+  ASSERT_EQ(run_for(&sys, 1000), RUN_BUDGET);
+  ASSERT_EQ(sys.registers[EAX], 500) << "The label counts once.";
+  ASSERT_EQ(sys.registers[EIP], 4);
+  ASSERT_EQ(run_for(&sys, 1000), RUN_BUDGET);
+  ASSERT_EQ(sys.registers[EAX], 1000);
+  destroy_system(&sys);
+
+  // and a failing instruction stops it for good
+  ASSERT_EQ(initialize_system_with_size(&sys, 264), 0);
+  ASSERT_EQ(load_instructions_from_file(&sys, "test/array_loop.txt"), 0);
+  while ((status = run_for(&sys, 10)) == RUN_BUDGET) {
+  }
+  ASSERT_EQ(status, RUN_ERROR);
+  ASSERT_EQ(sys.registers[EIP], 36);
+  destroy_system(&sys);
+}
+
+TEST(ProjectTests, test_scheduler) {
+  System loaded;
+  initialize_system(&loaded);
+  ASSERT_EQ(load_instructions_from_file(&loaded, "bench/loop.txt"), 0);
+
+  // Guests with different inputs take turns, and each ends up where a run of
+  // its own does
+  const int num_guests = 200;
+  System *guests = new System[num_guests];
+  RunStatus *statuses = new RunStatus[num_guests];
+  Scheduler *scheduler = create_scheduler(50);
+  ASSERT_NE(scheduler, nullptr);
+  for (int i = 0; i < num_guests; i++) {
+    ASSERT_EQ(copy_system(&guests[i], &loaded), 0);
+    guests[i].registers[ECX] = 7 * i;
+    ASSERT_EQ(spawn_guest(scheduler, &guests[i], &statuses[i]), 0);
+  }
+  ASSERT_EQ(count_guests(scheduler), num_guests);
+  ASSERT_GT(run_scheduler(scheduler), num_guests);
+  ASSERT_EQ(count_guests(scheduler), 0);
+  for (int i = 0; i < num_guests; i++) {
+    System expected;
+    ASSERT_EQ(copy_system(&expected, &loaded), 0);
+    expected.registers[ECX] = 7 * i;
+    execute_instructions(&expected);
+    ASSERT_EQ(statuses[i], RUN_FINISHED);
+    for (int reg = EAX; reg <= EIP; reg++) {
+      ASSERT_EQ(guests[i].registers[reg], expected.registers[reg])
+          << "Register " << reg << " of guest " << i << " differs.";
+    }
+    destroy_system(&expected);
+  }
+
+  // An endless guest only takes its turns, and is freed with the scheduler
+  System endless, failing;
+  RunStatus endless_status = RUN_FINISHED, failing_status = RUN_FINISHED;
+  initialize_system(&endless);
+  endless.memory.num_instructions = 2;
+  endless.memory.instruction[0] = strdup(".LOOP");
+  endless.memory.instruction[1] = strdup("JMP .LOOP");
+  ASSERT_EQ(initialize_system_with_size(&failing, 264), 0);
+  ASSERT_EQ(load_instructions_from_file(&failing, "test/array_loop.txt"), 0);
+  ASSERT_EQ(spawn_guest(scheduler, &endless, &endless_status), 0);
+  ASSERT_EQ(spawn_guest(scheduler, &failing, &failing_status), 0);
+  destroy_scheduler(scheduler);
+  ASSERT_EQ(endless_status, RUN_FINISHED) << "The guest never ran.";
+
+  scheduler = create_scheduler(10);
+  ASSERT_EQ(spawn_guest(scheduler, &failing, &failing_status), 0);
+  run_scheduler(scheduler);
+  ASSERT_EQ(failing_status, RUN_ERROR);
+  ASSERT_EQ(failing.registers[EIP], 36);
+  destroy_scheduler(scheduler);
+
+  destroy_system(&endless);
+  destroy_system(&failing);
+  for (int i = 0; i < num_guests; i++) destroy_system(&guests[i]);
+  delete[] guests;
+  delete[] statuses;
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_server) {
+  System loaded;
+  initialize_system(&loaded);
+  ASSERT_EQ(load_instructions_from_file(&loaded, "bench/loop.txt"), 0);
+  optimize_instructions(&loaded);
+  Server *server = create_server(MEMORY_SIZE);
+  ASSERT_NE(server, nullptr);
+  ASSERT_EQ(add_server_program(server, loaded.memory.program), 0);
+
+  // The requests are written up front and answered in one go, in order
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  const char endless[] = ".LOOP\nADDL $1 %EAX\nJMP .LOOP\n";
+  const char undefined[] = "JMP .NOWHERE\n";
+  ServerRequest requests[] = {
+      {0, 0, 1, 5, 3, 2, 0},                              // cached program 0
+      {0, 0, 1, 0, 0, 700, 0},                            // and again
+      {7, 0, 1, 0, 0, 0, 0},                              // unknown id
+      {0, (int)strlen(endless), 1, 0, 0, 0, 1000},        // text, with a budget
+      {0, (int)strlen(undefined), 1, 0, 0, 0, 0},         // rejected text
+      {1, 0, 0, 0, 0, 0, 0},                              // only look it up
+  };
+  const char *texts[] = {NULL, NULL, NULL, endless, undefined, NULL};
+  int count = sizeof(requests) / sizeof(requests[0]);
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(send_server_request(fds[0], &requests[i], texts[i]), 0);
+  }
+  shutdown(fds[0], SHUT_WR);
+  ASSERT_EQ(serve_connection(server, fds[1], fds[1]), 0);
+  close(fds[1]);
+
+  ServerResponse responses[6];
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(read_server_response(fds[0], &responses[i]), 0);
+  }
+  ServerResponse extra;
+  ASSERT_NE(read_server_response(fds[0], &extra), 0);
+  close(fds[0]);
+
+  for (int i = 0; i < 2; i++) {
+    System expected;
+    ASSERT_EQ(copy_system(&expected, &loaded), 0);
+    expected.registers[EAX] = requests[i].eax;
+    expected.registers[EDX] = requests[i].edx;
+    expected.registers[ECX] = requests[i].ecx;
+    execute_instructions(&expected);
+    ASSERT_EQ(responses[i].status, SERVER_OK);
+    ASSERT_EQ(responses[i].program, 0);
+    ASSERT_EQ(responses[i].run_status, RUN_FINISHED);
+    for (int reg = EAX; reg <= EIP; reg++) {
+      ASSERT_EQ(responses[i].registers[reg], expected.registers[reg])
+          << "Register " << reg << " differs for request " << i << ".";
+    }
+    ASSERT_EQ(responses[i].comparison_flag, expected.comparison_flag);
+    destroy_system(&expected);
+  }
+  ASSERT_EQ(responses[2].status, SERVER_UNKNOWN_PROGRAM);
+  ASSERT_EQ(responses[3].status, SERVER_OK);
+  ASSERT_EQ(responses[3].program, 1) << "The text should be cached as 1.";
+  ASSERT_EQ(responses[3].run_status, RUN_BUDGET);
+  ASSERT_EQ(responses[3].registers[EAX], 500);
+  ASSERT_EQ(responses[4].status, SERVER_BAD_PROGRAM);
+  ASSERT_EQ(responses[5].status, SERVER_OK);
+  ASSERT_EQ(responses[5].program, 1);
+  ASSERT_EQ(responses[5].registers[EIP], 0) << "Nothing should have run.";
+
+  // A request that ends in the middle is an error
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ASSERT_EQ(write(fds[0], &requests[0], sizeof(ServerRequest) / 2),
+            (ssize_t)(sizeof(ServerRequest) / 2));
+  shutdown(fds[0], SHUT_WR);
+  ASSERT_EQ(serve_connection(server, fds[1], fds[1]), -1);
+  close(fds[0]);
+  close(fds[1]);
+
+  // Texts sent again keep their ids while they are cached, and only the
+  // programs used last stay cached
+  auto ask = [server](ServerRequest request, const std::string &text) {
+    int pair[2] = {-1, -1};
+    ServerResponse response;
+    memset(&response, 0, sizeof(response));
+    request.text_bytes = (int)text.size();
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0 &&
+        send_server_request(pair[0], &request, text.c_str()) == 0 &&
+        shutdown(pair[0], SHUT_WR) == 0 &&
+        serve_connection(server, pair[1], pair[1]) == 0 &&
+        read_server_response(pair[0], &response) != 0) {
+      response.status = -1;
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return response;
+  };
+  ServerRequest load = {0, 0, 0, 0, 0, 0, 0}, run = {0, 0, 1, 0, 0, 0, 0};
+  int first = ask(load, "MOVL $1 %EAX\nEND\n").program;
+  ASSERT_GT(first, 1);
+  ASSERT_EQ(ask(load, "MOVL $1 %EAX\nEND\n").program, first)
+      << "The text sent again should keep its id.";
+  int last = first;
+  for (int i = 2; i <= SERVER_REGISTRY_PROGRAMS + 1; i++) {
+    last = ask(load, "MOVL $" + std::to_string(i) + " %EAX\nEND\n").program;
+    ASSERT_GT(last, 0);
+  }
+  run.program = first;
+  ASSERT_EQ(ask(run, "").status, SERVER_UNKNOWN_PROGRAM)
+      << "The program used least recently should have been dropped.";
+  run.program = last;
+  ServerResponse response = ask(run, "");
+  ASSERT_EQ(response.status, SERVER_OK);
+  ASSERT_EQ(response.registers[EAX], SERVER_REGISTRY_PROGRAMS + 1);
+  run.program = 0;
+  response = ask(run, "MOVL $1 %EAX\nEND\n");
+  ASSERT_EQ(response.status, SERVER_OK);
+  ASSERT_NE(response.program, first);
+  ASSERT_EQ(response.registers[EAX], 1);
+  run.ecx = 5;
+  response = ask(run, "");
+  ASSERT_EQ(response.status, SERVER_OK) << "Program 0 should stay cached.";
+  ASSERT_EQ(response.registers[EAX], 5);
+
+  destroy_server(server);
+  destroy_system(&loaded);
+}
+
+TEST(ProjectTests, test_program_registry) {
+  Registry *registry = create_registry(2);
+  ASSERT_NE(registry, nullptr);
+  const char *text = "MOVL $0 %EAX\n.LOOP\nADDL $1 %EAX\nCMPL %ECX %EAX\n"
+                     "JL .LOOP\nEND\n";
+  // the same program as the loader sees it: spacing and empty lines differ
+  const char *spaced = "  MOVL  $0 %EAX\n\n.LOOP\n ADDL $1   %EAX\n  \n"
+                       "CMPL %ECX %EAX\nJL .LOOP\nEND";
+  const char *other = "MOVL $1 %EAX\nEND\n";
+
+  int id, same_id, other_id;
+  Program *program =
+      load_program_registered(registry, text, strlen(text), &id);
+  ASSERT_NE(program, nullptr);
+  Program *same =
+      load_program_registered(registry, spaced, strlen(spaced), &same_id);
+  ASSERT_EQ(same, program) << "The image should be shared.";
+  ASSERT_EQ(same_id, id);
+  Program *different =
+      load_program_registered(registry, other, strlen(other), &other_id);
+  ASSERT_NE(different, program);
+  ASSERT_NE(other_id, id);
+  RegistryStats stats;
+  get_registry_stats(registry, &stats);
+  ASSERT_EQ(stats.hits, 1);
+  ASSERT_EQ(stats.misses, 2);
+  ASSERT_EQ(stats.num_programs, 2);
+
+  // The shared image runs like one loaded on its own
+  System sys;
+  initialize_system(&sys);
+  attach_program(&sys, same);
+  sys.registers[ECX] = 10;
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EAX], 10);
+
+  // A third program evicts the least recently used, which stays alive for
+  // the system that holds it
+  Program *again =
+      load_program_registered(registry, other, strlen(other), NULL);
+  ASSERT_EQ(again, different);
+  Program *by_id = get_registered_program(registry, other_id);
+  ASSERT_EQ(by_id, different) << "The program should be found by its id.";
+  release_program(by_id);
+  Program *third = load_program_registered(registry, "END\n", 4, NULL);
+  get_registry_stats(registry, &stats);
+  ASSERT_EQ(stats.evictions, 1);
+  ASSERT_EQ(stats.num_programs, 2);
+  ASSERT_EQ(get_registered_program(registry, id), nullptr)
+      << "The id of an evicted program should find nothing.";
+  int reloaded_id;
+  Program *reloaded =
+      load_program_registered(registry, text, strlen(text), &reloaded_id);
+  ASSERT_NE(reloaded, program) << "The program should have been evicted.";
+  ASSERT_NE(reloaded_id, id);
+  get_registry_stats(registry, &stats);
+  ASSERT_EQ(stats.misses, 4);
+  ASSERT_EQ(stats.hits, 2);
+  reset_system(&sys);
+  sys.registers[ECX] = 3;
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EAX], 3);
+
+  for (Program *held : {program, same, different, again, third, reloaded}) {
+    release_program(held);
+  }
+
+  // Texts whose hashes collide are told apart by the text itself
+  const char *colliding = "J|GW~@z5:2fBR%nlL $2 %EDX\nEND\n";
+  const char *adding = "ADDL $1 %EAX\nMOVL $2 %EDX\nEND\n";
+  Program *first = load_program_registered(registry, colliding,
+                                           strlen(colliding), NULL);
+  Program *second =
+      load_program_registered(registry, adding, strlen(adding), NULL);
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, first) << "Colliding texts should not share an image.";
+  attach_program(&sys, second);
+  reset_system(&sys);
+  execute_instructions(&sys);
+  ASSERT_EQ(sys.registers[EAX], 1);
+  ASSERT_EQ(sys.registers[EDX], 2);
+  release_program(first);
+  release_program(second);
+  destroy_registry(registry);
+  destroy_system(&sys);
+}